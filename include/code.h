@@ -0,0 +1,81 @@
+#pragma once
+
+#include "forth.h"
+
+// One instruction of threaded code: a word and its inline operand, if any
+struct Instruction {
+	const Word *word;
+	cell operand;
+	bool hasOperand;
+	// For branches: index of the instruction the branch lands on
+	size_t target;
+	// Some branch lands on this instruction
+	bool isTarget;
+};
+
+// Decoded body of a compiled word
+class ThreadedCode {
+	private:
+		Instruction *instructions;
+		size_t count;
+		size_t capacity;
+
+		void append(const Instruction &instruction);
+	public:
+		ThreadedCode();
+		~ThreadedCode();
+
+		// Decodes the body of a compiled word up to the cell before end.
+		// Also stops at the first exit or tail call no branch jumps over, so without end
+		// the body of any word in the dictionary can be decoded.
+		// Returns false if the body is not plain threaded code.
+		bool decode(const Forth &forth, const Word *word, const cell *end = NULL);
+
+		size_t size() const;
+		const Instruction& at(size_t index) const;
+
+		// Replaces count instructions starting at index with one instruction.
+		// No branch may land inside the replaced sequence except its start.
+		void replace(size_t index, size_t count, const Word *word, cell operand);
+		// Replaces the instruction at index with the first count instructions
+		// of body, which must have no branches. Branches to index land on
+		// the first of them.
+		void splice(size_t index, const ThreadedCode &body, size_t count);
+		// Number of cells the instructions take
+		size_t cells() const;
+		// Writes the instructions as threaded code, recomputing branch offsets
+		void encode(cell *code) const;
+};
+
+// Return stack behaviour of a word. Positions are counted from the frame
+// cell of the word (position 0): its own cells are above, caller's below.
+struct ReturnEffect {
+	// Lowest position the word reads or pops
+	int lowest;
+	// Depth above the frame cell at exit
+	int exit;
+};
+
+// Follows the body and the words it calls. Returns false if the effect
+// is not known, like for words that switch the instruction pointer.
+// Calls to assumed are taken to keep the frame and balance the stack,
+// so a word can be checked together with its calls to itself.
+bool analyseReturnStack(const Forth &forth, const Word *word, const cell *end,
+	ReturnEffect *result, const Word *assumed = NULL);
+
+// Data stack behaviour of a word, like the effects recorded in words
+struct StackEffect {
+	// Values below the depth at entry the word reads or pops
+	int in;
+	// Values it leaves in their place
+	int out;
+};
+
+// Follows the body, taking the recorded effects of the words it calls.
+// Returns false if some path has no known effect, like calls to words
+// without one, leave, or paths meeting at different depths.
+bool analyseDataStack(const Forth &forth, const Word *word, const cell *end, StackEffect *result);
+
+bool hasOperand(const Word *word);
+// The operand is an offset in the code: branches, (do) and (loop)
+bool isBranch(const Word *word);
@@ -7,15 +7,81 @@
 #define MAX_WORD 32
 
 class Forth;
+class Jit;
+class Tokenizer;
 typedef intptr_t cell;
 
 typedef void (*function)(Forth&);
+// Native code produced by the JIT, returns non-zero on error
+typedef int (*nativeCode)(Forth*);
+
+// Instruction set of the direct-threaded inner interpreter.
+// Every word gets its opcode when it is added to the dictionary
+enum ForthOpcode {
+    OPCODE_PRIMITIVE,
+    OPCODE_CALL,
+    OPCODE_STOP,
+    OPCODE_EXIT,
+    OPCODE_LIT,
+    OPCODE_BRANCH,
+    OPCODE_BRANCH0,
+    OPCODE_DROP,
+    OPCODE_DUP,
+    OPCODE_SWAP,
+    OPCODE_OVER,
+    OPCODE_ADD,
+    OPCODE_SUB,
+    OPCODE_MUL,
+    OPCODE_AND,
+    OPCODE_OR,
+    OPCODE_XOR,
+    OPCODE_NOT,
+    OPCODE_EQ,
+    OPCODE_LT,
+    OPCODE_TRUE,
+    OPCODE_FALSE,
+    OPCODE_FETCH,
+    OPCODE_STORE,
+    OPCODE_RPUSH,
+    OPCODE_RPOP,
+    OPCODE_RTOP,
+    OPCODE_DO,
+    OPCODE_LOOP,
+    OPCODE_PLUS_LOOP,
+    OPCODE_LEAVE,
+    OPCODE_UNLOOP,
+    OPCODE_J,
+    // Jump to the body of the word in the operand, made of a call and exit
+    OPCODE_TAIL,
+    // Superinstructions made by the fusion pass
+    OPCODE_LIT_ADD,
+    OPCODE_LIT_SUB,
+    OPCODE_DUP_MUL,
+    OPCODE_OVER_ADD,
+    OPCODE_2DUP,
+    OPCODE_LT_NOT,
+    OPCODE_SWAP_RPUSH,
+    OPCODE_RPOP3,
+    OPCODE_LIT_SHL,
+    OPCODE_LIT_SHR,
+    OPCODE_NATIVE,
+    OPCODE_COUNT
+};
+
+enum ForthEngine {
+    FORTH_ENGINE_INDIRECT,
+    FORTH_ENGINE_DIRECT,
+    // Direct threading with the top of the data stack in a register
+    FORTH_ENGINE_CACHED
+};
 
 enum ForthResult {
     FORTH_OK,
     FORTH_EOF,
     FORTH_WORD_NOT_FOUND,
-    FORTH_BUFFER_OVERFLOW
+    FORTH_BUFFER_OVERFLOW,
+    // The instruction budget or the time ran out, resume() goes on
+    FORTH_SUSPENDED
 };
 
 class ForthException{
@@ -60,10 +126,16 @@ class ForthEmptyStackException: public ForthException {
 class Word{
 	private:
 		Word *next;
+		Word *nextInBucket;
 		bool compiled;
    		bool hidden;
 		bool immediate;
+		bool inlinable;
 		uint8_t length;
+		uint8_t opcode;
+		int8_t stackIn;
+		int8_t stackOut;
+		nativeCode native;
 
 	public:
 		Word(Word *_next=NULL, bool _compiled=false, bool _hidden=false, bool _immediate=false);
@@ -71,6 +143,9 @@ class Word{
 		Word* getNextWord() const;
 		void setNextWord(Word *newWord);
 
+		Word* getNextInBucket() const;
+		void setNextInBucket(Word *newWord);
+
 		uint8_t getNameLength() const;
 
 		const char* getName() const;
@@ -85,35 +160,147 @@ class Word{
 		void setImmediate(bool _immediate);
 		bool isImmediate() const;
 
+		// Small compiled words are copied into their callers unless opted out
+		void setInlinable(bool _inlinable);
+		bool isInlinable() const;
+
+		void setNative(nativeCode _native);
+		nativeCode getNative() const;
+
+		// Values the word takes from the data stack and leaves on it.
+		// Recorded for primitives, inferred for compiled words by ;
+		// Unknown effects are -1, so no depth is ever enough for them.
+		void setStackEffect(int in, int out);
+		int getStackIn() const { return this->stackIn; }
+		int getStackOut() const;
+		bool hasStackEffect() const;
+
+		void setOpcode(uint8_t _opcode);
+		// Used by the inner interpreters on every instruction, so inline
+		uint8_t getOpcode() const { return this->opcode; }
+
 		void* getCode();
-		const void* getConstCode() const;
+		const void* getConstCode() const {
+			return (const void*)((const uint8_t*)this +
+				(((sizeof(Word) + this->length) | (sizeof(cell) - 1)) + 1));
+		}
 		const Word* find(const char *name, uint8_t length) const;
 };
 
+#define TASK_STACK_SIZE 256
+#define TASK_RETURN_STACK_SIZE 256
+
+// Stacks and instruction pointer of a cooperative task. The VM runs one
+// task at a time in its own registers, the others are saved here.
+// Tasks form a ring with the main task, the one the VM was created with.
+struct ForthTask {
+	cell *stackBottom;
+	cell *stackPointer;
+	size_t dataSize;
+	cell *returnStackBottom;
+	cell *returnStackPointer;
+	size_t returnStackSize;
+	Word *const *executing;
+	// Threaded code a new task starts with: its word and the stop word
+	Word *start[2];
+	ForthTask *previous;
+	ForthTask *next;
+};
+
+// State of the dictionary a rollback goes back to
+struct ForthMarker {
+	Word *latest;
+	cell *freeMemory;
+};
+
 class Forth{
 	private:
 		friend void here(Forth& forth);
+		friend void number_base(Forth& forth);
+		friend class Jit;
 	    Word *const* executing;
     	cell *returnStackPointer;
 		cell *stackPointer;
 		cell *memory;
 
 		cell *freeMemory;
+		// End of the part of the arena backed by memory
+		cell *committedMemory;
 		cell *stackBottom;
 		cell *returnStackBottom;
 
 		bool compiling;
+		// Radix of numbers in the input, 2 to 36
+		cell base;
 
 		Word *latest;
 		Word *stopWord;
+
+		// Hash index of the dictionary: every bucket is a chain of words
+		// linked through nextInBucket, newest first
+		Word **index;
+		size_t indexSize;
+		size_t indexCount;
+
+		void indexWord(Word *word);
+		void rebuildIndex(size_t newSize);
+		// Drops the words after keep and the memory from end on
+		void forget(Word *keep, cell *end);
+
+		// Frozen dictionary this VM adds its words to, NULL if none.
+		// Words from sharedLatest on belong to it, the index covers own words only.
+		const Forth *shared;
+		Word *sharedLatest;
+		bool frozen;
     
 		FILE* input;
+		Tokenizer *tokenizer;
+		// Where show and diagnostics go, so every VM can have its own
+		FILE* output;
+		FILE* errors;
 
 		size_t memorySize;
 		size_t dataSize;
 		size_t returnStackSize;
+		bool hugePages;
+
+		void growMemory(size_t size, const char *cause);
+
+		// A limited run stopped before the end of its word
+		bool suspended;
+		// run() goes on after errors, see setRecovery
+		bool recovery;
+
+		ForthTask mainTask;
+		ForthTask *currentTask;
+		size_t taskCount;
+
+		void switchTask(ForthTask *task);
+		void removeTask(ForthTask *task);
+		void abortTask();
+		void endTasks();
+
+		ForthEngine engine;
+		Jit *jit;
+		bool jitEnabled;
+		bool fusionEnabled;
+		// Final calls become jumps, independent of fusion
+		bool tailCallsEnabled;
+		// Compile-time warnings, off by default
+		bool warningsEnabled;
+		// Largest body in cells the inliner copies, 0 turns it off
+		size_t inlineLimit;
+
+		void runIndirect(const Word*);
+		void runNative(const Word*);
+		void runDirect(const Word*);
+		void runCached(const Word*);
+		void create(size_t _memorySize, size_t _stackSize, size_t _returnStackSize);
 	public:
 		Forth(FILE *_input, size_t _memorySize, size_t _stackSize, size_t _returnStackSize);
+		// Lightweight VM on top of a frozen dictionary, which must outlive it.
+		// Only the stacks and the arena for new words are its own.
+		Forth(const Forth &_shared, FILE *_input, size_t _memorySize, size_t _stackSize, size_t _returnStackSize);
 		~Forth();
 		void addMachineWords();
 
@@ -128,14 +315,52 @@ class Forth{
 		int addCompiledWord(const char*, const char**);
 
 		ForthResult run();
+		// With recovery on, run() does not throw ForthException: it reports
+		// the error to errors, calls recover() and goes on with the next token
+		void setRecovery(bool enabled);
+		bool isRecoveryEnabled() const;
+		// Brings the VM back to the text interpreter after an error: both
+		// stacks are cleared, tasks other than the main one and suspended
+		// words are dropped and a word being defined is forgotten
+		void recover();
 
 		Word* getLatest() const;
+		const Word* find(const char *name, uint8_t length) const;
 
 		cell* getStackBottom() const;
 		cell* getStackPointer() const;
+		// Capacities of the stacks of the running task in cells, the sizes
+		// asked for rounded up to whole pages
+		size_t getStackSize() const;
+		size_t getReturnStackSize() const;
 
 		cell* getMemory() const;
 		cell* getFreeMemory() const;
+		// The arena holds up to getMemorySize() cells at fixed addresses,
+		// memory is committed as the dictionary grows. Huge pages apply to
+		// the chunks committed after they are enabled.
+		size_t getMemorySize() const;
+		size_t getCommittedMemory() const;
+		void setHugePages(bool enabled);
+		bool isHugePages() const;
+		// The address is in the used part of this or a shared arena
+		bool inDictionary(cell address) const;
+		// The word is in the arena of this VM and the VM is not frozen
+		bool isWritable(const Word *word) const;
+
+		// Checkpoint of the dictionary. rollback() forgets every word added
+		// after mark() and gives their memory to the next words. It costs
+		// O(words dropped): each one is the head of its bucket when it goes,
+		// so it is unlinked in O(1). Markers are two pointers, marker words
+		// in the dictionary keep no copy of the index, and a rollback works
+		// after the index has grown.
+		void mark(ForthMarker *marker) const;
+		void rollback(const ForthMarker &marker);
+
+		// No words can be added after freezing, so VMs can share the dictionary
+		void freeze();
+		bool isFrozen() const;
+		const Forth* getShared() const;
 
 		cell *getReturnStackPointer() const;
 		cell *getReturnStackBottom() const;
@@ -147,15 +372,81 @@ class Forth{
 		void pushReturn(cell);
 		cell popReturn();
 
-		void setInput(FILE*); // TODO
+		void setInput(FILE*);
 		FILE* getInput();
+		void setOutput(FILE*);
+		FILE* getOutput() const;
+		void setErrors(FILE*);
+		FILE* getErrors() const;
+		// Next token of the input as a view, valid until the next call
+		ForthResult readToken(const char **token, size_t *length);
 
 		void setCompiling(bool _compiling);
+		void setEngine(ForthEngine _engine);
+		ForthEngine getEngine() const;
+		void setJit(bool enabled);
+		bool isJitEnabled() const;
+		void setFusion(bool enabled);
+		bool isFusionEnabled() const;
+		void setTailCalls(bool enabled);
+		bool isTailCallsEnabled() const;
+		// Words taking return stack cells they did not push are reported to
+		// errors when they are compiled. Idioms like rdrop do it on purpose.
+		void setWarnings(bool enabled);
+		bool isWarningsEnabled() const;
+		void setInlineLimit(size_t cells);
+		size_t getInlineLimit() const;
+		void finishWord(Word *word);
 		void runWord(const Word*);
-		void runNumber(const char *wordBuffer, size_t length);
+		void execute(const Word*);
+		// Run at most budget instructions of the word, and at most timeout
+		// microseconds if it is not 0. Compiled words run threaded, also
+		// the ones the JIT has translated, so every instruction counts.
+		// FORTH_SUSPENDED keeps the whole state for resume(), other words
+		// can not run until then. cancel() forgets the suspended word
+		// and its return stack.
+		ForthResult runLimited(const Word *word, size_t budget, long timeout = 0);
+		ForthResult resume(size_t budget, long timeout = 0);
+		bool isSuspended() const;
+		void cancel();
+		// Numbers are read in base, or in the base of a prefix:
+		// $ hexadecimal, # decimal and % binary, then an optional minus
+		void runNumber(const char *token, size_t length);
+		void runLiteral(cell number);
+
+		// Cooperative tasks. A new task runs the word on stacks of its own
+		// and ends when the word returns. pause switches to the next task
+		// of the ring, yield runs the other tasks once from the main task,
+		// join runs them until all of them have ended. An exception in
+		// a task ends it and goes on in the main task.
+		void spawn(const Word *word, size_t _stackSize = TASK_STACK_SIZE,
+			size_t _returnStackSize = TASK_RETURN_STACK_SIZE);
+		void pause();
+		void yield();
+		void join();
+		size_t getTaskCount() const;
+		bool isMainTask() const;
+
+		// Calls from C++, see call.cpp. A word is resolved once and called
+		// with arguments and results in arrays, bottom of the stack first.
+		// callBatch makes count calls, the arrays hold count rows then.
+		// Results of the calls before a failed one are written.
+		const Word* resolve(const char *name) const;
+		void call(const Word *word, const cell *arguments, size_t argumentCount,
+			cell *results, size_t resultCount);
+		void callBatch(const Word *word, const cell *arguments, size_t argumentCount,
+			cell *results, size_t resultCount, size_t count);
+
+		// Dictionary images, see image.cpp
+		void saveImage(FILE *file) const;
+		void loadImage(FILE *file);
 };
 
-void printCell(cell c);
+void printCell(FILE *output, cell c);
+
+uint8_t findOpcode(const function handler);
+function findHandler(uint8_t opcode);
+bool hasDirectEngine();
 
 ForthResult readWord(FILE* source,
     char* buffer, size_t bufferSize, size_t* length);
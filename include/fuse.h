@@ -0,0 +1,37 @@
+#pragma once
+
+#include "forth.h"
+
+#define FUSION_MAX_LENGTH 3
+
+// Superinstruction: a primitive doing the work of a sequence of primitives.
+// The sequence is given by the opcodes of its words. At most one of them
+// may be a literal, its operand becomes the operand of the superinstruction.
+struct Fusion {
+	const char *name;
+	function handler;
+	uint8_t length;
+	uint8_t sequence[FUSION_MAX_LENGTH];
+	// Data stack effect of the whole sequence
+	int8_t in;
+	int8_t out;
+};
+
+// Adds the superinstructions to the dictionary
+void addFusedWords(Forth &forth);
+// Table of all superinstructions
+const Fusion* getFusions(size_t *count);
+// Fusion whose superinstruction has the given handler, NULL if none
+const Fusion* findFusion(const function handler);
+// Rewrites the body of a compiled word ending at end.
+// Returns the new end of the body.
+cell* fuseWord(const Forth &forth, Word *word, cell *end);
+// Folds arithmetic on literals in the body of a compiled word ending at end
+// and replaces operations with literals by cheaper ones. Returns the new end.
+cell* foldConstants(const Forth &forth, Word *word, cell *end);
+// Copies the bodies of small compiled words into the body of a compiled
+// word ending at end, using at most room cells after it. Returns the new end.
+cell* inlineCalls(const Forth &forth, Word *word, cell *end, size_t room);
+// Turns calls followed by exit in the body of a compiled word ending at end
+// into tail calls, using at most room cells after it. Returns the new end.
+cell* tailCalls(const Forth &forth, Word *word, cell *end, size_t room);
@@ -0,0 +1,48 @@
+#pragma once
+
+#include "forth.h"
+
+enum JitError {
+	JIT_ERROR_NONE,
+	JIT_ERROR_GENERIC,
+	JIT_ERROR_WORD_PROPERTY,
+	JIT_ERROR_ILLEGAL_ARGUMENT,
+	JIT_ERROR_OUT_OF_MEMORY,
+	JIT_ERROR_ILLEGAL_STATE,
+	JIT_ERROR_EMPTY_STACK
+};
+
+// Block of executable memory, native code is bump-allocated in it
+struct JitRegion {
+	JitRegion *next;
+	size_t size;
+	size_t used;
+};
+
+// Template JIT translating compiled words to x86-64 machine code.
+// Native code keeps the VM conventions: it works on the Forth data stack,
+// pushes a frame cell to the return stack on entry and pops it at exit.
+// Exceptions never cross native frames: primitives are called through a
+// trampoline which stores the exception, native code returns non-zero
+// and the exception is thrown again by raise().
+class Jit {
+	private:
+		JitRegion *regions;
+		JitError error;
+		const char *cause;
+
+		void* allocate(size_t size);
+	public:
+		Jit();
+		~Jit();
+
+		// Translates a compiled word. Returns false (and leaves the word
+		// to the threaded interpreter) if the word can not be translated.
+		// end is the cell after the body, NULL if not known.
+		bool compile(Forth &forth, Word *word, const cell *end = NULL);
+
+		void setError(JitError _error, const char *_cause);
+		void raise();
+};
+
+bool hasJit();
@@ -0,0 +1,29 @@
+#pragma once
+
+#include <stdio.h>
+
+#include "forth.h"
+
+// How the VMs of the scripts are made
+struct JobSettings {
+	size_t memorySize;
+	size_t stackSize;
+	size_t returnStackSize;
+	ForthEngine engine;
+	bool jit;
+	bool fusion;
+	// Dictionary arenas are backed by huge pages where possible
+	bool hugePages;
+	// Image every VM starts from, NULL for the machine words
+	const char *image;
+
+	JobSettings(size_t _memorySize, size_t _stackSize, size_t _returnStackSize);
+};
+
+// Runs every script in a VM of its own on a pool of worker threads.
+// The VMs share one frozen dictionary made from the settings.
+// The output of every script, diagnostics included, is captured and
+// written to output in the order of the scripts, each as soon as it and
+// all scripts before it are done. Returns the number of failed scripts.
+size_t runJobs(const JobSettings &settings, const char *const *scripts, size_t count,
+	unsigned workers, FILE *output);
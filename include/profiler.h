@@ -0,0 +1,47 @@
+#pragma once
+
+#include <stdio.h>
+
+#include "forth.h"
+
+#define PROFILER_BUFFER (1 << 20)
+#define PROFILER_DEPTH 64
+#define PROFILER_RATE 997
+
+// Sampling profiler for Forth words.
+// A SIGPROF timer copies the instruction pointer and the return stack of
+// the VM into a buffer, the samples are mapped to words only when they are
+// written, as collapsed stacks ("outer;inner;leaf count") for flamegraph tools.
+// Nothing is done by the VM itself, so there is no cost when it is off.
+// The direct and cached engines store the instruction pointer only around
+// primitives and native code does not at all, so the innermost word is exact
+// with the indirect engine only. One profiler can run at a time.
+class Profiler {
+	private:
+		const Forth *forth;
+		// Samples one after another: depth, instruction pointer, return stack
+		cell *buffer;
+		volatile size_t used;
+		volatile size_t samples;
+		volatile size_t dropped;
+		bool running;
+
+		size_t collapse(const cell *sample, Word **words, size_t count, char *line) const;
+	public:
+		Profiler(const Forth &_forth);
+		~Profiler();
+
+		void start(unsigned rate = PROFILER_RATE);
+		void stop();
+		bool isRunning() const;
+
+		// Takes a sample now, also called from the signal handler
+		void sample();
+		size_t getSamples() const;
+		// Samples lost because the buffer was full
+		size_t getDropped() const;
+
+		void write(FILE *output) const;
+};
+
+bool hasProfiler();
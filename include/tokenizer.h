@@ -0,0 +1,44 @@
+#pragma once
+
+#include <stdio.h>
+
+#include "forth.h"
+
+// Splits the input into whitespace separated tokens.
+// Regular files are memory-mapped, other streams are read in large blocks.
+// Tokens are returned as views into the mapping or the buffer, they stay
+// valid until the next call to next() or open().
+class Tokenizer {
+	private:
+		FILE *input;
+		// Text being scanned: the mapping or the buffer
+		const char *data;
+		size_t size;
+		size_t position;
+
+		void *mapping;
+		size_t mappingSize;
+		char *buffer;
+		size_t capacity;
+		bool end;
+
+		void close();
+		bool map();
+		bool refill(size_t keep);
+	public:
+		Tokenizer();
+		~Tokenizer();
+
+		// Starts reading from the current position of the stream
+		void open(FILE *_input);
+		FILE* getInput() const;
+		bool isMapped() const;
+
+		// The next token can be read without waiting for the input.
+		// Skips the whitespace before it.
+		bool isReady();
+
+		// Tokens longer than maxLength are skipped
+		// and reported with FORTH_BUFFER_OVERFLOW
+		ForthResult next(const char **token, size_t *length, size_t maxLength);
+};
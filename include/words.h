@@ -2,6 +2,19 @@
 
 #include "forth.h"
 
+// Primitive word of the base dictionary
+struct Primitive {
+	const char *name;
+	function handler;
+	bool immediate;
+	// Values taken from and left on the data stack, -1 if not fixed
+	int8_t in;
+	int8_t out;
+};
+
+// Primitives added by Forth::addMachineWords
+const Primitive* getPrimitives(size_t *count);
+
 void drop(Forth &forth);
 void _dup(Forth &forth);
 void add(Forth &forth);
@@ -26,26 +39,66 @@ void _eq(Forth &forth);
 void within(Forth &forth);
 
 void forth_exit(Forth &forth);
+void tail_call(Forth &forth);
 void literal(Forth &forth);
 void compile_start(Forth &forth);
 void compile_end(Forth &forth);
+void recurse(Forth &forth);
+void marker(Forth &forth);
+void forget(Forth &forth);
 
 void rpush(Forth &forth);
 void rpop(Forth &forth);
 void rtop(Forth &forth);
 void rshow(Forth &forth);
 
+void forth_do(Forth &forth);
+void forth_loop(Forth &forth);
+void forth_plus_loop(Forth &forth);
+void forth_leave(Forth &forth);
+void forth_unloop(Forth &forth);
+void forth_j(Forth &forth);
+
 void memory_read(Forth &forth);
 void memory_write(Forth &forth);
 void here(Forth &forth);
+void number_base(Forth &forth);
 void branch(Forth &forth);
 void branch0(Forth &forth);
 void immediate(Forth &forth);
+void no_inline(Forth &forth);
 
 void next_word(Forth &forth);
 void find(Forth &forth);
 void _word_code(Forth &forth);
 void comma(Forth &forth);
 
+void lit_add(Forth &forth);
+void lit_sub(Forth &forth);
+void dup_mul(Forth &forth);
+void over_add(Forth &forth);
+void two_dup(Forth &forth);
+void lt_not(Forth &forth);
+void swap_rpush(Forth &forth);
+void rpop3(Forth &forth);
+void lit_shl(Forth &forth);
+void lit_shr(Forth &forth);
+
+void array_fill(Forth &forth);
+void array_move(Forth &forth);
+void array_sum(Forth &forth);
+void array_min(Forth &forth);
+void array_max(Forth &forth);
+void array_dot(Forth &forth);
+void array_add(Forth &forth);
+void array_mul(Forth &forth);
+void arrays_add(Forth &forth);
+void arrays_mul(Forth &forth);
+void array_scan(Forth &forth);
+
+void task_spawn(Forth &forth);
+void task_pause(Forth &forth);
+void task_join(Forth &forth);
+
 void next(Forth &forth);
 void interpreter_stub(Forth &forth);
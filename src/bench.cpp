@@ -0,0 +1,549 @@
+#ifdef _POSIX_C_SOURCE
+#undef _POSIX_C_SOURCE
+#endif
+#define _POSIX_C_SOURCE 200809L
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+
+#include "forth.h"
+#include "jit.h"
+#include "tokenizer.h"
+#include "words.h"
+
+#define DICTIONARY_WORDS 100000
+#define SOURCE_LINES 400000
+#define COMPILE_WORDS 20000
+#define MAX_DATA 16384
+#define MAX_STACK 16384
+#define MAX_RETURN 16384
+#define STARTUP_RUNS 200
+#define SHARED_VMS 500
+#define SHARED_DATA 1024
+#define TASKS 1000
+#define LIMITED_SLICE 10000
+#define CALLS 1000000
+#define CALL_TEXT_RUNS 100000
+#define ARRAY_CELLS 100000
+#define ARRAY_RUNS 100
+#define NUMBER_LINES 200000
+
+// Benchmarks print one tab separated line each, after a header line.
+// The columns stay the same between versions, so runs can be compared:
+// name, operations, ns per operation, operations per second,
+// ns per executed Forth word, MB/s of source and peak resident memory.
+// Values that do not apply to a benchmark are "-".
+// Every benchmark runs in its own process, so the peak memory is its own.
+
+static double now(){
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+static long peak_memory(){
+	struct rusage usage;
+	if(getrusage(RUSAGE_SELF, &usage))
+		return -1;
+	// Kilobytes on Linux
+	return usage.ru_maxrss;
+}
+
+// words and bytes are 0 when they do not apply
+static void report_full(const char *name, size_t ops, double seconds, size_t words, size_t bytes){
+	printf("%s\t%lu\t%.2f\t%.0f\t", name, (unsigned long)ops, seconds * 1e9 / ops, ops / seconds);
+	if(words)
+		printf("%.2f\t", seconds * 1e9 / words);
+	else
+		printf("-\t");
+	if(bytes)
+		printf("%.1f\t", bytes / seconds / (1024 * 1024));
+	else
+		printf("-\t");
+	printf("%ld\n", peak_memory());
+}
+
+static void report(const char *name, size_t ops, double seconds){
+	report_full(name, ops, seconds, 0, 0);
+}
+
+// Runs a benchmark in a child process
+static void isolate(void (*bench)(const void*), const void *argument){
+	pid_t child;
+	fflush(stdout);
+	child = fork();
+	if(child < 0){
+		bench(argument);
+		return;
+	}
+	if(child == 0){
+		bench(argument);
+		fflush(stdout);
+		_exit(0);
+	}
+	waitpid(child, NULL, 0);
+}
+
+// Writes the text to the descriptor from a child process, then closes it
+static pid_t write_child(int descriptor, const char *text, size_t size){
+	pid_t child = fork();
+	if(child != 0)
+		return child;
+	while(size){
+		ssize_t written = write(descriptor, text, size);
+		if(written <= 0)
+			break;
+		text += written;
+		size -= (size_t)written;
+	}
+	close(descriptor);
+	_exit(0);
+}
+
+// Split a generated source file into tokens: fgetc based readWord,
+// the tokenizer on a mapped file, on a memory stream and on a pipe
+static void bench_tokenizer(const void*){
+	FILE *file = tmpfile();
+	char *text;
+	size_t size, tokens;
+	char buffer[MAX_WORD + 1];
+	const char *token;
+	size_t length;
+	double start;
+	Tokenizer tokenizer;
+	FILE *stream;
+	int descriptors[2];
+	pid_t writer;
+	if(!file)
+		return;
+	for(size_t i = 0; i < SOURCE_LINES; i++)
+		fprintf(file, ": word%lu dup 1 + swap over * drop ;\n", (unsigned long)i);
+	size = (size_t)ftell(file);
+
+	rewind(file);
+	start = now();
+	for(tokens = 0; readWord(file, buffer, sizeof(buffer), &length) == FORTH_OK; tokens++);
+	report_full("tokenize-readword", tokens, now() - start, tokens, size);
+
+	rewind(file);
+	start = now();
+	tokenizer.open(file);
+	for(tokens = 0; tokenizer.next(&token, &length, MAX_WORD) == FORTH_OK; tokens++);
+	report_full(tokenizer.isMapped() ? "tokenize-mmap" : "tokenize-file", tokens, now() - start, tokens, size);
+
+	text = new char[size];
+	rewind(file);
+	if(fread(text, 1, size, file) != size)
+		size = 0;
+	if(size && (stream = fmemopen(text, size, "r"))){
+		start = now();
+		tokenizer.open(stream);
+		for(tokens = 0; tokenizer.next(&token, &length, MAX_WORD) == FORTH_OK; tokens++);
+		report_full("tokenize-memory", tokens, now() - start, tokens, size);
+		tokenizer.open(NULL);
+		fclose(stream);
+	}
+	// Pipes are read from the descriptor, as the data comes
+	if(size && pipe(descriptors) == 0){
+		writer = write_child(descriptors[1], text, size);
+		close(descriptors[1]);
+		stream = fdopen(descriptors[0], "r");
+		if(writer > 0 && stream){
+			start = now();
+			tokenizer.open(stream);
+			for(tokens = 0; tokenizer.next(&token, &length, MAX_WORD) == FORTH_OK; tokens++);
+			report_full("tokenize-pipe", tokens, now() - start, tokens, size);
+			tokenizer.open(NULL);
+		}
+		if(stream)
+			fclose(stream);
+		else
+			close(descriptors[0]);
+		if(writer > 0)
+			waitpid(writer, NULL, 0);
+	}
+	delete [] text;
+	tokenizer.open(NULL);
+	fclose(file);
+}
+
+// Define DICTIONARY_WORDS codewords, then look every one of them up
+static void bench_dictionary(const void*){
+	static char names[DICTIONARY_WORDS][8];
+	size_t found = 0;
+	double start;
+	Forth forth(stdin, DICTIONARY_WORDS * 8, 16, 16);
+
+	for(size_t i = 0; i < DICTIONARY_WORDS; i++)
+		sprintf(names[i], "w%lu", (unsigned long)i);
+
+	start = now();
+	for(size_t i = 0; i < DICTIONARY_WORDS; i++)
+		forth.addCodeword(names[i], drop);
+	report("dictionary-define", DICTIONARY_WORDS, now() - start);
+
+	start = now();
+	for(size_t i = 0; i < DICTIONARY_WORDS; i++){
+		if(forth.find(names[i], strlen(names[i])))
+			found += 1;
+	}
+	report("dictionary-find", DICTIONARY_WORDS, now() - start);
+	if(found != DICTIONARY_WORDS)
+		fprintf(stderr, "dictionary-find: %lu words missing\n", (unsigned long)(DICTIONARY_WORDS - found));
+}
+
+static void load(Forth &forth, const char *path){
+	FILE *in = fopen(path, "r");
+	if(!in){
+		fprintf(stderr, "Unable to open file %s!\n", path);
+		return;
+	}
+	forth.setInput(in);
+	forth.run();
+	fclose(in);
+}
+
+static void load_text(Forth &forth, const char *text, size_t size){
+	FILE *in = fmemopen((void*)(cell)text, size, "r");
+	if(!in)
+		return;
+	forth.setInput(in);
+	forth.run();
+	forth.setInput(stdin);
+	fclose(in);
+}
+
+// Compile COMPILE_WORDS definitions, ns/word is per token of the source
+static void bench_compile(const void*){
+	Forth forth(stdin, COMPILE_WORDS * 16 + MAX_DATA, MAX_STACK, MAX_RETURN);
+	char *text = new char[COMPILE_WORDS * 64];
+	size_t size = 0;
+	double start;
+	forth.addMachineWords();
+	load(forth, "stdlib.fth");
+	for(size_t i = 0; i < COMPILE_WORDS; i++)
+		size += (size_t)sprintf(text + size, ": word%lu dup 1 + swap over * drop ;\n", (unsigned long)i);
+	start = now();
+	load_text(forth, text, size);
+	report_full("compile", COMPILE_WORDS, now() - start, COMPILE_WORDS * 10, size);
+	delete [] text;
+}
+
+// Start a VM with stdlib.fth from source and from an image of it
+// Data files are mostly literals: interpret lines of numbers
+static void bench_numbers(const void*){
+	Forth forth(stdin, MAX_DATA, MAX_STACK, MAX_RETURN);
+	char *text = new char[NUMBER_LINES * 64];
+	size_t size = 0;
+	double start;
+	forth.addMachineWords();
+	for(size_t i = 0; i < NUMBER_LINES; i++)
+		size += (size_t)sprintf(text + size, "%lu -%lu 4096 %lu drop drop drop drop\n",
+			(unsigned long)i * 7919, (unsigned long)i, (unsigned long)i * 31 + 100000);
+	start = now();
+	load_text(forth, text, size);
+	report_full("interpret-numbers", NUMBER_LINES * 4, now() - start, NUMBER_LINES * 8, size);
+	delete [] text;
+}
+
+static void bench_startup(const void*){
+	FILE *image = tmpfile();
+	double start;
+	{
+		Forth forth(stdin, MAX_DATA, MAX_STACK, MAX_RETURN);
+		forth.addMachineWords();
+		load(forth, "stdlib.fth");
+		forth.saveImage(image);
+	}
+	start = now();
+	for(size_t i = 0; i < STARTUP_RUNS; i++){
+		Forth forth(stdin, MAX_DATA, MAX_STACK, MAX_RETURN);
+		forth.addMachineWords();
+		load(forth, "stdlib.fth");
+	}
+	report("startup-source", STARTUP_RUNS, now() - start);
+	start = now();
+	for(size_t i = 0; i < STARTUP_RUNS; i++){
+		Forth forth(stdin, MAX_DATA, MAX_STACK, MAX_RETURN);
+		rewind(image);
+		forth.loadImage(image);
+	}
+	report("startup-image", STARTUP_RUNS, now() - start);
+	fclose(image);
+}
+
+// Many VMs at once, each with its own copy of stdlib.fth
+// or all sharing one frozen dictionary with it
+static void bench_vms(const void *argument){
+	bool shared = *(const bool*)argument;
+	Forth base(stdin, MAX_DATA, MAX_STACK, MAX_RETURN);
+	Forth *vms[SHARED_VMS];
+	double start;
+	base.addMachineWords();
+	load(base, "stdlib.fth");
+	base.freeze();
+	start = now();
+	for(size_t i = 0; i < SHARED_VMS; i++){
+		if(shared)
+			vms[i] = new Forth(base, stdin, SHARED_DATA, MAX_STACK / 16, MAX_RETURN / 16);
+		else {
+			vms[i] = new Forth(stdin, MAX_DATA, MAX_STACK / 16, MAX_RETURN / 16);
+			vms[i]->addMachineWords();
+			load(*vms[i], "stdlib.fth");
+		}
+	}
+	report(shared ? "vms-shared" : "vms-private", SHARED_VMS, now() - start);
+	for(size_t i = 0; i < SHARED_VMS; i++)
+		delete vms[i];
+}
+
+// Round robin over many tasks that only pause
+static void bench_tasks(const void*){
+	static const char *program = ": worker 1000 1 do pause loop ; ";
+	Forth forth(stdin, MAX_DATA, MAX_STACK, MAX_RETURN);
+	const Word *worker;
+	double start;
+	forth.addMachineWords();
+	load(forth, "stdlib.fth");
+	load_text(forth, program, strlen(program));
+	if(hasDirectEngine())
+		forth.setEngine(FORTH_ENGINE_DIRECT);
+	worker = forth.find("worker", 6);
+	if(!worker)
+		return;
+	try{
+		for(size_t i = 0; i < TASKS; i++)
+			forth.spawn(worker, 16, 16);
+	} catch(ForthException &e){
+		fprintf(stderr, "task-switch: %s\n", e.getCause());
+		return;
+	}
+	start = now();
+	forth.join();
+	report("task-switch", TASKS * 1000, now() - start);
+}
+
+// Programs for the inner interpreters: words defined by source
+// and run once, ops counts the iterations of their main loop
+struct Workload {
+	const char *name;
+	const char *source;
+	const char *word;
+	size_t ops;
+};
+
+static const Workload workloads[] = {
+	// fib2 of n loops n + 1 times for n in 0..2000
+	{ "fib2", "", "fib2-bench", 2001 * 2002 / 2 },
+	{ "loop", ": bench-loop 0 1000000 1 do i + loop drop ;",
+		"bench-loop", 1000000 },
+	{ "nested-loop", ": bench-nested 0 1000 1 do 1000 1 do i j + + loop loop drop ;",
+		"bench-nested", 1000000 },
+	{ "rstack", ": bench-rstack 1000000 1 do 1 >r 2 >r r> r> + drop loop ;",
+		"bench-rstack", 1000000 },
+	{ "memory", ": bench-memory here @ 0 , 1000000 1 do dup @ 1 + over ! loop @ drop ;",
+		"bench-memory", 1000000 },
+	// Calls nested four deep, 15 calls per iteration
+	{ "calls", ": c1 1 + ; : c2 c1 c1 ; : c3 c2 c2 ; : c4 c3 c3 ; "
+		": bench-calls 0 250000 1 do c4 loop drop ;", "bench-calls", 250000 },
+	// Literal arithmetic, folded and turned into shifts unless unfused
+	{ "constants", ": bench-constants 0 1000000 1 do i 8 * 4 / 2 3 * + + loop drop ;",
+		"bench-constants", 1000000 }
+};
+
+#define WORKLOAD_COUNT (sizeof(workloads) / sizeof(workloads[0]))
+
+// Inner interpreter a workload runs with
+struct Engine {
+	const char *name;
+	ForthEngine engine;
+	bool jit;
+	bool fusion;
+};
+
+static const Engine engines[] = {
+	{ "indirect-unfused", FORTH_ENGINE_INDIRECT, false, false },
+	{ "indirect", FORTH_ENGINE_INDIRECT, false, true },
+	{ "direct-unfused", FORTH_ENGINE_DIRECT, false, false },
+	{ "direct", FORTH_ENGINE_DIRECT, false, true },
+	{ "cached", FORTH_ENGINE_CACHED, false, true },
+	{ "jit", FORTH_ENGINE_DIRECT, true, true }
+};
+
+#define ENGINE_COUNT (sizeof(engines) / sizeof(engines[0]))
+
+struct Dispatch {
+	const Workload *workload;
+	const Engine *engine;
+};
+
+static const Word* prepare(Forth &forth, const Workload &workload){
+	forth.addMachineWords();
+	load(forth, "stdlib.fth");
+	load_text(forth, workload.source, strlen(workload.source));
+	return forth.find(workload.word, strlen(workload.word));
+}
+
+// Same loop as the indirect interpreter, counting the executed words
+static size_t count_words(Forth &forth, const Word *word){
+	Word *const stop = *forth.getInstructionPointer();
+	size_t count = 0;
+	do{
+		count += 1;
+		if(*forth.getInstructionPointer() != stop)
+			forth.rewindInstructionPointer(1);
+		if(!word->isCompiled()){
+			const function code = *(const function*)word->getConstCode();
+			code(forth);
+		} else{
+			forth.pushReturn((cell)forth.getInstructionPointer());
+			forth.setInstructionPointer((Word**)(cell)word->getConstCode());
+		}
+		word = *forth.getInstructionPointer();
+	} while(word != stop);
+	return count;
+}
+
+static void bench_dispatch(const void *argument){
+	const Dispatch *dispatch = (const Dispatch*)argument;
+	const Workload &workload = *dispatch->workload;
+	const Engine &engine = *dispatch->engine;
+	char name[64];
+	size_t words;
+	double start;
+	const Word *word;
+	if((engine.jit && !hasJit()) || (engine.engine != FORTH_ENGINE_INDIRECT && !hasDirectEngine()))
+		return;
+	{
+		// Words of the source program, without superinstructions
+		Forth counter(stdin, MAX_DATA, MAX_STACK, MAX_RETURN);
+		counter.setFusion(false);
+		word = prepare(counter, workload);
+		if(!word){
+			fprintf(stderr, "%s: word %s not found\n", workload.name, workload.word);
+			return;
+		}
+		words = count_words(counter, word);
+	}
+	Forth forth(stdin, MAX_DATA, MAX_STACK, MAX_RETURN);
+	forth.setJit(engine.jit);
+	forth.setFusion(engine.fusion);
+	word = prepare(forth, workload);
+	forth.setEngine(engine.engine);
+	start = now();
+	forth.runWord(word);
+	sprintf(name, "%s-%s", workload.name, engine.name);
+	report_full(name, workload.ops, now() - start, words, 0);
+}
+
+// The loop workload run in slices of a limited number of instructions,
+// compare with loop-indirect
+static void bench_limited(const void*){
+	const Workload &workload = workloads[1];
+	Forth forth(stdin, MAX_DATA, MAX_STACK, MAX_RETURN);
+	const Word *word = prepare(forth, workload);
+	double start;
+	if(!word)
+		return;
+	start = now();
+	ForthResult result = forth.runLimited(word, LIMITED_SLICE);
+	while(result == FORTH_SUSPENDED)
+		result = forth.resume(LIMITED_SLICE);
+	report("loop-limited", workload.ops, now() - start);
+}
+
+// A small word evaluated from C++: through the text interpreter,
+// one call at a time and in batches
+static void bench_call(const void*){
+	static const char *program = ": score dup * 3 + ; ";
+	Forth forth(stdin, MAX_DATA, MAX_STACK, MAX_RETURN);
+	const Word *score;
+	cell *inputs = new cell[CALLS], *outputs = new cell[CALLS];
+	char *text = new char[CALL_TEXT_RUNS * 32];
+	size_t size = 0;
+	double start;
+	forth.addMachineWords();
+	load(forth, "stdlib.fth");
+	load_text(forth, program, strlen(program));
+	if(hasDirectEngine())
+		forth.setEngine(FORTH_ENGINE_DIRECT);
+	score = forth.resolve("score");
+	for(size_t i = 0; i < CALLS; i++)
+		inputs[i] = (cell)i;
+
+	for(size_t i = 0; i < CALL_TEXT_RUNS; i++)
+		size += sprintf(text + size, "%lu score drop ", (unsigned long)i);
+	start = now();
+	load_text(forth, text, size);
+	report("call-text", CALL_TEXT_RUNS, now() - start);
+
+	start = now();
+	for(size_t i = 0; i < CALLS; i++)
+		forth.call(score, inputs + i, 1, outputs + i, 1);
+	report("call-single", CALLS, now() - start);
+
+	start = now();
+	forth.callBatch(score, inputs, 1, outputs, 1, CALLS);
+	report("call-batch", CALLS, now() - start);
+	delete [] text;
+	delete [] outputs;
+	delete [] inputs;
+}
+
+// Sum of an array by an interpreted loop and by array-sum
+static void bench_arrays(const void*){
+	Forth forth(stdin, MAX_DATA, MAX_STACK, MAX_RETURN);
+	cell *data = new cell[ARRAY_CELLS];
+	char program[256];
+	const Word *loop, *word;
+	double start;
+	for(size_t i = 0; i < ARRAY_CELLS; i++)
+		data[i] = (cell)i;
+	forth.addMachineWords();
+	load(forth, "stdlib.fth");
+	sprintf(program, ": sum-loop 0 %ld %ld do i @ + %d +loop drop ; : sum-word %ld %d array-sum drop ;",
+		(long)(cell)(data + ARRAY_CELLS - 1), (long)(cell)data, (int)sizeof(cell),
+		(long)(cell)data, ARRAY_CELLS);
+	load_text(forth, program, strlen(program));
+	if(hasDirectEngine())
+		forth.setEngine(FORTH_ENGINE_DIRECT);
+	loop = forth.find("sum-loop", 8);
+	word = forth.find("sum-word", 8);
+	if(loop && word){
+		start = now();
+		for(size_t i = 0; i < ARRAY_RUNS; i++)
+			forth.runWord(loop);
+		report("array-sum-loop", ARRAY_CELLS * ARRAY_RUNS, now() - start);
+		start = now();
+		for(size_t i = 0; i < ARRAY_RUNS; i++)
+			forth.runWord(word);
+		report("array-sum", ARRAY_CELLS * ARRAY_RUNS, now() - start);
+	}
+	delete [] data;
+}
+
+int main(){
+	const bool privateVms = false, sharedVms = true;
+	printf("benchmark\tops\tns_per_op\tops_per_sec\tns_per_word\tmb_per_sec\tpeak_kb\n");
+	isolate(bench_dictionary, NULL);
+	isolate(bench_tokenizer, NULL);
+	isolate(bench_compile, NULL);
+	isolate(bench_numbers, NULL);
+	isolate(bench_startup, NULL);
+	isolate(bench_vms, &privateVms);
+	isolate(bench_vms, &sharedVms);
+	isolate(bench_tasks, NULL);
+	isolate(bench_limited, NULL);
+	isolate(bench_call, NULL);
+	isolate(bench_arrays, NULL);
+	for(size_t i = 0; i < WORKLOAD_COUNT; i++){
+		for(size_t j = 0; j < ENGINE_COUNT; j++){
+			Dispatch dispatch = { &workloads[i], &engines[j] };
+			isolate(bench_dispatch, &dispatch);
+		}
+	}
+	return 0;
+}
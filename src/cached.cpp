@@ -0,0 +1,442 @@
+#include <stddef.h>
+
+#include "forth.h"
+
+// Direct-threaded inner interpreter with the top of the data stack cached.
+// The instruction pointer, the stack pointer and the top of the stack are
+// locals (registers after optimisation). Memory holds the stack below the
+// top: stackPointer[-1] is stale while the top is cached. It is written
+// back (spilled) before anything else can look at the stack: handlers of
+// primitives without an opcode, native code, exceptions and the return
+// to the caller. So push, pop, top and show see a consistent stack.
+//
+// The cell below stackBottom is scratch: an empty stack spills and fills
+// it, so neither needs a check.
+
+#ifdef __GNUC__
+
+#define LABEL(name) (__extension__ &&name)
+#define DISPATCH() __extension__ ({ goto *table[word->getOpcode()]; })
+#define NEXT() do { word = *ip++; DISPATCH(); } while(0)
+
+#define SPILL() do { sp[-1] = tos; this->stackPointer = sp; } while(0)
+#define FILL() do { sp = this->stackPointer; tos = sp[-1]; } while(0)
+#define THROW(exception) do { SPILL(); this->executing = ip; throw exception; } while(0)
+
+// Pushes are not checked, the guard page above each stack faults on the
+// first write past the top, a push or a spill after tos
+#define NEED(n) if(sp - bottom < (n)) goto underflow
+// Operations with a depth check have an unchecked variant starting after it,
+// see ENTER in direct.cpp
+#define NEED_UNCHECKED(n, name) NEED(n); name:
+#define ENTER(called) \
+	table = (size_t)(sp - bottom) >= (size_t)(called)->getStackIn() ? unchecked : labels
+#define FRAME(n) if(this->returnStackPointer - this->returnStackBottom < (n)) goto no_frame
+#define PUSH(value) do { a = (value); sp[-1] = tos; tos = a; sp += 1; } while(0)
+
+void Forth::runCached(const Word *word){
+	static void *const labels[OPCODE_COUNT] = {
+		LABEL(op_primitive),
+		LABEL(op_call),
+		LABEL(op_stop),
+		LABEL(op_exit),
+		LABEL(op_lit),
+		LABEL(op_branch),
+		LABEL(op_branch0),
+		LABEL(op_drop),
+		LABEL(op_dup),
+		LABEL(op_swap),
+		LABEL(op_over),
+		LABEL(op_add),
+		LABEL(op_sub),
+		LABEL(op_mul),
+		LABEL(op_and),
+		LABEL(op_or),
+		LABEL(op_xor),
+		LABEL(op_not),
+		LABEL(op_eq),
+		LABEL(op_lt),
+		LABEL(op_true),
+		LABEL(op_false),
+		LABEL(op_fetch),
+		LABEL(op_store),
+		LABEL(op_rpush),
+		LABEL(op_rpop),
+		LABEL(op_rtop),
+		LABEL(op_do),
+		LABEL(op_loop),
+		LABEL(op_plus_loop),
+		LABEL(op_leave),
+		LABEL(op_unloop),
+		LABEL(op_j),
+		LABEL(op_tail),
+		LABEL(op_lit_add),
+		LABEL(op_lit_sub),
+		LABEL(op_dup_mul),
+		LABEL(op_over_add),
+		LABEL(op_2dup),
+		LABEL(op_lt_not),
+		LABEL(op_swap_rpush),
+		LABEL(op_rpop3),
+		LABEL(op_lit_shl),
+		LABEL(op_lit_shr),
+		LABEL(op_native)
+	};
+	// Operations without their depth checks, for words whose stack effect
+	// is known and whose callers leave enough values for it
+	static void *const unchecked[OPCODE_COUNT] = {
+		LABEL(op_primitive),
+		LABEL(op_call),
+		LABEL(op_stop),
+		LABEL(op_exit),
+		LABEL(op_lit),
+		LABEL(op_branch),
+		LABEL(u_branch0),
+		LABEL(u_drop),
+		LABEL(u_dup),
+		LABEL(u_swap),
+		LABEL(u_over),
+		LABEL(u_add),
+		LABEL(u_sub),
+		LABEL(u_mul),
+		LABEL(u_and),
+		LABEL(u_or),
+		LABEL(u_xor),
+		LABEL(u_not),
+		LABEL(u_eq),
+		LABEL(u_lt),
+		LABEL(op_true),
+		LABEL(op_false),
+		LABEL(u_fetch),
+		LABEL(u_store),
+		LABEL(u_rpush),
+		LABEL(op_rpop),
+		LABEL(op_rtop),
+		LABEL(u_do),
+		LABEL(op_loop),
+		LABEL(u_plus_loop),
+		LABEL(op_leave),
+		LABEL(op_unloop),
+		LABEL(op_j),
+		LABEL(op_tail),
+		LABEL(u_lit_add),
+		LABEL(u_lit_sub),
+		LABEL(u_dup_mul),
+		LABEL(u_over_add),
+		LABEL(u_2dup),
+		LABEL(u_lt_not),
+		LABEL(u_swap_rpush),
+		LABEL(op_rpop3),
+		LABEL(u_lit_shl),
+		LABEL(u_lit_shr),
+		LABEL(op_native)
+	};
+	void *const *table = labels;
+	Word *const *ip = this->executing;
+	// Reloaded after primitives, pause switches to the stacks of another task
+	cell *bottom = this->stackBottom;
+	cell *sp;
+	cell tos;
+	cell a;
+
+	FILL();
+	if(*ip != this->stopWord)
+		ip += 1;
+	if(word == this->stopWord)
+		goto op_primitive;
+	DISPATCH();
+
+op_primitive:
+	SPILL();
+	this->executing = ip;
+	(*(const function*)word->getConstCode())(*this);
+	ip = this->executing;
+	bottom = this->stackBottom;
+	FILL();
+	NEXT();
+
+op_call:
+	*this->returnStackPointer++ = (cell)ip;
+	ip = (Word *const*)word->getConstCode();
+	ENTER(word);
+	NEXT();
+
+op_stop:
+	SPILL();
+	this->executing = ip - 1;
+	return;
+
+op_exit:
+	if(this->returnStackPointer == this->returnStackBottom)
+		THROW(ForthEmptyStackException("popReturn: return stack empty"));
+	ip = (Word *const*)*--this->returnStackPointer;
+	table = labels;
+	NEXT();
+
+op_lit:
+	PUSH(*(const cell*)ip);
+	ip += 1;
+	NEXT();
+
+op_branch:
+	ip += *(const cell*)ip / (cell)sizeof(cell);
+	NEXT();
+
+op_branch0:
+	NEED_UNCHECKED(1, u_branch0);
+	a = tos;
+	tos = sp[-2];
+	sp -= 1;
+	if(!a)
+		ip += *(const cell*)ip / (cell)sizeof(cell);
+	else
+		ip += 1;
+	NEXT();
+
+op_drop:
+	NEED_UNCHECKED(1, u_drop);
+	tos = sp[-2];
+	sp -= 1;
+	NEXT();
+
+op_dup:
+	NEED_UNCHECKED(1, u_dup);
+	sp[-1] = tos;
+	sp += 1;
+	NEXT();
+
+op_swap:
+	NEED_UNCHECKED(2, u_swap);
+	a = sp[-2];
+	sp[-2] = tos;
+	tos = a;
+	NEXT();
+
+op_over:
+	if(sp - bottom < 2)
+		THROW(ForthIllegalStateException("over: not enough values in data stack"));
+u_over:
+	PUSH(sp[-2]);
+	NEXT();
+
+#define BINARY(name, expression) \
+op_##name: \
+	NEED_UNCHECKED(2, u_##name); \
+	tos = (expression); \
+	sp -= 1; \
+	NEXT()
+
+	BINARY(add, sp[-2] + tos);
+	BINARY(sub, sp[-2] - tos);
+	BINARY(mul, sp[-2] * tos);
+	BINARY(and, sp[-2] & tos);
+	BINARY(or, sp[-2] | tos);
+	BINARY(xor, sp[-2] ^ tos);
+	BINARY(eq, sp[-2] == tos ? -1 : 0);
+	BINARY(lt, sp[-2] < tos ? -1 : 0);
+	BINARY(lt_not, sp[-2] < tos ? 0 : -1);
+
+#undef BINARY
+
+op_not:
+	NEED_UNCHECKED(1, u_not);
+	tos = ~tos;
+	NEXT();
+
+op_true:
+	PUSH(-1);
+	NEXT();
+
+op_false:
+	PUSH(0);
+	NEXT();
+
+op_fetch:
+	NEED_UNCHECKED(1, u_fetch);
+	tos = *(cell*)tos;
+	NEXT();
+
+op_store:
+	NEED_UNCHECKED(2, u_store);
+	*(cell*)tos = sp[-2];
+	tos = sp[-3];
+	sp -= 2;
+	NEXT();
+
+op_rpush:
+	NEED_UNCHECKED(1, u_rpush);
+	*this->returnStackPointer++ = tos;
+	tos = sp[-2];
+	sp -= 1;
+	NEXT();
+
+op_rpop:
+	if(this->returnStackPointer == this->returnStackBottom)
+		THROW(ForthEmptyStackException("popReturn: return stack empty"));
+	PUSH(*--this->returnStackPointer);
+	NEXT();
+
+op_rtop:
+	if(this->returnStackPointer <= this->returnStackBottom + 1)
+		THROW(ForthIllegalStateException("rtop: not enough values in return stack"));
+	PUSH(this->returnStackPointer[-2]);
+	NEXT();
+
+op_do:
+	NEED_UNCHECKED(2, u_do);
+	this->returnStackPointer[0] = (cell)(ip + *(const cell*)ip / (cell)sizeof(cell));
+	this->returnStackPointer[1] = tos;
+	this->returnStackPointer[2] = sp[-2];
+	this->returnStackPointer += 3;
+	tos = sp[-3];
+	sp -= 2;
+	ip += 1;
+	NEXT();
+
+op_loop:
+	FRAME(3);
+	a = this->returnStackPointer[-2] + 1;
+	this->returnStackPointer[-2] = a;
+	if(a <= this->returnStackPointer[-1])
+		ip += *(const cell*)ip / (cell)sizeof(cell);
+	else {
+		this->returnStackPointer -= 3;
+		ip += 1;
+	}
+	NEXT();
+
+op_plus_loop:
+	NEED_UNCHECKED(1, u_plus_loop);
+	FRAME(3);
+	a = this->returnStackPointer[-2] + tos;
+	this->returnStackPointer[-2] = a;
+	if(tos < 0 ? a >= this->returnStackPointer[-1] : a <= this->returnStackPointer[-1])
+		ip += *(const cell*)ip / (cell)sizeof(cell);
+	else {
+		this->returnStackPointer -= 3;
+		ip += 1;
+	}
+	tos = sp[-2];
+	sp -= 1;
+	NEXT();
+
+op_leave:
+	FRAME(3);
+	ip = (Word *const*)this->returnStackPointer[-3];
+	this->returnStackPointer -= 3;
+	NEXT();
+
+op_unloop:
+	FRAME(3);
+	this->returnStackPointer -= 3;
+	NEXT();
+
+op_j:
+	FRAME(6);
+	PUSH(this->returnStackPointer[-5]);
+	NEXT();
+
+op_tail:
+	word = *(const Word *const*)ip;
+	ip = (Word *const*)word->getConstCode();
+	ENTER(word);
+	NEXT();
+
+op_lit_add:
+	NEED_UNCHECKED(1, u_lit_add);
+	tos += *(const cell*)ip;
+	ip += 1;
+	NEXT();
+
+op_lit_sub:
+	NEED_UNCHECKED(1, u_lit_sub);
+	tos -= *(const cell*)ip;
+	ip += 1;
+	NEXT();
+
+op_dup_mul:
+	NEED_UNCHECKED(1, u_dup_mul);
+	tos *= tos;
+	NEXT();
+
+op_over_add:
+	if(sp - bottom < 2)
+		THROW(ForthIllegalStateException("over: not enough values in data stack"));
+u_over_add:
+	tos += sp[-2];
+	NEXT();
+
+op_2dup:
+	if(sp - bottom < 2)
+		THROW(ForthIllegalStateException("over: not enough values in data stack"));
+u_2dup:
+	sp[-1] = tos;
+	sp[0] = sp[-2];
+	sp += 2;
+	NEXT();
+
+op_swap_rpush:
+	NEED_UNCHECKED(2, u_swap_rpush);
+	*this->returnStackPointer++ = sp[-2];
+	sp -= 1;
+	NEXT();
+
+op_rpop3:
+	if(this->returnStackPointer - this->returnStackBottom < 3)
+		THROW(ForthEmptyStackException("popReturn: return stack empty"));
+	sp[-1] = tos;
+	sp[0] = this->returnStackPointer[-1];
+	sp[1] = this->returnStackPointer[-2];
+	tos = this->returnStackPointer[-3];
+	this->returnStackPointer -= 3;
+	sp += 3;
+	NEXT();
+
+op_lit_shl:
+	NEED_UNCHECKED(1, u_lit_shl);
+	tos = (cell)((uintptr_t)tos << *(const cell*)ip);
+	ip += 1;
+	NEXT();
+
+op_lit_shr:
+	NEED_UNCHECKED(1, u_lit_shr);
+	if(tos < 0)
+		tos += ((cell)1 << *(const cell*)ip) - 1;
+	tos >>= *(const cell*)ip;
+	ip += 1;
+	NEXT();
+
+op_native:
+	SPILL();
+	this->executing = ip;
+	this->runNative(word);
+	ip = this->executing;
+	FILL();
+	NEXT();
+
+underflow:
+	THROW(ForthEmptyStackException("pop: data stack empty"));
+
+no_frame:
+	THROW(ForthIllegalStateException("loop: not enough values in return stack"));
+}
+
+#undef PUSH
+#undef FRAME
+#undef ENTER
+#undef NEED_UNCHECKED
+#undef NEED
+#undef THROW
+#undef FILL
+#undef SPILL
+#undef NEXT
+#undef DISPATCH
+#undef LABEL
+
+#else
+
+void Forth::runCached(const Word *word){
+	this->runDirect(word);
+}
+
+#endif
@@ -0,0 +1,45 @@
+#include <string.h>
+
+#include "forth.h"
+
+// Calls from C++. The arguments are copied onto the data stack, the word
+// runs through execute and the results are copied back, so the text
+// interpreter, the dictionary lookup and number parsing are left out.
+// A call leaves the data stack as it found it, also when it throws.
+
+const Word* Forth::resolve(const char *name) const{
+	size_t length = strlen(name);
+	const Word *word = length <= MAX_WORD ? this->find(name, (uint8_t)length) : NULL;
+	if(!word)
+		throw ForthIllegalArgumentException("resolve: word not found");
+	return word;
+}
+
+void Forth::call(const Word *word, const cell *arguments, size_t argumentCount,
+		cell *results, size_t resultCount){
+	this->callBatch(word, arguments, argumentCount, results, resultCount, 1);
+}
+
+void Forth::callBatch(const Word *word, const cell *arguments, size_t argumentCount,
+		cell *results, size_t resultCount, size_t count){
+	cell *base = this->stackPointer;
+	size_t room = (size_t)(this->stackBottom + this->dataSize - base);
+	if(!word)
+		throw ForthIllegalArgumentException("call: no word");
+	if(argumentCount > room || resultCount > room)
+		throw ForthOutOfMemoryException("call: data stack full");
+	try{
+		for(size_t i = 0; i < count; i++){
+			memcpy(base, arguments + i * argumentCount, argumentCount * sizeof(cell));
+			this->stackPointer = base + argumentCount;
+			this->execute(word);
+			if(this->stackPointer != base + resultCount)
+				throw ForthIllegalStateException("call: the word left another number of results");
+			memcpy(results + i * resultCount, base, resultCount * sizeof(cell));
+		}
+	} catch(...) {
+		this->stackPointer = base;
+		throw;
+	}
+	this->stackPointer = base;
+}
@@ -0,0 +1,85 @@
+#include "call.cpp"
+#include "minunit.h"
+
+MU_TEST(call_tests_call){
+    Forth forth(stdin, 2000, 200, 200);
+    run_program(forth, ": score dup * 3 + ; : divmod over over / -rot % ; 42");
+    const Word *score = forth.resolve("score");
+    const Word *divmod = forth.resolve("divmod");
+    cell arguments[] = { 17, 5 };
+    cell results[2];
+
+    forth.call(score, arguments, 1, results, 1);
+    mu_check(results[0] == 292);
+    forth.call(divmod, arguments, 2, results, 2);
+    mu_check(results[0] == 3 && results[1] == 2);
+    // The stack is left as it was
+    mu_check(forth.getStackPointer() - forth.getStackBottom() == 1 && *forth.top() == 42);
+
+    cell inputs[100], outputs[100];
+    for(int i = 0; i < 100; i++)
+        inputs[i] = i;
+    forth.callBatch(score, inputs, 1, outputs, 1, 100);
+    for(int i = 0; i < 100; i++)
+        mu_check(outputs[i] == i * i + 3);
+    forth.callBatch(divmod, inputs + 10, 2, outputs, 2, 10);
+    for(int i = 0; i < 10; i++)
+        mu_check(outputs[2 * i] == (10 + 2 * i) / (11 + 2 * i) && outputs[2 * i + 1] == (10 + 2 * i) % (11 + 2 * i));
+
+    if(hasJit()){
+        Forth jitted(stdin, 2000, 200, 200);
+        jitted.setJit(true);
+        run_program(jitted, ": score dup * 3 + ;");
+        score = jitted.resolve("score");
+        mu_check(score->getNative() != NULL);
+        jitted.callBatch(score, inputs, 1, outputs, 1, 100);
+        mu_check(outputs[99] == 99 * 99 + 3);
+    }
+}
+
+MU_TEST(call_tests_errors){
+    Forth forth(stdin, 2000, 20, 200);
+    cell arguments[30] = { 0 };
+    cell results[30];
+    bool thrown = false;
+    run_program(forth, ": pair dup ; : under drop drop ;");
+    try{
+        forth.resolve("missing");
+    } catch(ForthIllegalArgumentException &e){
+        thrown = true;
+    }
+    mu_check(thrown);
+
+    // Another number of results than expected
+    thrown = false;
+    try{
+        forth.call(forth.resolve("pair"), arguments, 1, results, 1);
+    } catch(ForthIllegalStateException &e){
+        thrown = true;
+    }
+    mu_check(thrown);
+
+    thrown = false;
+    try{
+        forth.call(forth.resolve("under"), arguments, 1, results, 0);
+    } catch(ForthEmptyStackException &e){
+        thrown = true;
+    }
+    mu_check(thrown);
+
+    thrown = false;
+    cell *many = new cell[forth.getStackSize() + 1]();
+    try{
+        forth.call(forth.resolve("pair"), many, forth.getStackSize() + 1, many, 1);
+    } catch(ForthOutOfMemoryException &e){
+        thrown = true;
+    }
+    delete [] many;
+    mu_check(thrown);
+    mu_check(forth.getStackPointer() == forth.getStackBottom());
+}
+
+MU_TEST_SUITE(call_tests) {
+    MU_RUN_TEST(call_tests_call);
+    MU_RUN_TEST(call_tests_errors);
+}
@@ -0,0 +1,465 @@
+#include <limits.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "code.h"
+#include "words.h"
+
+// How deep the return stack analysis follows calls to other words
+#define RETURN_MAX_NESTING 8
+
+// Binary search for the instruction that starts at the given cell
+static size_t findStart(const size_t *starts, size_t count, size_t cellIndex){
+	size_t low = 0, high = count;
+	while(low < high){
+		size_t middle = (low + high) / 2;
+		if(starts[middle] < cellIndex)
+			low = middle + 1;
+		else
+			high = middle;
+	}
+	return (low < count && starts[low] == cellIndex) ? low : count;
+}
+
+bool hasOperand(const Word *word){
+	switch(word->getOpcode()){
+		case OPCODE_LIT:
+		case OPCODE_BRANCH:
+		case OPCODE_BRANCH0:
+		case OPCODE_DO:
+		case OPCODE_LOOP:
+		case OPCODE_PLUS_LOOP:
+		case OPCODE_LIT_ADD:
+		case OPCODE_LIT_SUB:
+		case OPCODE_LIT_SHL:
+		case OPCODE_LIT_SHR:
+		case OPCODE_TAIL:
+			return true;
+		default:
+			return false;
+	}
+}
+
+bool isBranch(const Word *word){
+	switch(word->getOpcode()){
+		case OPCODE_BRANCH:
+		case OPCODE_BRANCH0:
+		case OPCODE_DO:
+		case OPCODE_LOOP:
+		case OPCODE_PLUS_LOOP:
+			return true;
+		default:
+			return false;
+	}
+}
+
+ThreadedCode::ThreadedCode(): instructions(NULL), count(0), capacity(0){}
+
+ThreadedCode::~ThreadedCode(){
+	delete [] this->instructions;
+}
+
+void ThreadedCode::append(const Instruction &instruction){
+	if(this->count == this->capacity){
+		size_t newCapacity = this->capacity ? this->capacity * 2 : 16;
+		Instruction *newInstructions = new Instruction[newCapacity];
+		if(this->count)
+			memcpy(newInstructions, this->instructions, this->count * sizeof(Instruction));
+		delete [] this->instructions;
+		this->instructions = newInstructions;
+		this->capacity = newCapacity;
+	}
+	this->instructions[this->count] = instruction;
+	this->count += 1;
+}
+
+bool ThreadedCode::decode(const Forth &forth, const Word *word, const cell *end){
+	const cell *code = (const cell*)word->getConstCode();
+	const cell *lastTarget = code;
+	const cell *c = code;
+	size_t *starts;
+	size_t i, j;
+
+	this->count = 0;
+	if(!word->isCompiled())
+		return false;
+	if(!end)
+		end = forth.getFreeMemory();
+	// First pass: split cells into instructions and find the end of the body
+	while(c < end){
+		Instruction instruction;
+		const cell *instructionStart = c;
+		if(!forth.inDictionary(*c))
+			return false;
+		instruction.word = (const Word*)*c;
+		instruction.hasOperand = hasOperand(instruction.word);
+		instruction.operand = 0;
+		instruction.target = (size_t)(c - code);
+		instruction.isTarget = false;
+		c += 1;
+		if(instruction.hasOperand){
+			if(c >= end)
+				return false;
+			instruction.operand = *c;
+			if(isBranch(instruction.word)){
+				// Branch offsets are counted in bytes from the operand cell
+				ptrdiff_t target = (c - code) + instruction.operand / (cell)sizeof(cell);
+				if(instruction.operand % (cell)sizeof(cell) || target < 0)
+					return false;
+				instruction.target = (size_t)target;
+				if(code + instruction.target > lastTarget)
+					lastTarget = code + instruction.target;
+			}
+			c += 1;
+		}
+		this->append(instruction);
+		if((instruction.word->getOpcode() == OPCODE_EXIT || instruction.word->getOpcode() == OPCODE_TAIL) &&
+				instructionStart >= lastTarget)
+			break;
+	}
+	if(lastTarget >= c)
+		return false;
+
+	// Second pass: turn cell offsets of branch targets into instruction indices
+	starts = new size_t[this->count];
+	for(i = 0, c = code; i < this->count; i++){
+		starts[i] = (size_t)(c - code);
+		c += this->instructions[i].hasOperand ? 2 : 1;
+	}
+	for(i = 0; i < this->count; i++){
+		if(!isBranch(this->instructions[i].word))
+			continue;
+		j = findStart(starts, this->count, this->instructions[i].target);
+		if(j == this->count){
+			delete [] starts;
+			return false;
+		}
+		this->instructions[i].target = j;
+		this->instructions[j].isTarget = true;
+	}
+	delete [] starts;
+	return true;
+}
+
+size_t ThreadedCode::size() const{
+	return this->count;
+}
+
+const Instruction& ThreadedCode::at(size_t index) const{
+	return this->instructions[index];
+}
+
+void ThreadedCode::replace(size_t index, size_t count, const Word *word, cell operand){
+	Instruction &instruction = this->instructions[index];
+	size_t removed = count - 1;
+	instruction.word = word;
+	instruction.operand = operand;
+	instruction.hasOperand = hasOperand(word);
+	instruction.target = index;
+	if(removed){
+		memmove(this->instructions + index + 1, this->instructions + index + count,
+			(this->count - index - count) * sizeof(Instruction));
+		this->count -= removed;
+	}
+	for(size_t i = 0; i < this->count; i++){
+		if(isBranch(this->instructions[i].word) && this->instructions[i].target > index)
+			this->instructions[i].target -= removed;
+	}
+}
+
+void ThreadedCode::splice(size_t index, const ThreadedCode &body, size_t count){
+	Instruction first = this->instructions[index];
+	if(count == 0){
+		// Nothing to put there, later instructions move up
+		memmove(this->instructions + index, this->instructions + index + 1,
+			(this->count - index - 1) * sizeof(Instruction));
+		this->count -= 1;
+		if(first.isTarget && index < this->count)
+			this->instructions[index].isTarget = true;
+		for(size_t i = 0; i < this->count; i++){
+			if(isBranch(this->instructions[i].word) && this->instructions[i].target > index)
+				this->instructions[i].target -= 1;
+		}
+		return;
+	}
+	for(size_t i = 1; i < count; i++)
+		this->append(body.instructions[i]);
+	// Appended at the end, then moved into place after index
+	memmove(this->instructions + index + count, this->instructions + index + 1,
+		(this->count - index - count) * sizeof(Instruction));
+	memcpy(this->instructions + index, body.instructions, count * sizeof(Instruction));
+	for(size_t i = 0; i < count; i++){
+		this->instructions[index + i].isTarget = i == 0 && first.isTarget;
+		this->instructions[index + i].target = index + i;
+	}
+	for(size_t i = 0; i < this->count; i++){
+		if(isBranch(this->instructions[i].word) && this->instructions[i].target > index)
+			this->instructions[i].target += count - 1;
+	}
+}
+
+size_t ThreadedCode::cells() const{
+	size_t result = 0;
+	for(size_t i = 0; i < this->count; i++)
+		result += this->instructions[i].hasOperand ? 2 : 1;
+	return result;
+}
+
+void ThreadedCode::encode(cell *code) const{
+	size_t *starts = new size_t[this->count];
+	size_t i, c;
+	for(i = 0, c = 0; i < this->count; i++){
+		starts[i] = c;
+		c += this->instructions[i].hasOperand ? 2 : 1;
+	}
+	for(i = 0; i < this->count; i++){
+		const Instruction &instruction = this->instructions[i];
+		cell *out = code + starts[i];
+		out[0] = (cell)instruction.word;
+		if(!instruction.hasOperand)
+			continue;
+		if(isBranch(instruction.word))
+			out[1] = ((cell)starts[instruction.target] - (cell)(starts[i] + 1)) * (cell)sizeof(cell);
+		else
+			out[1] = instruction.operand;
+	}
+	delete [] starts;
+}
+
+// Return stack analysis
+
+static bool isForbidden(const Word *word){
+	function handler;
+	// leave jumps to the address kept in the loop frame
+	if(word->getOpcode() == OPCODE_STOP || word->getOpcode() == OPCODE_LEAVE)
+		return true;
+	if(word->getOpcode() != OPCODE_PRIMITIVE)
+		return false;
+	// These look at the instruction pointer, pause switches it with the stacks
+	handler = *(const function*)word->getConstCode();
+	return handler == next || handler == interpreter_stub || handler == task_pause;
+}
+
+static bool analyse(const Forth &forth, const Word *word, const cell *end,
+		int nesting, const Word *assumed, ReturnEffect *result){
+	ThreadedCode code;
+	int *depths;
+	size_t *work;
+	size_t pending = 0;
+	bool ok = true;
+
+	if(nesting > RETURN_MAX_NESTING || !code.decode(forth, word, end))
+		return false;
+	depths = new int[code.size()];
+	work = new size_t[code.size()];
+	for(size_t i = 0; i < code.size(); i++)
+		depths[i] = INT_MIN;
+	result->lowest = 1;
+	result->exit = INT_MIN;
+	depths[0] = 0;
+	work[pending++] = 0;
+
+	while(ok && pending){
+		size_t i = work[--pending];
+		const Instruction &instruction = code.at(i);
+		int depth = depths[i];
+		size_t successors[2];
+		size_t successorCount = 0;
+		// Depth at the branch target when it differs from the fall through
+		int targetDepth = INT_MIN;
+		ReturnEffect callee;
+
+		if(isForbidden(instruction.word))
+			ok = false;
+		switch(instruction.word->getOpcode()){
+			case OPCODE_EXIT:
+				if(result->exit != INT_MIN && result->exit != depth)
+					ok = false;
+				result->exit = depth;
+				break;
+			case OPCODE_BRANCH:
+				successors[successorCount++] = instruction.target;
+				break;
+			case OPCODE_BRANCH0:
+				successors[successorCount++] = instruction.target;
+				successors[successorCount++] = i + 1;
+				break;
+			case OPCODE_RPUSH:
+			case OPCODE_SWAP_RPUSH:
+				depth += 1;
+				successors[successorCount++] = i + 1;
+				break;
+			case OPCODE_RPOP:
+				if(depth < result->lowest)
+					result->lowest = depth;
+				depth -= 1;
+				successors[successorCount++] = i + 1;
+				break;
+			case OPCODE_DO:
+				depth += 3;
+				successors[successorCount++] = i + 1;
+				break;
+			case OPCODE_LOOP:
+			case OPCODE_PLUS_LOOP:
+				if(depth - 2 < result->lowest)
+					result->lowest = depth - 2;
+				// Loops back with the frame, falls through without it
+				targetDepth = depth;
+				depth -= 3;
+				successors[successorCount++] = instruction.target;
+				successors[successorCount++] = i + 1;
+				break;
+			case OPCODE_UNLOOP:
+				if(depth - 2 < result->lowest)
+					result->lowest = depth - 2;
+				depth -= 3;
+				successors[successorCount++] = i + 1;
+				break;
+			case OPCODE_J:
+				if(depth - 4 < result->lowest)
+					result->lowest = depth - 4;
+				successors[successorCount++] = i + 1;
+				break;
+			case OPCODE_RPOP3:
+				if(depth - 2 < result->lowest)
+					result->lowest = depth - 2;
+				depth -= 3;
+				successors[successorCount++] = i + 1;
+				break;
+			case OPCODE_RTOP:
+				if(depth - 1 < result->lowest)
+					result->lowest = depth - 1;
+				successors[successorCount++] = i + 1;
+				break;
+			case OPCODE_CALL:
+			case OPCODE_TAIL: {
+				// A tail call is a call followed by exit
+				bool tail = instruction.word->getOpcode() == OPCODE_TAIL;
+				const Word *called = tail ? (const Word*)instruction.operand : instruction.word;
+				if(called == assumed){
+					callee.lowest = 1;
+					callee.exit = 0;
+				} else if(!analyse(forth, called, NULL, nesting + 1, assumed, &callee)){
+					ok = false;
+					break;
+				}
+				// The callee frame sits at depth + 1
+				if(depth + 1 + callee.lowest < result->lowest)
+					result->lowest = depth + 1 + callee.lowest;
+				depth += callee.exit;
+				if(!tail)
+					successors[successorCount++] = i + 1;
+				else if(result->exit != INT_MIN && result->exit != depth)
+					ok = false;
+				else
+					result->exit = depth;
+				break;
+			}
+			default:
+				successors[successorCount++] = i + 1;
+				break;
+		}
+		for(size_t j = 0; ok && j < successorCount; j++){
+			int successorDepth = (j == 0 && targetDepth != INT_MIN) ? targetDepth : depth;
+			if(successors[j] >= code.size())
+				ok = false;
+			else if(depths[successors[j]] == INT_MIN){
+				depths[successors[j]] = successorDepth;
+				work[pending++] = successors[j];
+			} else if(depths[successors[j]] != successorDepth)
+				ok = false;
+		}
+	}
+	delete [] work;
+	delete [] depths;
+	return ok && result->exit != INT_MIN;
+}
+
+bool analyseReturnStack(const Forth &forth, const Word *word, const cell *end,
+		ReturnEffect *result, const Word *assumed){
+	return analyse(forth, word, end, 0, assumed, result);
+}
+
+// Data stack analysis
+
+bool analyseDataStack(const Forth &forth, const Word *word, const cell *end, StackEffect *result){
+	ThreadedCode code;
+	int *depths;
+	size_t *work;
+	size_t pending = 0;
+	int lowest = 0, exit = INT_MIN;
+	bool ok = true;
+
+	if(!code.decode(forth, word, end))
+		return false;
+	depths = new int[code.size()];
+	work = new size_t[code.size()];
+	for(size_t i = 0; i < code.size(); i++)
+		depths[i] = INT_MIN;
+	depths[0] = 0;
+	work[pending++] = 0;
+
+	while(ok && pending){
+		size_t i = work[--pending];
+		const Instruction &instruction = code.at(i);
+		const Word *called = instruction.word;
+		int depth = depths[i];
+		size_t successors[2];
+		size_t successorCount = 0;
+
+		switch(instruction.word->getOpcode()){
+			case OPCODE_EXIT:
+				if(exit != INT_MIN && exit != depth)
+					ok = false;
+				exit = depth;
+				continue;
+			case OPCODE_BRANCH:
+				successors[successorCount++] = instruction.target;
+				break;
+			// The target of (do) is only reached by leave
+			case OPCODE_BRANCH0:
+			case OPCODE_LOOP:
+			case OPCODE_PLUS_LOOP:
+				successors[successorCount++] = instruction.target;
+				successors[successorCount++] = i + 1;
+				break;
+			case OPCODE_TAIL:
+				called = (const Word*)instruction.operand;
+				break;
+			default:
+				successors[successorCount++] = i + 1;
+				break;
+		}
+		// leave and the words switching the instruction pointer have no effect
+		if(!called->hasStackEffect()){
+			ok = false;
+			break;
+		}
+		depth -= called->getStackIn();
+		if(depth < lowest)
+			lowest = depth;
+		depth += called->getStackOut();
+		if(instruction.word->getOpcode() == OPCODE_TAIL){
+			if(exit != INT_MIN && exit != depth)
+				ok = false;
+			exit = depth;
+		}
+		for(size_t j = 0; ok && j < successorCount; j++){
+			size_t successor = successors[j];
+			if(successor >= code.size())
+				ok = false;
+			else if(depths[successor] == INT_MIN){
+				depths[successor] = depth;
+				work[pending++] = successor;
+			} else if(depths[successor] != depth)
+				ok = false;
+		}
+	}
+	delete [] work;
+	delete [] depths;
+	if(!ok || exit == INT_MIN)
+		return false;
+	result->in = -lowest;
+	result->out = exit - lowest;
+	return true;
+}
@@ -0,0 +1,527 @@
+#include <stddef.h>
+
+#include "forth.h"
+#include "words.h"
+
+// Direct-threaded inner interpreter.
+// Threaded code still holds Word pointers, but every word carries an opcode
+// resolved when it was added to the dictionary. The hot primitives are
+// executed right here and everything else is called through its handler.
+
+static const struct {
+	function handler;
+	uint8_t opcode;
+} opcodes[] = {
+	{ forth_exit, OPCODE_EXIT },
+	{ literal, OPCODE_LIT },
+	{ branch, OPCODE_BRANCH },
+	{ branch0, OPCODE_BRANCH0 },
+	{ drop, OPCODE_DROP },
+	{ _dup, OPCODE_DUP },
+	{ swap, OPCODE_SWAP },
+	{ over, OPCODE_OVER },
+	{ add, OPCODE_ADD },
+	{ sub, OPCODE_SUB },
+	{ mul, OPCODE_MUL },
+	{ _and, OPCODE_AND },
+	{ _or, OPCODE_OR },
+	{ _xor, OPCODE_XOR },
+	{ _not, OPCODE_NOT },
+	{ _eq, OPCODE_EQ },
+	{ lt, OPCODE_LT },
+	{ _true, OPCODE_TRUE },
+	{ _false, OPCODE_FALSE },
+	{ memory_read, OPCODE_FETCH },
+	{ memory_write, OPCODE_STORE },
+	{ rpush, OPCODE_RPUSH },
+	{ rpop, OPCODE_RPOP },
+	{ rtop, OPCODE_RTOP },
+	{ forth_do, OPCODE_DO },
+	{ forth_loop, OPCODE_LOOP },
+	{ forth_plus_loop, OPCODE_PLUS_LOOP },
+	{ forth_leave, OPCODE_LEAVE },
+	{ forth_unloop, OPCODE_UNLOOP },
+	{ forth_j, OPCODE_J },
+	{ tail_call, OPCODE_TAIL },
+	{ lit_add, OPCODE_LIT_ADD },
+	{ lit_sub, OPCODE_LIT_SUB },
+	{ dup_mul, OPCODE_DUP_MUL },
+	{ over_add, OPCODE_OVER_ADD },
+	{ two_dup, OPCODE_2DUP },
+	{ lt_not, OPCODE_LT_NOT },
+	{ swap_rpush, OPCODE_SWAP_RPUSH },
+	{ rpop3, OPCODE_RPOP3 },
+	{ lit_shl, OPCODE_LIT_SHL },
+	{ lit_shr, OPCODE_LIT_SHR }
+};
+
+uint8_t findOpcode(const function handler){
+	for(size_t i = 0; i < sizeof(opcodes) / sizeof(opcodes[0]); i++){
+		if(opcodes[i].handler == handler)
+			return opcodes[i].opcode;
+	}
+	return OPCODE_PRIMITIVE;
+}
+
+function findHandler(uint8_t opcode){
+	for(size_t i = 0; i < sizeof(opcodes) / sizeof(opcodes[0]); i++){
+		if(opcodes[i].opcode == opcode)
+			return opcodes[i].handler;
+	}
+	return NULL;
+}
+
+#ifdef __GNUC__
+
+bool hasDirectEngine(){
+	return true;
+}
+
+// Labels as values and computed goto are GNU extensions
+#define LABEL(name) (__extension__ &&name)
+#define DISPATCH() __extension__ ({ goto *table[word->getOpcode()]; })
+#define NEXT() do { word = *ip++; DISPATCH(); } while(0)
+
+// Pushes are not checked, the guard page above each stack faults instead
+#define NEED(n) if(sp - this->stackBottom < (n)) goto underflow
+// Operations with a depth check have an unchecked variant starting after it.
+#define NEED_UNCHECKED(n, name) \
+	if(this->stackPointer - this->stackBottom < (n)) goto underflow; \
+name: \
+	sp = this->stackPointer
+// A called word runs the unchecked variants if the stack holds the values
+// it takes, until it returns. Unknown effects are -1, no size_t reaches them.
+#define ENTER(called) \
+	table = (size_t)(this->stackPointer - this->stackBottom) >= (size_t)(called)->getStackIn() ? \
+		unchecked : labels
+#define FRAME(n) if(this->returnStackPointer - this->returnStackBottom < (n)) goto no_frame
+
+void Forth::runDirect(const Word *word){
+	static void *const labels[OPCODE_COUNT] = {
+		LABEL(op_primitive),
+		LABEL(op_call),
+		LABEL(op_stop),
+		LABEL(op_exit),
+		LABEL(op_lit),
+		LABEL(op_branch),
+		LABEL(op_branch0),
+		LABEL(op_drop),
+		LABEL(op_dup),
+		LABEL(op_swap),
+		LABEL(op_over),
+		LABEL(op_add),
+		LABEL(op_sub),
+		LABEL(op_mul),
+		LABEL(op_and),
+		LABEL(op_or),
+		LABEL(op_xor),
+		LABEL(op_not),
+		LABEL(op_eq),
+		LABEL(op_lt),
+		LABEL(op_true),
+		LABEL(op_false),
+		LABEL(op_fetch),
+		LABEL(op_store),
+		LABEL(op_rpush),
+		LABEL(op_rpop),
+		LABEL(op_rtop),
+		LABEL(op_do),
+		LABEL(op_loop),
+		LABEL(op_plus_loop),
+		LABEL(op_leave),
+		LABEL(op_unloop),
+		LABEL(op_j),
+		LABEL(op_tail),
+		LABEL(op_lit_add),
+		LABEL(op_lit_sub),
+		LABEL(op_dup_mul),
+		LABEL(op_over_add),
+		LABEL(op_2dup),
+		LABEL(op_lt_not),
+		LABEL(op_swap_rpush),
+		LABEL(op_rpop3),
+		LABEL(op_lit_shl),
+		LABEL(op_lit_shr),
+		LABEL(op_native)
+	};
+	// Operations without their depth checks, for words whose stack effect
+	// is known and whose callers leave enough values for it
+	static void *const unchecked[OPCODE_COUNT] = {
+		LABEL(op_primitive),
+		LABEL(op_call),
+		LABEL(op_stop),
+		LABEL(op_exit),
+		LABEL(op_lit),
+		LABEL(op_branch),
+		LABEL(u_branch0),
+		LABEL(u_drop),
+		LABEL(u_dup),
+		LABEL(u_swap),
+		LABEL(u_over),
+		LABEL(u_add),
+		LABEL(u_sub),
+		LABEL(u_mul),
+		LABEL(u_and),
+		LABEL(u_or),
+		LABEL(u_xor),
+		LABEL(u_not),
+		LABEL(u_eq),
+		LABEL(u_lt),
+		LABEL(op_true),
+		LABEL(op_false),
+		LABEL(u_fetch),
+		LABEL(u_store),
+		LABEL(u_rpush),
+		LABEL(op_rpop),
+		LABEL(op_rtop),
+		LABEL(u_do),
+		LABEL(op_loop),
+		LABEL(u_plus_loop),
+		LABEL(op_leave),
+		LABEL(op_unloop),
+		LABEL(op_j),
+		LABEL(op_tail),
+		LABEL(u_lit_add),
+		LABEL(u_lit_sub),
+		LABEL(u_dup_mul),
+		LABEL(u_over_add),
+		LABEL(u_2dup),
+		LABEL(u_lt_not),
+		LABEL(u_swap_rpush),
+		LABEL(op_rpop3),
+		LABEL(u_lit_shl),
+		LABEL(u_lit_shr),
+		LABEL(op_native)
+	};
+	void *const *table = labels;
+	Word *const *ip = this->executing;
+	cell *sp;
+	cell a;
+
+	if(*ip != this->stopWord)
+		ip += 1;
+	if(word == this->stopWord)
+		goto op_primitive;
+	DISPATCH();
+
+op_primitive:
+	this->executing = ip;
+	(*(const function*)word->getConstCode())(*this);
+	ip = this->executing;
+	NEXT();
+
+op_call:
+	*this->returnStackPointer++ = (cell)ip;
+	ip = (Word *const*)word->getConstCode();
+	ENTER(word);
+	NEXT();
+
+op_stop:
+	this->executing = ip - 1;
+	return;
+
+op_exit:
+	if(this->returnStackPointer == this->returnStackBottom){
+		this->executing = ip;
+		throw ForthEmptyStackException("popReturn: return stack empty");
+	}
+	ip = (Word *const*)*--this->returnStackPointer;
+	table = labels;
+	NEXT();
+
+op_lit:
+	sp = this->stackPointer;
+	*sp = *(const cell*)ip;
+	this->stackPointer = sp + 1;
+	ip += 1;
+	NEXT();
+
+op_branch:
+	ip += *(const cell*)ip / (cell)sizeof(cell);
+	NEXT();
+
+op_branch0:
+	NEED_UNCHECKED(1, u_branch0);
+	this->stackPointer = sp - 1;
+	if(!sp[-1])
+		ip += *(const cell*)ip / (cell)sizeof(cell);
+	else
+		ip += 1;
+	NEXT();
+
+op_drop:
+	NEED_UNCHECKED(1, u_drop);
+	this->stackPointer = sp - 1;
+	NEXT();
+
+op_dup:
+	NEED_UNCHECKED(1, u_dup);
+	*sp = sp[-1];
+	this->stackPointer = sp + 1;
+	NEXT();
+
+op_swap:
+	NEED_UNCHECKED(2, u_swap);
+	a = sp[-1];
+	sp[-1] = sp[-2];
+	sp[-2] = a;
+	NEXT();
+
+op_over:
+	if(this->stackPointer - this->stackBottom < 2){
+		this->executing = ip;
+		throw ForthIllegalStateException("over: not enough values in data stack");
+	}
+u_over:
+	sp = this->stackPointer;
+	*sp = sp[-2];
+	this->stackPointer = sp + 1;
+	NEXT();
+
+#define BINARY(name, expression) \
+op_##name: \
+	NEED_UNCHECKED(2, u_##name); \
+	a = sp[-1]; \
+	sp[-2] = (expression); \
+	this->stackPointer = sp - 1; \
+	NEXT()
+
+	BINARY(add, sp[-2] + a);
+	BINARY(sub, sp[-2] - a);
+	BINARY(mul, sp[-2] * a);
+	BINARY(and, sp[-2] & a);
+	BINARY(or, sp[-2] | a);
+	BINARY(xor, sp[-2] ^ a);
+	BINARY(eq, sp[-2] == a ? -1 : 0);
+	BINARY(lt, sp[-2] < a ? -1 : 0);
+
+#undef BINARY
+
+op_not:
+	NEED_UNCHECKED(1, u_not);
+	sp[-1] = ~sp[-1];
+	NEXT();
+
+op_true:
+	sp = this->stackPointer;
+	*sp = -1;
+	this->stackPointer = sp + 1;
+	NEXT();
+
+op_false:
+	sp = this->stackPointer;
+	*sp = 0;
+	this->stackPointer = sp + 1;
+	NEXT();
+
+op_fetch:
+	NEED_UNCHECKED(1, u_fetch);
+	sp[-1] = *(cell*)sp[-1];
+	NEXT();
+
+op_store:
+	NEED_UNCHECKED(2, u_store);
+	*(cell*)sp[-1] = sp[-2];
+	this->stackPointer = sp - 2;
+	NEXT();
+
+op_rpush:
+	NEED_UNCHECKED(1, u_rpush);
+	*this->returnStackPointer++ = sp[-1];
+	this->stackPointer = sp - 1;
+	NEXT();
+
+op_rpop:
+	sp = this->stackPointer;
+	if(this->returnStackPointer == this->returnStackBottom){
+		this->executing = ip;
+		throw ForthEmptyStackException("popReturn: return stack empty");
+	}
+	*sp = *--this->returnStackPointer;
+	this->stackPointer = sp + 1;
+	NEXT();
+
+op_rtop:
+	sp = this->stackPointer;
+	if(this->returnStackPointer <= this->returnStackBottom + 1){
+		this->executing = ip;
+		throw ForthIllegalStateException("rtop: not enough values in return stack");
+	}
+	*sp = this->returnStackPointer[-2];
+	this->stackPointer = sp + 1;
+	NEXT();
+
+op_do:
+	NEED_UNCHECKED(2, u_do);
+	this->returnStackPointer[0] = (cell)(ip + *(const cell*)ip / (cell)sizeof(cell));
+	this->returnStackPointer[1] = sp[-1];
+	this->returnStackPointer[2] = sp[-2];
+	this->returnStackPointer += 3;
+	this->stackPointer = sp - 2;
+	ip += 1;
+	NEXT();
+
+op_loop:
+	FRAME(3);
+	a = this->returnStackPointer[-2] + 1;
+	this->returnStackPointer[-2] = a;
+	if(a <= this->returnStackPointer[-1])
+		ip += *(const cell*)ip / (cell)sizeof(cell);
+	else {
+		this->returnStackPointer -= 3;
+		ip += 1;
+	}
+	NEXT();
+
+op_plus_loop:
+	NEED_UNCHECKED(1, u_plus_loop);
+	FRAME(3);
+	this->stackPointer = sp - 1;
+	a = this->returnStackPointer[-2] + sp[-1];
+	this->returnStackPointer[-2] = a;
+	if(sp[-1] < 0 ? a >= this->returnStackPointer[-1] : a <= this->returnStackPointer[-1])
+		ip += *(const cell*)ip / (cell)sizeof(cell);
+	else {
+		this->returnStackPointer -= 3;
+		ip += 1;
+	}
+	NEXT();
+
+op_leave:
+	FRAME(3);
+	ip = (Word *const*)this->returnStackPointer[-3];
+	this->returnStackPointer -= 3;
+	NEXT();
+
+op_unloop:
+	FRAME(3);
+	this->returnStackPointer -= 3;
+	NEXT();
+
+op_j:
+	sp = this->stackPointer;
+	FRAME(6);
+	*sp = this->returnStackPointer[-5];
+	this->stackPointer = sp + 1;
+	NEXT();
+
+op_tail:
+	word = *(const Word *const*)ip;
+	ip = (Word *const*)word->getConstCode();
+	ENTER(word);
+	NEXT();
+
+// Superinstructions check the stacks once for the whole sequence
+
+op_lit_add:
+	NEED_UNCHECKED(1, u_lit_add);
+	sp[-1] += *(const cell*)ip;
+	ip += 1;
+	NEXT();
+
+op_lit_sub:
+	NEED_UNCHECKED(1, u_lit_sub);
+	sp[-1] -= *(const cell*)ip;
+	ip += 1;
+	NEXT();
+
+op_dup_mul:
+	NEED_UNCHECKED(1, u_dup_mul);
+	sp[-1] *= sp[-1];
+	NEXT();
+
+op_over_add:
+	if(this->stackPointer - this->stackBottom < 2){
+		this->executing = ip;
+		throw ForthIllegalStateException("over: not enough values in data stack");
+	}
+u_over_add:
+	sp = this->stackPointer;
+	sp[-1] += sp[-2];
+	NEXT();
+
+op_2dup:
+	if(this->stackPointer - this->stackBottom < 2){
+		this->executing = ip;
+		throw ForthIllegalStateException("over: not enough values in data stack");
+	}
+u_2dup:
+	sp = this->stackPointer;
+	sp[0] = sp[-2];
+	sp[1] = sp[-1];
+	this->stackPointer = sp + 2;
+	NEXT();
+
+op_lt_not:
+	NEED_UNCHECKED(2, u_lt_not);
+	sp[-2] = sp[-2] < sp[-1] ? 0 : -1;
+	this->stackPointer = sp - 1;
+	NEXT();
+
+op_swap_rpush:
+	NEED_UNCHECKED(2, u_swap_rpush);
+	*this->returnStackPointer++ = sp[-2];
+	sp[-2] = sp[-1];
+	this->stackPointer = sp - 1;
+	NEXT();
+
+op_rpop3:
+	sp = this->stackPointer;
+	if(this->returnStackPointer - this->returnStackBottom < 3){
+		this->executing = ip;
+		throw ForthEmptyStackException("popReturn: return stack empty");
+	}
+	sp[0] = this->returnStackPointer[-1];
+	sp[1] = this->returnStackPointer[-2];
+	sp[2] = this->returnStackPointer[-3];
+	this->returnStackPointer -= 3;
+	this->stackPointer = sp + 3;
+	NEXT();
+
+op_lit_shl:
+	NEED_UNCHECKED(1, u_lit_shl);
+	sp[-1] = (cell)((uintptr_t)sp[-1] << *(const cell*)ip);
+	ip += 1;
+	NEXT();
+
+op_lit_shr:
+	NEED_UNCHECKED(1, u_lit_shr);
+	a = sp[-1];
+	sp[-1] = (a < 0 ? a + ((cell)1 << *(const cell*)ip) - 1 : a) >> *(const cell*)ip;
+	ip += 1;
+	NEXT();
+
+op_native:
+	this->executing = ip;
+	this->runNative(word);
+	ip = this->executing;
+	NEXT();
+
+underflow:
+	this->executing = ip;
+	throw ForthEmptyStackException("pop: data stack empty");
+
+no_frame:
+	this->executing = ip;
+	throw ForthIllegalStateException("loop: not enough values in return stack");
+}
+
+#undef ENTER
+#undef NEED_UNCHECKED
+#undef NEED
+#undef FRAME
+#undef NEXT
+#undef DISPATCH
+#undef LABEL
+
+#else
+
+bool hasDirectEngine(){
+	return false;
+}
+
+void Forth::runDirect(const Word *word){
+	this->runIndirect(word);
+}
+
+#endif
@@ -5,12 +5,38 @@
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
+#include <time.h>
+#include <pthread.h>
+#include <signal.h>
+#include <sys/mman.h>
+#include <unistd.h>
 
+#include "code.h"
 #include "forth.h"
+#include "fuse.h"
+#include "jit.h"
+#include "tokenizer.h"
 #include "words.h"
 
+#define INDEX_INITIAL_SIZE 256
+// Limited runs look at the clock once per this many instructions
+#define LIMIT_CLOCK_INTERVAL 1024
+// Bodies of at most this many cells are inlined by default
+#define INLINE_LIMIT 6
+// The arena is committed by chunks of a huge page
+#define ARENA_CHUNK ((size_t)2 << 20)
+// Guarded stacks are registered in chunks of this many
+#define GUARD_CHUNK 256
+
 static uintptr_t align(uintptr_t value, uint8_t alignment);
-static intptr_t strtoiptr(const char* ptr, char** endptr, int base);
+static bool parseNumber(const char *token, size_t length, cell base, cell *number);
+static bool isNumberStart(char c);
+static size_t hashName(const char *name, uint8_t length);
+static double monotonicSeconds();
+static size_t roundUp(size_t value, size_t unit);
+static cell* reserveArena(size_t size);
+static cell* mapStack(size_t *cells, bool returnStack);
+static void unmapStack(cell *bottom, size_t cells, bool returnStack);
 
 // C++ implementation
 
@@ -19,82 +45,202 @@ static intptr_t strtoiptr(const char* ptr, char** endptr, int base);
 // Constructor and destructor
 
 Forth::Forth(FILE *_input, size_t _memorySize, size_t _stackSize, size_t _returnStackSize):
-	input(_input), memorySize(_memorySize), dataSize(_stackSize), returnStackSize(_returnStackSize){
-	this->memory = new cell[_memorySize];
+	input(_input), output(stdout), errors(stderr){
+	this->create(_memorySize, _stackSize, _returnStackSize);
+	this->latest = NULL;
+	this->stopWord = NULL;
+	this->executing = NULL;
+#ifdef FORTH_DIRECT_THREADED
+	this->setEngine(FORTH_ENGINE_DIRECT);
+#else
+	this->engine = FORTH_ENGINE_INDIRECT;
+#endif
+	this->jitEnabled = false;
+	this->fusionEnabled = true;
+	this->tailCallsEnabled = true;
+	this->warningsEnabled = false;
+}
+
+Forth::Forth(const Forth &_shared, FILE *_input, size_t _memorySize, size_t _stackSize, size_t _returnStackSize):
+	input(_input), output(_shared.output), errors(_shared.errors){
+	if(!_shared.frozen)
+		throw ForthIllegalArgumentException("Forth constructor: shared dictionary is not frozen");
+	this->create(_memorySize, _stackSize, _returnStackSize);
+	this->shared = &_shared;
+	this->latest = _shared.latest;
+	this->sharedLatest = _shared.latest;
+	this->stopWord = _shared.stopWord;
+	this->executing = (Word *const*)&this->stopWord;
+	this->engine = _shared.engine;
+	this->fusionEnabled = _shared.fusionEnabled;
+	this->tailCallsEnabled = _shared.tailCallsEnabled;
+	this->warningsEnabled = _shared.warningsEnabled;
+	this->inlineLimit = _shared.inlineLimit;
+	this->jitEnabled = _shared.jitEnabled;
+	// Shared native code reports errors to the Jit of the VM running it
+	if(_shared.jit)
+		this->jit = new Jit();
+}
+
+// Allocation common to all VMs
+void Forth::create(size_t _memorySize, size_t _stackSize, size_t _returnStackSize){
+	this->memorySize = _memorySize;
+	this->memory = reserveArena(_memorySize * sizeof(cell));
 	this->freeMemory = this->memory;
+	this->committedMemory = this->memory;
+	this->hugePages = false;
 
-	this->stackBottom = new cell[_stackSize];
+	// The sizes are rounded up to whole pages
+	this->dataSize = _stackSize;
+	this->stackBottom = mapStack(&this->dataSize, false);
 	this->stackPointer = this->stackBottom;
 
-	this->returnStackBottom = new cell[_returnStackSize];
+	this->returnStackSize = _returnStackSize;
+	this->returnStackBottom = mapStack(&this->returnStackSize, true);
 	this->returnStackPointer = this->returnStackBottom;
 
-	this->latest = NULL;
-	this->executing = NULL;
+	// The main task is saved to only when another task runs
+	this->mainTask.stackBottom = this->stackBottom;
+	this->mainTask.dataSize = this->dataSize;
+	this->mainTask.returnStackBottom = this->returnStackBottom;
+	this->mainTask.returnStackSize = this->returnStackSize;
+	this->mainTask.previous = &this->mainTask;
+	this->mainTask.next = &this->mainTask;
+	this->currentTask = &this->mainTask;
+	this->taskCount = 0;
+
 	this->compiling = false;
+	this->inlineLimit = INLINE_LIMIT;
+	this->base = 10;
+	this->suspended = false;
+	this->recovery = false;
+	this->jit = NULL;
+	this->shared = NULL;
+	this->sharedLatest = NULL;
+	this->frozen = false;
+
+	this->indexSize = INDEX_INITIAL_SIZE;
+	this->indexCount = 0;
+	this->index = new Word*[this->indexSize]();
+
+	this->tokenizer = new Tokenizer();
+	this->tokenizer->open(this->input);
 	
-	if(!(this->memory) || !(this->stackBottom) || !(this->returnStackBottom))
+	if(!(this->memory) || !(this->stackBottom) || !(this->returnStackBottom) || !(this->index))
 		throw ForthException("Forth constructor: failed to allocate memory");
 }
 
 Forth::~Forth(){
-	delete [] this->stackBottom;
-	delete [] this->memory;
-	delete [] this->returnStackBottom;
+	this->endTasks();
+	unmapStack(this->stackBottom, this->dataSize, false);
+	if(this->memory)
+		munmap(this->memory, roundUp(this->memorySize * sizeof(cell), ARENA_CHUNK));
+	unmapStack(this->returnStackBottom, this->returnStackSize, true);
+	delete [] this->index;
+	delete this->jit;
+	delete this->tokenizer;
+}
+
+// Primitives of the base dictionary, in the order they are added.
+// Images refer to handlers by their index in this table,
+// so new primitives go to the end.
+static const Primitive primitives[] = {
+	{ "interpret", interpreter_stub, false, -1, -1 },
+	{ "drop", drop, false, 1, 0 },
+	{ "dup", _dup, false, 1, 2 },
+	{ "+", add, false, 2, 1 },
+	{ "-", sub, false, 2, 1 },
+	{ "*", mul, false, 2, 1 },
+	{ "/", _div, false, 2, 1 },
+	{ "%", mod, false, 2, 1 },
+	{ "swap", swap, false, 2, 2 },
+	{ "rot", rot, false, 3, 3 },
+	{ "-rot", rot_back, false, 3, 3 },
+	{ "show", show, false, 0, 0 },
+	{ "over", over, false, 2, 3 },
+	{ "true", _true, false, 0, 1 },
+	{ "false", _false, false, 0, 1 },
+	{ "xor", _xor, false, 2, 1 },
+	{ "or", _or, false, 2, 1 },
+	{ "and", _and, false, 2, 1 },
+	{ "not", _not, false, 1, 1 },
+	{ "=", _eq, false, 2, 1 },
+	{ "<", lt, false, 2, 1 },
+	{ "within", within, false, 3, 1 },
+
+	{ "exit", forth_exit, false, 0, 0 },
+	{ "lit", literal, false, 0, 1 },
+	{ ":", compile_start, false, -1, -1 },
+	{ ";", compile_end, true, -1, -1 },
+	{ "'", literal, false, 0, 1 },
+
+	{ ">r", rpush, false, 1, 0 },
+	{ "r>", rpop, false, 0, 1 },
+	{ "i", rtop, false, 0, 1 },
+	{ "rshow", rtop, false, 0, 1 },
+	{ "(do)", forth_do, false, 2, 0 },
+	{ "(loop)", forth_loop, false, 0, 0 },
+	{ "(+loop)", forth_plus_loop, false, 1, 0 },
+	{ "leave", forth_leave, false, -1, -1 },
+	{ "unloop", forth_unloop, false, 0, 0 },
+	{ "j", forth_j, false, 0, 1 },
+	{ "@", memory_read, false, 1, 1 },
+	{ "!", memory_write, false, 2, 0 },
+	{ "here", here, false, 0, 1 },
+	{ "branch", branch, false, 0, 0 },
+	{ "0branch", branch0, false, 1, 0 },
+	{ "immediate", immediate, true, -1, -1 },
+
+	{ "word", next_word, false, 0, 2 },
+	{ ">cfa", _word_code, false, 1, 1 },
+	{ "find", ::find, false, 2, 1 },
+	{ ",", comma, false, 1, 0 },
+	{ "next", next, false, -1, -1 },
+	{ "spawn", task_spawn, false, 1, 0 },
+	{ "pause", task_pause, false, -1, -1 },
+	{ "join", task_join, false, -1, -1 },
+	{ "array-fill", array_fill, false, 3, 0 },
+	{ "array-move", array_move, false, 3, 0 },
+	{ "array-sum", array_sum, false, 2, 1 },
+	{ "array-min", array_min, false, 2, 1 },
+	{ "array-max", array_max, false, 2, 1 },
+	{ "array-dot", array_dot, false, 3, 1 },
+	{ "array-add", array_add, false, 3, 0 },
+	{ "array-mul", array_mul, false, 3, 0 },
+	{ "arrays-add", arrays_add, false, 3, 0 },
+	{ "arrays-mul", arrays_mul, false, 3, 0 },
+	{ "array-scan", array_scan, false, 2, 0 },
+	{ "base", number_base, false, 0, 1 },
+	{ "(tail)", tail_call, false, -1, -1 },
+	{ "recurse", recurse, true, -1, -1 },
+	{ "noinline", no_inline, true, -1, -1 },
+	{ "(lit<<)", lit_shl, false, 1, 1 },
+	{ "(lit>>)", lit_shr, false, 1, 1 },
+	{ "marker", marker, false, 0, 0 },
+	{ "(forget)", forget, false, 1, 0 }
+};
+
+#define PRIMITIVE_COUNT (sizeof(primitives) / sizeof(primitives[0]))
+
+const Primitive* getPrimitives(size_t *count){
+	*count = PRIMITIVE_COUNT;
+	return primitives;
 }
 
 void Forth::addMachineWords(){
 	int status = 0;
 	static const char *square[] = { "dup", "*", "exit", NULL};
-	this->addCodeword("interpret", interpreter_stub);
-	this->stopWord = this->latest;
-	this->executing = (Word *const*)&this->stopWord;
-	this->addCodeword("drop", drop);
-	this->addCodeword("dup", _dup);
-	this->addCodeword("+", add);
-	this->addCodeword("-", sub);
-	this->addCodeword("*", mul);
-	this->addCodeword("/", _div);
-	this->addCodeword("%", mod);
-	this->addCodeword("swap", swap);
-	this->addCodeword("rot", rot);
-	this->addCodeword("-rot", rot_back);
-	this->addCodeword("show", show);
-	this->addCodeword("over", over);
-	this->addCodeword("true", _true);
-	this->addCodeword("false", _false);
-	this->addCodeword("xor", _xor);
-	this->addCodeword("or", _or);
-	this->addCodeword("and", _and);
-	this->addCodeword("not", _not);
-	this->addCodeword("=", _eq);
-	this->addCodeword("<", lt);
-	this->addCodeword("within", within);
-
-	this->addCodeword("exit", forth_exit);
-	this->addCodeword("lit", literal);
-	this->addCodeword(":", compile_start);
-	this->addCodeword(";", compile_end);
-	this->latest->setImmediate(true);
-	this->addCodeword("'", literal);
-
-	this->addCodeword(">r", rpush);
-	this->addCodeword("r>", rpop);
-	this->addCodeword("i", rtop);
-	this->addCodeword("rshow", rtop);
-	this->addCodeword("@", memory_read);
-	this->addCodeword("!", memory_write);
-	this->addCodeword("here", here);
-	this->addCodeword("branch", branch);
-	this->addCodeword("0branch", branch0);
-	this->addCodeword("immediate", immediate);
-	this->latest->setImmediate(true);
-
-	this->addCodeword("word", next_word);
-	this->addCodeword(">cfa", _word_code);
-	this->addCodeword("find", find);
-	this->addCodeword(",", comma);
-	this->addCodeword("next", next);
+	for(size_t i = 0; i < PRIMITIVE_COUNT; i++){
+		this->addCodeword(primitives[i].name, primitives[i].handler);
+		this->latest->setImmediate(primitives[i].immediate);
+		this->latest->setStackEffect(primitives[i].in, primitives[i].out);
+		if(primitives[i].handler == interpreter_stub){
+			this->stopWord = this->latest;
+			this->stopWord->setOpcode(OPCODE_STOP);
+			this->executing = (Word *const*)&this->stopWord;
+		}
+	}
+	addFusedWords(*this);
 	
 	status = this->addCompiledWord("square", square);
 	if(status)
@@ -103,14 +249,16 @@ void Forth::addMachineWords(){
 
 // Data stack management
 
+// A push to a full stack hits the guard page above it and throws from
+// the fault handler. The value is written before the pointer moves, so
+// the stack is left as it was.
 void Forth::push(cell value){
-	// Ensure we have room for new data
-	if(this->stackPointer == this->stackBottom + this->dataSize)
-		throw ForthOutOfMemoryException("push: data stack full");
 	*(this->stackPointer) = value;
 	this->stackPointer += 1;
 }
 
+// The cell below the bottom is the scratch cell of the cached engine, so
+// the guard page is one cell lower and pops still compare
 cell Forth::pop(){
 	if (this->stackPointer == this->stackBottom){
 		throw ForthEmptyStackException("pop: data stack empty");
@@ -129,34 +277,348 @@ cell* Forth::top(){
 void Forth::addCodeword(const char *name, const function handler){
 	if(strlen(name) >= 32)
 		throw ForthIllegalArgumentException("addCodeword: too long name");
-	if((uint8_t*)this->freeMemory + align(sizeof(Word) + 1 + strlen(name), sizeof(cell)) >
-		(uint8_t*)(this->memory + this->memorySize)){
-		throw ForthOutOfMemoryException("addCodeword: dictionary is full");
-	}
-	this->addWord(name, strlen(name), false);
+	Word *word = this->addWord(name, strlen(name), false);
+	word->setOpcode(findOpcode(handler));
 	this->emit((cell)handler);
 }
 
 void Forth::emit(cell value){
+	if(this->frozen)
+		throw ForthIllegalStateException("emit: dictionary is frozen");
+	if(this->freeMemory == this->committedMemory)
+		this->growMemory(sizeof(cell), "emit: dictionary is full");
 	*(this->freeMemory) = value;
 	this->freeMemory += 1;
 }
 
 Word* Forth::addWord(const char *name, uint8_t length, bool isCompiled){
+	if(this->frozen)
+		throw ForthIllegalStateException("addWord: dictionary is frozen");
+	this->growMemory(align(sizeof(Word) + 1 + length, sizeof(cell)), "addWord: dictionary is full");
 	Word newWord(this->latest, isCompiled);
 	Word *word = reinterpret_cast<Word*>(this->freeMemory);
 	*word = newWord;
 	word->setName(name, length);
     this->freeMemory = (cell*)(word->getCode());
 	this->latest = word;
+	this->indexWord(word);
 	return word;
 }
 
+// Memory arena. The whole size is reserved as address space at once,
+// so the addresses never change, and is committed by chunks as the
+// dictionary grows. Chunks are huge pages if the system has them.
+
+// The arena starts at a chunk boundary, so chunks can be huge pages
+static cell* reserveArena(size_t size){
+	size_t length = roundUp(size, ARENA_CHUNK);
+	uint8_t *start, *aligned;
+	void *arena = mmap(NULL, length + ARENA_CHUNK, PROT_NONE,
+		MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+	if(arena == MAP_FAILED)
+		return NULL;
+	start = (uint8_t*)arena;
+	aligned = (uint8_t*)roundUp((size_t)start, ARENA_CHUNK);
+	if(aligned > start)
+		munmap(start, (size_t)(aligned - start));
+	munmap(aligned + length, (size_t)(start + ARENA_CHUNK - aligned));
+	return (cell*)aligned;
+}
+
+// Makes sure size bytes from freeMemory on can be written
+void Forth::growMemory(size_t size, const char *cause){
+	uint8_t *end = (uint8_t*)this->committedMemory;
+	uint8_t *limit = (uint8_t*)(this->memory + this->memorySize);
+	if((uint8_t*)this->freeMemory + size <= end)
+		return;
+	if(size > (size_t)(limit - (uint8_t*)this->freeMemory))
+		throw ForthOutOfMemoryException(cause);
+	while((uint8_t*)this->freeMemory + size > end){
+		size_t chunk = ARENA_CHUNK < (size_t)(limit - end) ? ARENA_CHUNK : (size_t)(limit - end);
+		void *mapped = MAP_FAILED;
+#ifdef MAP_HUGETLB
+		if(this->hugePages && chunk == ARENA_CHUNK)
+			mapped = mmap(end, chunk, PROT_READ | PROT_WRITE,
+				MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED | MAP_HUGETLB, -1, 0);
+#endif
+		// A failed MAP_FIXED may have unmapped the range, so it is mapped again
+		if(mapped == MAP_FAILED){
+			mapped = mmap(end, roundUp(chunk, (size_t)sysconf(_SC_PAGESIZE)), PROT_READ | PROT_WRITE,
+				MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED | MAP_NORESERVE, -1, 0);
+			if(mapped == MAP_FAILED)
+				throw ForthOutOfMemoryException(cause);
+#ifdef MADV_HUGEPAGE
+			if(this->hugePages)
+				madvise(end, chunk, MADV_HUGEPAGE);
+#endif
+		}
+		end += chunk;
+		this->committedMemory = (cell*)end;
+	}
+}
+
+void Forth::setHugePages(bool enabled){
+	this->hugePages = enabled;
+}
+
+bool Forth::isHugePages() const{
+	return this->hugePages;
+}
+
+// Stacks. Each one is mapped between two PROT_NONE guard pages and its size
+// is rounded up to whole pages, so it ends right at the upper one and
+// pushing to a full stack faults. The return stack starts right at the
+// lower one too. The data stack has a scratch cell of the cached engine
+// below its bottom. The fault
+// handler finds the guard in a table of all stacks of the process and
+// throws the exception the check would have thrown. It works because
+// everything is built with -fnon-call-exceptions.
+
+struct GuardedStack {
+	// Lower guard page, NULL for a free slot
+	uint8_t *volatile low;
+	uint8_t *high;
+	bool returnStack;
+};
+
+// The table grows by chunks that are never freed, so the handler can walk
+// it without the lock while another thread adds a stack
+struct GuardChunk {
+	GuardedStack stacks[GUARD_CHUNK];
+	GuardChunk *volatile next;
+};
+
+static GuardChunk guardedStacks;
+static pthread_mutex_t guardedLock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_once_t guardOnce = PTHREAD_ONCE_INIT;
+static struct sigaction previousFault;
+static size_t pageSize;
+
+static void stackFault(int signal, siginfo_t *info, void *context){
+	uint8_t *address = (uint8_t*)info->si_addr;
+	for(GuardChunk *chunk = &guardedStacks; chunk; chunk = chunk->next){
+		for(size_t i = 0; i < GUARD_CHUNK; i++){
+			GuardedStack *stack = &chunk->stacks[i];
+			uint8_t *low = stack->low;
+			if(!low)
+				continue;
+			if(address >= stack->high && address < stack->high + pageSize){
+				if(stack->returnStack)
+					throw ForthOutOfMemoryException("pushReturn: return stack full");
+				throw ForthOutOfMemoryException("push: data stack full");
+			}
+			if(address >= low && address < low + pageSize){
+				if(stack->returnStack)
+					throw ForthEmptyStackException("popReturn: return stack empty");
+				throw ForthEmptyStackException("pop: data stack empty");
+			}
+		}
+	}
+	// Not ours: the handler there was before takes it
+	if((previousFault.sa_flags & SA_SIGINFO) && previousFault.sa_sigaction)
+		previousFault.sa_sigaction(signal, info, context);
+	else if(previousFault.sa_handler != SIG_DFL && previousFault.sa_handler != SIG_IGN)
+		previousFault.sa_handler(signal);
+	else {
+		// The fault happens again on return and ends the process as usual
+		struct sigaction action;
+		memset(&action, 0, sizeof(action));
+		action.sa_handler = SIG_DFL;
+		sigemptyset(&action.sa_mask);
+		sigaction(SIGSEGV, &action, NULL);
+	}
+}
+
+static void installStackFault(){
+	struct sigaction action;
+	pageSize = (size_t)sysconf(_SC_PAGESIZE);
+	memset(&action, 0, sizeof(action));
+	action.sa_sigaction = stackFault;
+	// The handler does not return when it throws, so the signal stays unblocked
+	action.sa_flags = SA_SIGINFO | SA_NODEFER;
+	sigemptyset(&action.sa_mask);
+	sigaction(SIGSEGV, &action, &previousFault);
+}
+
+// Cells between the guard pages that are not part of the stack
+static size_t stackScratch(bool returnStack){
+	return returnStack ? 0 : 1;
+}
+
+// Bytes between the guard pages
+static size_t stackLength(size_t cells, bool returnStack){
+	return roundUp((cells + stackScratch(returnStack)) * sizeof(cell), pageSize);
+}
+
+// Takes a free slot of the table, adding a chunk if there is none
+static GuardedStack* guardSlot(){
+	GuardChunk *chunk = &guardedStacks;
+	for(;;){
+		for(size_t i = 0; i < GUARD_CHUNK; i++){
+			if(!chunk->stacks[i].low)
+				return &chunk->stacks[i];
+		}
+		if(!chunk->next){
+			GuardChunk *added = new GuardChunk();
+			// The handler must see the chunk cleared before it is linked
+			__sync_synchronize();
+			chunk->next = added;
+		}
+		chunk = chunk->next;
+	}
+}
+
+// Returns the bottom of a stack of at least the given number of cells,
+// NULL on failure. The number is rounded up to what fits in the pages.
+static cell* mapStack(size_t *cells, bool returnStack){
+	size_t length;
+	uint8_t *start;
+	void *mapped;
+	GuardedStack *slot;
+	pthread_once(&guardOnce, installStackFault);
+	length = stackLength(*cells, returnStack);
+	mapped = mmap(NULL, length + 2 * pageSize, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+	if(mapped == MAP_FAILED)
+		return NULL;
+	start = (uint8_t*)mapped;
+	if(mprotect(start + pageSize, length, PROT_READ | PROT_WRITE)){
+		munmap(mapped, length + 2 * pageSize);
+		return NULL;
+	}
+	pthread_mutex_lock(&guardedLock);
+	slot = guardSlot();
+	slot->high = start + pageSize + length;
+	slot->returnStack = returnStack;
+	// The handler only looks at a slot once low is set
+	__sync_synchronize();
+	slot->low = start;
+	pthread_mutex_unlock(&guardedLock);
+	*cells = length / sizeof(cell) - stackScratch(returnStack);
+	return (cell*)(start + pageSize + length) - *cells;
+}
+
+static void unmapStack(cell *bottom, size_t cells, bool returnStack){
+	size_t length;
+	uint8_t *high;
+	if(!bottom)
+		return;
+	length = stackLength(cells, returnStack);
+	high = (uint8_t*)(bottom + cells);
+	pthread_mutex_lock(&guardedLock);
+	for(GuardChunk *chunk = &guardedStacks; chunk; chunk = chunk->next){
+		for(size_t i = 0; i < GUARD_CHUNK; i++){
+			if(chunk->stacks[i].low && chunk->stacks[i].high == high)
+				chunk->stacks[i].low = NULL;
+		}
+	}
+	pthread_mutex_unlock(&guardedLock);
+	munmap(high - length - pageSize, length + 2 * pageSize);
+}
+
+size_t Forth::getMemorySize() const{
+	return this->memorySize;
+}
+
+size_t Forth::getCommittedMemory() const{
+	return (size_t)(this->committedMemory - this->memory);
+}
+
+// Dictionary index
+
+void Forth::indexWord(Word *word){
+	if(this->indexCount >= this->indexSize)
+		this->rebuildIndex(this->indexSize * 2);
+	else {
+		// Newest word goes to the head of its bucket, so it shadows older ones
+		size_t bucket = hashName(word->getName(), word->getNameLength()) & (this->indexSize - 1);
+		word->setNextInBucket(this->index[bucket]);
+		this->index[bucket] = word;
+		this->indexCount += 1;
+	}
+}
+
+void Forth::rebuildIndex(size_t newSize){
+	Word **newIndex = new Word*[newSize]();
+	Word **tails = new Word*[newSize]();
+	// Walk from the newest word to the oldest and append to the tails
+	// to keep the newest-first order in every bucket
+	for(Word *word = this->latest; word != this->sharedLatest; word = word->getNextWord()){
+		size_t bucket = hashName(word->getName(), word->getNameLength()) & (newSize - 1);
+		word->setNextInBucket(NULL);
+		if(tails[bucket])
+			tails[bucket]->setNextInBucket(word);
+		else
+			newIndex[bucket] = word;
+		tails[bucket] = word;
+	}
+	delete [] tails;
+	delete [] this->index;
+	this->index = newIndex;
+	this->indexSize = newSize;
+	this->indexCount = 0;
+	for(Word *word = this->latest; word != this->sharedLatest; word = word->getNextWord())
+		this->indexCount += 1;
+}
+
+// The words after keep are the newest ones, so each of them is the head
+// of its bucket when it is dropped
+void Forth::forget(Word *keep, cell *end){
+	while(this->latest != keep){
+		Word *dropped = this->latest;
+		size_t bucket = hashName(dropped->getName(), dropped->getNameLength()) & (this->indexSize - 1);
+		this->index[bucket] = dropped->getNextInBucket();
+		this->indexCount -= 1;
+		this->latest = dropped->getNextWord();
+		if(dropped == this->stopWord)
+			this->stopWord = NULL;
+	}
+	this->freeMemory = end;
+}
+
+void Forth::mark(ForthMarker *marker) const{
+	marker->latest = this->latest;
+	marker->freeMemory = this->freeMemory;
+}
+
+void Forth::rollback(const ForthMarker &marker){
+	if(this->frozen)
+		throw ForthIllegalStateException("rollback: dictionary is frozen");
+	if(marker.freeMemory < this->memory || marker.freeMemory > this->freeMemory ||
+			(marker.latest != this->sharedLatest &&
+				(!this->isWritable(marker.latest) || (cell*)marker.latest >= marker.freeMemory)))
+		throw ForthIllegalArgumentException("rollback: marker is not in this dictionary");
+	this->forget(marker.latest, marker.freeMemory);
+}
+
+// Own words shadow the words of the shared dictionaries
+const Word* Forth::find(const char *name, uint8_t length) const{
+	size_t hash = hashName(name, length);
+	for(const Forth *vm = this; vm; vm = vm->shared){
+		const Word *word = vm->index[hash & (vm->indexSize - 1)];
+		while(word){
+			if(!word->isHidden() && length == word->getNameLength() &&
+					!strncmp(word->getName(), name, length))
+				return word;
+			word = word->getNextInBucket();
+		}
+	}
+	return NULL;
+}
+
+// Infers the effect of a compiled word ending at end, see analyseDataStack
+static bool recordStackEffect(const Forth &forth, Word *word, const cell *end){
+	StackEffect effect;
+	if(!analyseDataStack(forth, word, end, &effect))
+		return false;
+	word->setStackEffect(effect.in, effect.out);
+	return true;
+}
+
 int Forth::addCompiledWord(const char *name, const char **words){
 	Word *newWord = this->addWord(name, strlen(name), true);
 	newWord->setHidden(true);
 	while(*words) {
-		const Word *word = this->latest->find(*words, strlen(*words));
+		const Word *word = this->find(*words, strlen(*words));
 		if(!word) {
 			return 1;
 		}
@@ -164,6 +626,7 @@ int Forth::addCompiledWord(const char *name, const char **words){
 		words += 1;
 	}
 	newWord->setHidden(false);
+	recordStackEffect(*this, newWord, this->freeMemory);
 	return 0;
 }
 
@@ -172,38 +635,115 @@ int Forth::addCompiledWord(const char *name, const char **words){
 ForthResult Forth::run(){
 	size_t length;
 	ForthResult readResult;
-	char wordBuffer[MAX_WORD + 1] = {0};
-	while((readResult = readWord(this->input, wordBuffer, 
-					sizeof(wordBuffer), &length)) == FORTH_OK){
-		const Word *word = this->latest->find(wordBuffer, length);
-		if(!word)
-			this->runNumber(wordBuffer, length);
-        else if(word->isImmediate() || !this->compiling)
-            this->runWord(word);
-		else
-            this->emit((cell)word);
+	const char *token;
+	for(;;){
+		try{
+			// Other tasks run while the input has nothing to read
+			while(this->taskCount && !this->tokenizer->isReady())
+				this->yield();
+			if((readResult = this->readToken(&token, &length)) != FORTH_OK)
+				break;
+			// Up to base 10 numbers are told from words by their first
+			// character and skip the dictionary. In larger bases words
+			// could be numbers too, so those are tried when no word is found.
+			cell number;
+			if(isNumberStart(*token) && this->base >= 2 && this->base <= 10 &&
+					parseNumber(token, length, this->base, &number)){
+				this->runLiteral(number);
+				continue;
+			}
+			const Word *word = this->find(token, length);
+			if(!word)
+				this->runNumber(token, length);
+			else if(word->isImmediate() || !this->compiling)
+				this->runWord(word);
+			else
+				this->emit((cell)word);
+		} catch(ForthException &e) {
+			if(!this->recovery)
+				throw;
+			fprintf(this->errors, "Error: %s\n", e.getCause());
+			this->recover();
+		}
 	}
 	return readResult;
 
 }
 
-void Forth::runNumber(const char *wordBuffer, size_t length){
-	char *end;
-	intptr_t number = strtoiptr(wordBuffer, &end, 10); // TODO
-	if(end - wordBuffer < (int)length){
-		fprintf(stderr, "Unknown word: '%.*s'\n", (int)length, wordBuffer);
-	} else if(!this->compiling)
+void Forth::setRecovery(bool enabled){
+	this->recovery = enabled;
+}
+
+bool Forth::isRecoveryEnabled() const{
+	return this->recovery;
+}
+
+void Forth::recover(){
+	Word *word = this->latest;
+	this->suspended = false;
+	this->endTasks();
+	this->executing = (Word *const*)&this->stopWord;
+	this->stackPointer = this->stackBottom;
+	this->returnStackPointer = this->returnStackBottom;
+	// The word being defined is hidden until ;
+	if(this->compiling && word && word != this->sharedLatest && word->isHidden())
+		this->forget(word->getNextWord(), (cell*)word);
+	this->compiling = false;
+}
+
+void Forth::runNumber(const char *token, size_t length){
+	cell number;
+	if(this->base < 2 || this->base > 36)
+		throw ForthIllegalStateException("runNumber: base is out of range");
+	if(parseNumber(token, length, this->base, &number))
+		this->runLiteral(number);
+	else
+		fprintf(this->errors, "Unknown word: '%.*s'\n", (int)(length > MAX_WORD ? MAX_WORD : length), token);
+}
+
+void Forth::runLiteral(cell number){
+	if(!this->compiling)
 		this->push(number);
     else{
-        const Word *word = this->latest->find("lit", strlen("lit"));
+        const Word *word = this->find("lit", strlen("lit"));
         if(!word)
-            throw ForthIllegalStateException("runNumber: literal word missing");
+            throw ForthIllegalStateException("runLiteral: literal word missing");
         this->emit((cell)word);
         this->emit(number);
     }
 }
 
+// The inner interpreters stop at the stop word: the word run by the
+// main task or by execute is done, or the task running has reached the end
+// of its word. Only in the last case, at the stop word of its start cells,
+// the task is ended and the next one goes on where it paused.
 void Forth::runWord(const Word* word){
+	if(this->suspended)
+		throw ForthIllegalStateException("runWord: a word is suspended");
+	for(;;){
+		try{
+			if(this->engine == FORTH_ENGINE_CACHED)
+				this->runCached(word);
+			else if(this->engine == FORTH_ENGINE_DIRECT)
+				this->runDirect(word);
+			else
+				this->runIndirect(word);
+		} catch(...) {
+			this->abortTask();
+			throw;
+		}
+		ForthTask *task = this->currentTask;
+		if(task == &this->mainTask || this->executing != task->start + 1)
+			return;
+		this->switchTask(task->next);
+		this->removeTask(task);
+		word = *this->executing;
+		if(word == this->stopWord)
+			return;
+	}
+}
+
+void Forth::runIndirect(const Word* word){
     do{
         if(*this->executing != this->stopWord)
             this->executing += 1;
@@ -212,6 +752,8 @@ void Forth::runWord(const Word* word){
             // But C++ does not
             const function code = *(const function*)word->getConstCode();
 			code(*this);
+        } else if(word->getNative()){
+            this->runNative(word);
         } else{
             this->pushReturn((cell)this->executing);
             this->executing = (Word *const*)word->getConstCode();
@@ -220,6 +762,200 @@ void Forth::runWord(const Word* word){
     } while(word != this->stopWord);
 }
 
+ForthResult Forth::runLimited(const Word *word, size_t budget, long timeout){
+	if(this->suspended)
+		throw ForthIllegalStateException("runLimited: a word is suspended");
+	if(!this->stopWord)
+		throw ForthIllegalStateException("runLimited: machine words are missing");
+	// Started like a task, so reaching the stop word is the end
+	this->mainTask.start[0] = (Word*)(cell)word;
+	this->mainTask.start[1] = this->stopWord;
+	this->executing = this->mainTask.start;
+	this->suspended = true;
+	return this->resume(budget, timeout);
+}
+
+// The indirect interpreter with a counter. Primitives that run words
+// themselves, like join, count as one instruction.
+ForthResult Forth::resume(size_t budget, long timeout){
+	double deadline = timeout > 0 ? monotonicSeconds() + timeout / 1e6 : 0;
+	if(!this->suspended)
+		throw ForthIllegalStateException("resume: no word is suspended");
+	this->suspended = false;
+	try{
+		while(budget){
+			const Word *word = *this->executing;
+			if(word == this->stopWord){
+				ForthTask *task = this->currentTask;
+				if(task == &this->mainTask){
+					this->executing = (Word *const*)&this->stopWord;
+					return FORTH_OK;
+				}
+				this->switchTask(task->next);
+				this->removeTask(task);
+				continue;
+			}
+			this->executing += 1;
+			budget -= 1;
+			if(!word->isCompiled()){
+				const function code = *(const function*)word->getConstCode();
+				code(*this);
+			} else{
+				this->pushReturn((cell)this->executing);
+				this->executing = (Word *const*)word->getConstCode();
+			}
+			if(timeout > 0 && budget % LIMIT_CLOCK_INTERVAL == 0 && monotonicSeconds() >= deadline)
+				break;
+		}
+	} catch(...) {
+		this->abortTask();
+		throw;
+	}
+	this->suspended = true;
+	return FORTH_SUSPENDED;
+}
+
+bool Forth::isSuspended() const{
+	return this->suspended;
+}
+
+void Forth::cancel(){
+	if(!this->suspended)
+		return;
+	this->suspended = false;
+	if(this->currentTask != &this->mainTask)
+		this->switchTask(&this->mainTask);
+	this->executing = (Word *const*)&this->stopWord;
+	this->returnStackPointer = this->returnStackBottom;
+}
+
+void Forth::runNative(const Word *word){
+	if(word->getNative()(this))
+		this->jit->raise();
+}
+
+// Runs a word to completion, also from inside a running word
+void Forth::execute(const Word *word){
+	Word *const *saved = this->executing;
+	this->executing = (Word *const*)&this->stopWord;
+	try{
+		this->runWord(word);
+	} catch(...) {
+		this->executing = saved;
+		throw;
+	}
+	this->executing = saved;
+}
+
+// Tasks
+
+void Forth::spawn(const Word *word, size_t _stackSize, size_t _returnStackSize){
+	ForthTask *task;
+	if(!this->stopWord)
+		throw ForthIllegalStateException("spawn: machine words are missing");
+	if(!word || word == this->stopWord || !this->inDictionary((cell)word))
+		throw ForthIllegalArgumentException("spawn: not a word");
+	task = new ForthTask;
+	task->dataSize = _stackSize;
+	task->returnStackSize = _returnStackSize;
+	task->stackBottom = mapStack(&task->dataSize, false);
+	task->returnStackBottom = mapStack(&task->returnStackSize, true);
+	if(!task->stackBottom || !task->returnStackBottom){
+		unmapStack(task->stackBottom, task->dataSize, false);
+		unmapStack(task->returnStackBottom, task->returnStackSize, true);
+		delete task;
+		throw ForthOutOfMemoryException("spawn: failed to allocate the stacks");
+	}
+	task->stackPointer = task->stackBottom;
+	task->returnStackPointer = task->returnStackBottom;
+	task->start[0] = (Word*)(cell)word;
+	task->start[1] = this->stopWord;
+	task->executing = task->start;
+	// New tasks go to the end of the round
+	task->next = &this->mainTask;
+	task->previous = this->mainTask.previous;
+	task->previous->next = task;
+	this->mainTask.previous = task;
+	this->taskCount += 1;
+}
+
+void Forth::switchTask(ForthTask *task){
+	ForthTask *current = this->currentTask;
+	current->stackPointer = this->stackPointer;
+	current->returnStackPointer = this->returnStackPointer;
+	current->executing = this->executing;
+	this->stackBottom = task->stackBottom;
+	this->stackPointer = task->stackPointer;
+	this->dataSize = task->dataSize;
+	this->returnStackBottom = task->returnStackBottom;
+	this->returnStackPointer = task->returnStackPointer;
+	this->returnStackSize = task->returnStackSize;
+	this->executing = task->executing;
+	this->currentTask = task;
+}
+
+// The task must not be the running one
+void Forth::removeTask(ForthTask *task){
+	task->previous->next = task->next;
+	task->next->previous = task->previous;
+	this->taskCount -= 1;
+	unmapStack(task->stackBottom, task->dataSize, false);
+	unmapStack(task->returnStackBottom, task->returnStackSize, true);
+	delete task;
+}
+
+// After an exception: a failing task ends, the main task goes on
+void Forth::abortTask(){
+	ForthTask *task = this->currentTask;
+	if(task != &this->mainTask){
+		this->switchTask(&this->mainTask);
+		this->removeTask(task);
+	}
+}
+
+void Forth::endTasks(){
+	if(this->currentTask != &this->mainTask)
+		this->switchTask(&this->mainTask);
+	while(this->mainTask.next != &this->mainTask)
+		this->removeTask(this->mainTask.next);
+}
+
+void Forth::pause(){
+	this->switchTask(this->currentTask->next);
+}
+
+// The main task waits at the stop word, so the inner interpreter
+// returns here when the round comes back to it
+void Forth::yield(){
+	Word *const *saved = this->executing;
+	if(this->currentTask != &this->mainTask)
+		throw ForthIllegalStateException("yield: only the main task runs the others");
+	if(!this->taskCount)
+		return;
+	this->executing = (Word *const*)&this->stopWord;
+	try{
+		this->pause();
+		this->runWord(*this->executing);
+	} catch(...) {
+		this->executing = saved;
+		throw;
+	}
+	this->executing = saved;
+}
+
+void Forth::join(){
+	while(this->taskCount)
+		this->yield();
+}
+
+size_t Forth::getTaskCount() const{
+	return this->taskCount;
+}
+
+bool Forth::isMainTask() const{
+	return this->currentTask == &this->mainTask;
+}
+
 cell* Forth::getStackBottom() const{
     return this->stackBottom;
 }
@@ -228,6 +964,14 @@ cell* Forth::getStackPointer() const{
     return this->stackPointer;
 }
 
+size_t Forth::getStackSize() const{
+	return this->dataSize;
+}
+
+size_t Forth::getReturnStackSize() const{
+	return this->returnStackSize;
+}
+
 cell* Forth::getMemory() const{
     return this->memory;
 }
@@ -236,6 +980,32 @@ cell* Forth::getFreeMemory() const{
     return this->freeMemory;
 }
 
+bool Forth::inDictionary(cell address) const{
+	for(const Forth *vm = this; vm; vm = vm->shared){
+		if(address >= (cell)vm->memory && address < (cell)vm->freeMemory)
+			return true;
+	}
+	return false;
+}
+
+bool Forth::isWritable(const Word *word) const{
+	return !this->frozen && (cell)word >= (cell)this->memory && (cell)word < (cell)this->freeMemory;
+}
+
+void Forth::freeze(){
+	if(this->compiling)
+		throw ForthIllegalStateException("freeze: a word is being compiled");
+	this->frozen = true;
+}
+
+bool Forth::isFrozen() const{
+	return this->frozen;
+}
+
+const Forth* Forth::getShared() const{
+	return this->shared;
+}
+
 Word* Forth::getLatest() const{
     return this->latest;
 }
@@ -266,26 +1036,124 @@ FILE* Forth::getInput(){
 
 void Forth::setInput(FILE *newInput){
 	this->input = newInput;
+	this->tokenizer->open(newInput);
+}
+
+void Forth::setOutput(FILE *newOutput){
+	this->output = newOutput;
+}
+
+FILE* Forth::getOutput() const{
+	return this->output;
+}
+
+void Forth::setErrors(FILE *newErrors){
+	this->errors = newErrors;
+}
+
+FILE* Forth::getErrors() const{
+	return this->errors;
+}
+
+ForthResult Forth::readToken(const char **token, size_t *length){
+	return this->tokenizer->next(token, length, MAX_WORD);
 }
 
 void Forth::setCompiling(bool _compiling){
 	this->compiling = _compiling;
 }
 
+void Forth::setEngine(ForthEngine _engine){
+	if(_engine != FORTH_ENGINE_INDIRECT && !hasDirectEngine())
+		throw ForthIllegalArgumentException("setEngine: direct threading is not supported by this build");
+	this->engine = _engine;
+}
+
+ForthEngine Forth::getEngine() const{
+	return this->engine;
+}
+
+void Forth::setJit(bool enabled){
+	if(enabled && !hasJit())
+		throw ForthIllegalArgumentException("setJit: JIT is not supported on this platform");
+	// Native code of already translated words stays in use when disabled
+	if(enabled && !this->jit)
+		this->jit = new Jit();
+	this->jitEnabled = enabled;
+}
+
+bool Forth::isJitEnabled() const{
+	return this->jitEnabled;
+}
+
+void Forth::setFusion(bool enabled){
+	this->fusionEnabled = enabled;
+}
+
+bool Forth::isFusionEnabled() const{
+	return this->fusionEnabled;
+}
+
+void Forth::setTailCalls(bool enabled){
+	this->tailCallsEnabled = enabled;
+}
+
+bool Forth::isTailCallsEnabled() const{
+	return this->tailCallsEnabled;
+}
+
+void Forth::setWarnings(bool enabled){
+	this->warningsEnabled = enabled;
+}
+
+bool Forth::isWarningsEnabled() const{
+	return this->warningsEnabled;
+}
+
+void Forth::setInlineLimit(size_t cells){
+	this->inlineLimit = cells;
+}
+
+size_t Forth::getInlineLimit() const{
+	return this->inlineLimit;
+}
+
+// Compile-time passes over a word closed by ;
+void Forth::finishWord(Word *word){
+	ReturnEffect frame;
+	this->freeMemory = inlineCalls(*this, word, this->freeMemory,
+		(size_t)(this->committedMemory - this->freeMemory));
+	this->freeMemory = foldConstants(*this, word, this->freeMemory);
+	if(this->fusionEnabled)
+		this->freeMemory = fuseWord(*this, word, this->freeMemory);
+	if(this->tailCallsEnabled)
+		this->freeMemory = tailCalls(*this, word, this->freeMemory,
+			(size_t)(this->committedMemory - this->freeMemory));
+	// Known effects let the threaded engines drop depth checks in the word
+	recordStackEffect(*this, word, this->freeMemory);
+	// Only the cells a word pushed itself are its to take from the return
+	// stack, below them are the return address and the frames of its callers
+	if(this->warningsEnabled && analyseReturnStack(*this, word, this->freeMemory, &frame) && frame.lowest < 1)
+		fprintf(this->errors, "Warning: '%.*s' takes %d return stack cells it did not push\n",
+			(int)word->getNameLength(), word->getName(), 1 - frame.lowest);
+	if(this->jitEnabled)
+		this->jit->compile(*this, word, this->freeMemory);
+}
+
 // Return stack management
 
+// Overflows are caught by the guard page as in push
 void Forth::pushReturn(cell value){
-	if(this->returnStackPointer == this->returnStackBottom + this->returnStackSize)
-		throw ForthOutOfMemoryException("pushReturn: return stack full");
 	*(this->returnStackPointer) = value;
 	this->returnStackPointer++;
 }
 
+// The bottom of the return stack is right on the guard page below it, a pop
+// from an empty stack faults before the pointer moves
 cell Forth::popReturn(){
-	if(this->returnStackPointer == this->returnStackBottom)
-		throw ForthEmptyStackException("popReturn: return stack empty");
-	this->returnStackPointer--;
-	return *(this->returnStackPointer);
+	cell value = this->returnStackPointer[-1];
+	this->returnStackPointer -= 1;
+	return value;
 }
 
 // End of Forth implementation
@@ -293,7 +1161,8 @@ cell Forth::popReturn(){
 // Word class
 
 Word::Word(Word *_next, bool _compiled, bool _hidden, bool _immediate):
-    next(_next), compiled(_compiled), hidden(_hidden), immediate(_immediate), length(0){}
+    next(_next), nextInBucket(NULL), compiled(_compiled), hidden(_hidden), immediate(_immediate), inlinable(true), length(0),
+    opcode(_compiled ? OPCODE_CALL : OPCODE_PRIMITIVE), stackIn(-1), stackOut(-1), native(NULL){}
 
 //Word::Word(const char *_name, uint8_t _length, Word *_next):
 //	length(_length), next(_next) {
@@ -308,6 +1177,14 @@ void Word::setNextWord(Word *newWord){
 	this->next = newWord;
 }
 
+Word* Word::getNextInBucket() const {
+	return this->nextInBucket;
+}
+
+void Word::setNextInBucket(Word *newWord){
+	this->nextInBucket = newWord;
+}
+
 uint8_t Word::getNameLength() const{
 	return this->length;
 }
@@ -329,11 +1206,6 @@ void* Word::getCode() {
 	return (void*)((uint8_t*)this + size);
 }
 
-const void* Word::getConstCode() const {
-	uintptr_t size = align(sizeof(Word) + 1 + this->length, sizeof(cell));
-	return (const void*)((const uint8_t*)this + size);
-}
-
 const Word* Word::find(const char *name, uint8_t length) const {
 	const Word *word = this;
 	while(word){
@@ -355,12 +1227,48 @@ bool Word::isCompiled() const{
 
 void Word::setCompiled(bool _compiled){
 	this->compiled = _compiled;
+	this->opcode = _compiled ? OPCODE_CALL : OPCODE_PRIMITIVE;
+}
+
+void Word::setNative(nativeCode _native){
+	this->native = _native;
+}
+
+nativeCode Word::getNative() const{
+	return this->native;
+}
+
+void Word::setStackEffect(int in, int out){
+	if(in < 0 || out < 0 || in > INT8_MAX || out > INT8_MAX)
+		in = out = -1;
+	this->stackIn = (int8_t)in;
+	this->stackOut = (int8_t)out;
+}
+
+int Word::getStackOut() const{
+	return this->stackOut;
+}
+
+bool Word::hasStackEffect() const{
+	return this->stackIn >= 0;
+}
+
+void Word::setOpcode(uint8_t _opcode){
+	this->opcode = _opcode;
 }
 
 void Word::setImmediate(bool _immediate){
 	this->immediate = _immediate;
 }
 
+void Word::setInlinable(bool _inlinable){
+	this->inlinable = _inlinable;
+}
+
+bool Word::isInlinable() const{
+	return this->inlinable;
+}
+
 void Word::setHidden(bool _hidden){
 	this->hidden = _hidden;
 }
@@ -373,8 +1281,8 @@ bool Word::isHidden() const{
 
 // Miscellaneous functions
 
-void printCell(cell c) {
-    printf("%" PRIdPTR " ", c);
+void printCell(FILE *output, cell c) {
+    fprintf(output, "%" PRIdPTR " ", c);
 }
 
 ForthResult readWord(FILE* source,
@@ -407,15 +1315,67 @@ ForthResult readWord(FILE* source,
     return FORTH_EOF;
 }
 
-static intptr_t strtoiptr(const char* ptr, char** endptr, int base){
-    if (sizeof(intptr_t) <= sizeof(long)) {
-        return (intptr_t)strtol(ptr, endptr, base);
-    } else {
-        return (intptr_t)strtoll(ptr, endptr, base);
+// Digits are 0-9 and letters, case insensitive. Numbers wrap
+// like cell arithmetic instead of saturating.
+static bool parseNumber(const char *token, size_t length, cell base, cell *number){
+	const char *end = token + length;
+	bool negative = false;
+	uintptr_t value = 0;
+	if(token < end && (*token == '$' || *token == '#' || *token == '%')){
+		base = *token == '$' ? 16 : *token == '#' ? 10 : 2;
+		token += 1;
+	}
+	if(token < end && *token == '-'){
+		negative = true;
+		token += 1;
+	}
+	if(token == end)
+		return false;
+	for(; token < end; token++){
+		unsigned digit;
+		if(*token >= '0' && *token <= '9')
+			digit = (unsigned)(*token - '0');
+		else if((*token | 0x20) >= 'a' && (*token | 0x20) <= 'z')
+			digit = (unsigned)((*token | 0x20) - 'a' + 10);
+		else
+			return false;
+		if(digit >= (unsigned)base)
+			return false;
+		value = value * (uintptr_t)base + digit;
+	}
+	*number = (cell)(negative ? 0 - value : value);
+	return true;
+}
+
+static bool isNumberStart(char c){
+	return (c >= '0' && c <= '9') || c == '-' || c == '$' || c == '#' || c == '%';
+}
+
+// FNV-1a
+static size_t hashName(const char *name, uint8_t length){
+    uint32_t hash = 2166136261u;
+    for(uint8_t i = 0; i < length; i++){
+        hash ^= (uint8_t)name[i];
+        hash *= 16777619u;
     }
+    return hash;
 }
 
 static uintptr_t align(uintptr_t value, uint8_t alignment){
     return ((value - 1) | (alignment - 1)) + 1;
 }
 
+
+static size_t roundUp(size_t value, size_t unit){
+	return (value + unit - 1) / unit * unit;
+}
+
+static double monotonicSeconds(){
+#ifdef __unix__
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec + now.tv_nsec * 1e-9;
+#else
+    return (double)clock() / CLOCKS_PER_SEC;
+#endif
+}
@@ -4,6 +4,9 @@
 #define _POSIX_C_SOURCE 200809L
 #include "forth.cpp"
 #include "words.cpp"
+#include "direct.cpp"
+#include "cached.cpp"
+#include "tokenizer.cpp"
 #include "minunit.h"
 
 MU_TEST(forth_tests_init_free) {
@@ -62,8 +65,33 @@ MU_TEST(forth_tests_codeword) {
     mu_check(forth.getLatest()->find("TEST", strlen("TEST")) == NULL);
 }
 
+MU_TEST(forth_tests_index){
+    char name[MAX_WORD];
+    Forth forth(stdin, 20000, 100, 100);
+
+    Word *w1 = forth.addWord("TEST", strlen("TEST"), false);
+    forth.emit(1);
+    Word *w2 = forth.addWord("TEST", strlen("TEST"), false);
+    forth.emit(2);
+    mu_check(forth.find("TEST", strlen("TEST")) == w2);
+    w2->setHidden(true);
+    mu_check(forth.find("TEST", strlen("TEST")) == w1);
+    w2->setHidden(false);
+    mu_check(forth.find("TEST", strlen("TEST")) == w2);
+    mu_check(forth.find("TES", strlen("TES")) == NULL);
+
+    // Force the index to grow and check that nothing got lost
+    for(int i = 0; i < 1000; i++){
+        sprintf(name, "w%d", i);
+        forth.addCodeword(name, drop);
+    }
+    mu_check(forth.find("TEST", strlen("TEST")) == w2);
+    mu_check(forth.find("w0", strlen("w0")) == forth.getLatest()->find("w0", strlen("w0")));
+    mu_check(forth.find("w999", strlen("w999")) == forth.getLatest());
+}
+
 MU_TEST(forth_tests_compileword){
-	Forth forth(stdin, 200, 200, 200);
+	Forth forth(stdin, 600, 200, 200);
 	forth.addMachineWords();
 
 	const Word *dup = forth.getLatest()->find("dup", strlen("dup"));
@@ -86,7 +114,7 @@ MU_TEST(forth_tests_compileword){
 }
 
 MU_TEST(forth_tests_literal){
-	Forth forth(stdin, 200, 200, 200);
+	Forth forth(stdin, 600, 200, 200);
 	forth.addMachineWords();
 
 	const Word *literal = forth.getLatest()->find("lit", strlen("lit"));
@@ -140,12 +168,106 @@ MU_TEST(forth_tests_read_word){
     free(str1); free(str2); free(str3); free(str4);
 }
 
+MU_TEST(forth_tests_tokenizer){
+    Tokenizer tokenizer;
+    const char *token;
+    size_t length, count = 0;
+    bool same = true;
+    // Longer than the buffer, so some tokens are split between two reads
+    size_t size = 3 * TOKENIZER_BUFFER;
+    char *text = (char*)malloc(size + 1);
+    for(size_t i = 0; i < size; i += 7)
+        memcpy(text + i, "word12 ", size - i < 7 ? size - i : 7);
+    memcpy(text + 98, " 0123456789012345678901234567890123456789 ", 42);
+    text[size] = 0;
+    FILE *stream = fmemopen(text, size, "r");
+
+    tokenizer.open(stream);
+    mu_check(!tokenizer.isMapped());
+    ForthResult result;
+    while((result = tokenizer.next(&token, &length, MAX_WORD)) != FORTH_EOF){
+        if(result == FORTH_BUFFER_OVERFLOW){
+            mu_check(count == 14);
+            continue;
+        }
+        count += 1;
+        if(length > 6 || strncmp(token, "word12", length))
+            same = false;
+    }
+    mu_check(same);
+    mu_check(count > size / 7 - 10);
+    fclose(stream);
+
+    // The last token of a stream ends with the stream
+    stream = fmemopen(text, 13, "r");
+    tokenizer.open(stream);
+    mu_check(tokenizer.next(&token, &length, MAX_WORD) == FORTH_OK);
+    mu_check(tokenizer.next(&token, &length, MAX_WORD) == FORTH_OK);
+    mu_check(length == 6 && !strncmp(token, "word12", 6));
+    mu_check(tokenizer.next(&token, &length, MAX_WORD) == FORTH_EOF);
+    fclose(stream);
+    free(text);
+
+    // Regular files are mapped from the current position
+    FILE *file = tmpfile();
+    fputs("skip\t foo\n\r\v\fbar", file);
+    fflush(file);
+    fseek(file, 4, SEEK_SET);
+    tokenizer.open(file);
+    mu_check(tokenizer.next(&token, &length, MAX_WORD) == FORTH_OK);
+    mu_check(length == 3 && !strncmp(token, "foo", 3));
+    mu_check(tokenizer.next(&token, &length, MAX_WORD) == FORTH_OK);
+    mu_check(length == 3 && !strncmp(token, "bar", 3));
+    mu_check(tokenizer.next(&token, &length, MAX_WORD) == FORTH_EOF);
+#ifdef __unix__
+    mu_check(tokenizer.isMapped());
+#endif
+    // The stream is at the end of the mapped text then
+    mu_check(ftell(file) == 16);
+    fclose(file);
+
+    // What the stream has buffered before the tokenizer is not lost,
+    // the rest is read from the descriptor as it comes
+    int descriptors[2];
+    char line[10];
+    mu_check(pipe(descriptors) == 0);
+    mu_check(write(descriptors[1], "skip\nfoo ", 9) == 9);
+    stream = fdopen(descriptors[0], "r");
+    mu_check(fgets(line, sizeof(line), stream) && !strcmp(line, "skip\n"));
+    tokenizer.open(stream);
+    mu_check(!tokenizer.isMapped() && tokenizer.isReady());
+    mu_check(tokenizer.next(&token, &length, MAX_WORD) == FORTH_OK);
+    mu_check(length == 3 && !strncmp(token, "foo", 3));
+    mu_check(!tokenizer.isReady());
+    mu_check(write(descriptors[1], "bar\n", 4) == 4);
+    close(descriptors[1]);
+    mu_check(tokenizer.isReady());
+    mu_check(tokenizer.next(&token, &length, MAX_WORD) == FORTH_OK);
+    mu_check(length == 3 && !strncmp(token, "bar", 3));
+    mu_check(tokenizer.next(&token, &length, MAX_WORD) == FORTH_EOF);
+    fclose(stream);
+
+    // A number at the very end of a mapping is not terminated
+    Forth forth(stdin, 600, 200, 200);
+    forth.addMachineWords();
+    file = tmpfile();
+    for(int i = 0; i < 4094; i++)
+        fputc(' ', file);
+    fputs("12", file);
+    fflush(file);
+    rewind(file);
+    forth.setInput(file);
+    mu_check(forth.run() == FORTH_EOF);
+    mu_check(forth.pop() == 12);
+    fclose(file);
+}
+
 MU_TEST(forth_tests_run_number){
 	const cell *test;
     const Word **code_ptr;
     Word *word;
     const Word *lit;
-    Forth forth(stdin, 200, 200, 200);
+    Forth forth(stdin, 600, 200, 200);
     const char *str1 = "1";
     const char *str2 = "foo";
     forth.addMachineWords();
@@ -171,7 +293,7 @@ MU_TEST(forth_tests_run_number){
 MU_TEST(forth_tests_run){
     char *program = strdup(": init_fib 1 1 ; : next_fib swap over + ; init_fib next_fib next_fib");
     FILE *stream = fmemopen(program, strlen(program), "r");
-    Forth forth(stdin, 200, 200, 200);
+    Forth forth(stdin, 600, 200, 200);
     forth.setInput(stream);
     forth.addMachineWords();
     forth.run();
@@ -183,16 +305,728 @@ MU_TEST(forth_tests_run){
     free(program);
 }
 
+static void run_program(Forth &forth, const char *program){
+    char *text = strdup(program);
+    FILE *stdlib = fopen("../stdlib.fth", "r");
+    FILE *stream = fmemopen(text, strlen(text), "r");
+    forth.addMachineWords();
+    forth.setInput(stdlib);
+    forth.run();
+    forth.setInput(stream);
+    forth.run();
+    fclose(stream);
+    fclose(stdlib);
+    free(text);
+}
+
+// Runs a program in a VM that already has its dictionary
+static void run_text(Forth &forth, const char *program){
+    char *text = strdup(program);
+    FILE *stream = fmemopen(text, strlen(text), "r");
+    forth.setInput(stream);
+    forth.run();
+    forth.setInput(stdin);
+    fclose(stream);
+    free(text);
+}
+
+MU_TEST(forth_tests_direct){
+    const char *program = ": fib 0 1 rot begin dup while 1 - -rot swap over + rot repeat drop drop ; "
+        ": sign dup 0 < if drop -1 else 0 = not if 1 else 0 then then ; "
+        "20 fib 7 sign -7 sign 0 sign 5 over swap - 6 and 3 xor 3 fib2 4 test-loop";
+    Forth indirect(stdin, 1000, 200, 200);
+    Forth direct(stdin, 1000, 200, 200);
+
+    mu_check(findOpcode(add) == OPCODE_ADD);
+    mu_check(findOpcode(show) == OPCODE_PRIMITIVE);
+    if(!hasDirectEngine())
+        return;
+    direct.setEngine(FORTH_ENGINE_DIRECT);
+    mu_check(direct.getEngine() == FORTH_ENGINE_DIRECT);
+
+    run_program(indirect, program);
+    run_program(direct, program);
+    mu_check(direct.find("interpret", strlen("interpret"))->getOpcode() == OPCODE_STOP);
+    mu_check(indirect.getStackPointer() - indirect.getStackBottom() == 11);
+    mu_check(direct.getStackPointer() - direct.getStackBottom() == 11);
+    for(int i = 0; i < 11; i++)
+        mu_check(indirect.getStackBottom()[i] == direct.getStackBottom()[i]);
+    mu_check(direct.getStackBottom()[0] == 6765);
+    mu_check(direct.getStackBottom()[1] == 1);
+    mu_check(direct.getStackBottom()[2] == -1);
+    mu_check(direct.getStackBottom()[3] == 0);
+    mu_check(direct.getReturnStackPointer() == direct.getReturnStackBottom());
+}
+
+static const char *loop_program = ": squares 0 swap 1 do i dup * + loop ; "
+    ": table 0 3 1 do 4 2 do i j * + loop loop ; "
+    ": first 0 100 0 do i 7 = if drop i leave then loop ; "
+    ": down 0 0 10 do i + -2 +loop ; "
+    ": up 0 10 0 do i + 5 +loop ; "
+    ": find-first 10 1 do i 4 = if i unloop exit then loop 0 ; "
+    "5 squares table first down up find-first";
+
+static void check_loops(Forth &forth){
+    cell expected[] = { 55, 54, 7, 30, 15, 4 };
+    mu_check(forth.getStackPointer() - forth.getStackBottom() == 6);
+    for(size_t i = 0; i < 6; i++)
+        mu_check(forth.getStackBottom()[i] == expected[i]);
+    mu_check(forth.getReturnStackPointer() == forth.getReturnStackBottom());
+}
+
+MU_TEST(forth_tests_loops){
+    Forth indirect(stdin, 2000, 200, 200);
+    run_program(indirect, loop_program);
+    check_loops(indirect);
+
+    bool thrown = false;
+    try{
+        forth_leave(indirect);
+    } catch(ForthIllegalStateException &e){
+        thrown = true;
+    }
+    mu_check(thrown);
+
+    if(!hasDirectEngine())
+        return;
+    Forth direct(stdin, 2000, 200, 200);
+    direct.setEngine(FORTH_ENGINE_DIRECT);
+    run_program(direct, loop_program);
+    check_loops(direct);
+}
+
+MU_TEST(forth_tests_cached){
+    const char *program = ": fib 0 1 rot begin dup while 1 - -rot swap over + rot repeat drop drop ; "
+        ": sign dup 0 < if drop -1 else 0 = not if 1 else 0 then then ; "
+        ": under drop drop ; "
+        "20 fib 7 sign -7 sign 0 sign 5 over swap - 6 and 3 xor 3 fib2 4 test-loop";
+    Forth indirect(stdin, 2000, 200, 200);
+    Forth cached(stdin, 2000, 200, 200);
+    if(!hasDirectEngine())
+        return;
+    cached.setEngine(FORTH_ENGINE_CACHED);
+    mu_check(cached.getEngine() == FORTH_ENGINE_CACHED);
+
+    run_program(indirect, program);
+    run_program(cached, program);
+    // The cached top is written back when the engine returns
+    mu_check(cached.getStackPointer() - cached.getStackBottom() == 11);
+    for(int i = 0; i < 11; i++)
+        mu_check(indirect.getStackBottom()[i] == cached.getStackBottom()[i]);
+    mu_check(*cached.top() == indirect.getStackBottom()[10]);
+
+    // and before an exception leaves it
+    while(cached.getStackPointer() > cached.getStackBottom())
+        cached.pop();
+    cached.push(42);
+    bool thrown = false;
+    try{
+        cached.execute(cached.find("under", 5));
+    } catch(ForthEmptyStackException &e){
+        thrown = true;
+    }
+    mu_check(thrown);
+    mu_check(cached.getStackPointer() == cached.getStackBottom());
+    cached.push(1);
+    cached.push(2);
+    cached.execute(cached.find("sign", 4));
+    mu_check(cached.pop() == 1);
+    mu_check(cached.pop() == 1);
+
+    Forth loops(stdin, 2000, 200, 200);
+    loops.setEngine(FORTH_ENGINE_CACHED);
+    run_program(loops, loop_program);
+    check_loops(loops);
+}
+
+MU_TEST(forth_tests_shared){
+    Forth base(stdin, 2000, 200, 200);
+    bool thrown = false;
+    run_program(base, ": twice 2 * ;");
+    try{
+        Forth early(base, stdin, 100, 20, 20);
+    } catch(ForthIllegalArgumentException &e){
+        thrown = true;
+    }
+    mu_check(thrown);
+    base.freeze();
+    mu_check(base.isFrozen());
+
+    Forth first(base, stdin, 1000, 200, 200);
+    Forth second(base, stdin, 4000, 200, 200);
+    mu_check(first.getShared() == &base);
+    mu_check(first.getLatest() == base.getLatest());
+    run_text(first, loop_program);
+    check_loops(first);
+    // Own words shadow shared ones and stay private
+    run_text(first, ": twice 3 * ; 5 twice");
+    run_text(second, "5 twice");
+    mu_check(*first.top() == 15);
+    mu_check(*second.top() == 10);
+    mu_check(second.find("squares", 7) == NULL);
+    mu_check(first.find("twice", 5) != base.find("twice", 5));
+    mu_check(base.getFreeMemory() - base.getMemory() > second.getFreeMemory() - second.getMemory());
+
+    // Enough words to grow the own index
+    for(int i = 0; i < 300; i++){
+        char definition[32];
+        sprintf(definition, ": w%d %d ;", i, i);
+        run_text(second, definition);
+    }
+    mu_check(second.find("w0", 2) != NULL);
+    mu_check(second.find("w299", 4) != NULL);
+    mu_check(second.find("fib2", 4) == base.find("fib2", 4));
+
+    // The frozen dictionary itself can not change
+    thrown = false;
+    try{
+        run_text(base, ": more ;");
+    } catch(ForthIllegalStateException &e){
+        thrown = true;
+    }
+    mu_check(thrown);
+    thrown = false;
+    Forth third(base, stdin, 1000, 200, 200);
+    try{
+        run_text(third, "immediate");
+    } catch(ForthIllegalStateException &e){
+        thrown = true;
+    }
+    mu_check(thrown);
+    mu_check(!base.getLatest()->isImmediate());
+}
+
+static cell task_log[16];
+static size_t task_logged;
+
+static void task_record(Forth &forth){
+    cell value = forth.pop();
+    if(task_logged < sizeof(task_log) / sizeof(task_log[0]))
+        task_log[task_logged++] = value;
+}
+
+MU_TEST(forth_tests_tasks){
+    static const ForthEngine engines[] = {
+        FORTH_ENGINE_INDIRECT, FORTH_ENGINE_DIRECT, FORTH_ENGINE_CACHED, FORTH_ENGINE_INDIRECT
+    };
+    static const cell expected[] = { 10, 20, 1, 11, 21, 12, 22 };
+    for(size_t i = 0; i < sizeof(engines) / sizeof(engines[0]); i++){
+        Forth forth(stdin, 2000, 200, 200);
+        bool jit = i == 3;
+        bool thrown = false;
+        if((engines[i] != FORTH_ENGINE_INDIRECT && !hasDirectEngine()) || (jit && !hasJit()))
+            continue;
+        forth.setEngine(engines[i]);
+        forth.setJit(jit);
+        forth.addCodeword("record", task_record);
+        task_logged = 0;
+        run_program(forth, ": worker-a 2 0 do 10 i + record pause loop ; "
+            ": worker-b 2 0 do 20 i + record pause loop 7 8 ; "
+            "5 word worker-a find spawn word worker-b find spawn pause 1 record join");
+        mu_check(task_logged == sizeof(expected) / sizeof(expected[0]));
+        for(size_t j = 0; j < task_logged; j++)
+            mu_check(task_log[j] == expected[j]);
+        // Every task had stacks of its own
+        mu_check(forth.getTaskCount() == 0 && forth.isMainTask());
+        mu_check(forth.getStackPointer() - forth.getStackBottom() == 1 && *forth.top() == 5);
+        if(jit)
+            mu_check(forth.find("worker-a", 8)->getNative() == NULL);
+
+        // A failing task ends, the others go on
+        try{
+            run_text(forth, ": bad drop ; word bad find spawn word worker-a find spawn join");
+        } catch(ForthEmptyStackException &e){
+            thrown = true;
+        }
+        mu_check(thrown);
+        mu_check(forth.isMainTask() && forth.getTaskCount() == 1);
+        mu_check(*forth.top() == 5);
+        task_logged = 0;
+        forth.join();
+        mu_check(task_logged == 3 && task_log[2] == 12);
+
+        // Words run from native code or the call API end at their own stop
+        // word, the task calling them goes on
+        task_logged = 0;
+        run_text(forth, ": peek r> dup >r ; : calls-peek 5 peek drop 1000 + record ; "
+            ": idle 50 0 do pause loop ; word calls-peek find spawn word idle find spawn join");
+        mu_check(task_logged == 1 && task_log[0] == 1005);
+        mu_check(forth.getTaskCount() == 0 && forth.isMainTask() && *forth.top() == 5);
+        // With the JIT the task is native code calling back into threaded code
+        if(jit)
+            mu_check(forth.find("calls-peek", 10)->getNative() && !forth.find("peek", 4)->getNative());
+
+        // Tasks left are freed with the VM
+        forth.spawn(forth.find("worker-b", 8));
+        forth.yield();
+        mu_check(forth.getTaskCount() == 1 && task_logged == 2 && task_log[1] == 20);
+    }
+
+    // Input that is not there yet lets the tasks run
+    int descriptors[2];
+    Tokenizer tokenizer;
+    mu_check(pipe(descriptors) == 0);
+    FILE *stream = fdopen(descriptors[0], "r");
+    tokenizer.open(stream);
+    mu_check(!tokenizer.isReady());
+    mu_check(write(descriptors[1], " x", 2) == 2);
+    mu_check(tokenizer.isReady());
+    close(descriptors[1]);
+    fclose(stream);
+}
+
+MU_TEST(forth_tests_limited){
+    Forth forth(stdin, 2000, 200, 200);
+    bool thrown = false;
+    size_t slices = 1;
+    forth.setJit(hasJit());
+    run_program(forth, ": sum 0 swap 1 do i + loop ; "
+        ": forever begin again ; "
+        ": under drop drop ; 100");
+
+    ForthResult result = forth.runLimited(forth.find("sum", 3), 50);
+    mu_check(result == FORTH_SUSPENDED && forth.isSuspended());
+    try{
+        forth.runWord(forth.find("sum", 3));
+    } catch(ForthIllegalStateException &e){
+        thrown = true;
+    }
+    mu_check(thrown);
+    while(result == FORTH_SUSPENDED){
+        result = forth.resume(50);
+        slices += 1;
+    }
+    mu_check(result == FORTH_OK && !forth.isSuspended());
+    mu_check(slices >= 6);
+    mu_check(forth.getStackPointer() - forth.getStackBottom() == 1 && *forth.top() == 5050);
+    mu_check(forth.getReturnStackPointer() == forth.getReturnStackBottom());
+
+    // Also native words are stopped, by the budget or the time
+    mu_check(forth.runLimited(forth.find("forever", 7), 100000) == FORTH_SUSPENDED);
+    mu_check(forth.resume((size_t)-1, 2000) == FORTH_SUSPENDED);
+    forth.cancel();
+    mu_check(!forth.isSuspended());
+    mu_check(forth.getReturnStackPointer() == forth.getReturnStackBottom());
+    run_text(forth, "1 +");
+    mu_check(*forth.top() == 5051);
+
+    thrown = false;
+    try{
+        forth.runLimited(forth.find("under", 5), 10);
+    } catch(ForthEmptyStackException &e){
+        thrown = true;
+    }
+    mu_check(thrown && !forth.isSuspended());
+}
+
+MU_TEST(forth_tests_arrays){
+    Forth forth(stdin, 2000, 200, 200);
+    cell a[37], b[37], c[37];
+    char program[256];
+    bool thrown = false;
+    run_program(forth, "");
+    for(int i = 0; i < 37; i++){
+        a[i] = i - 10;
+        b[i] = 2 * i;
+    }
+    // Lengths that are not multiples of the vector width
+    sprintf(program, "%ld 37 array-sum %ld %ld 37 array-dot %ld 37 array-min %ld 37 array-max",
+        (long)(cell)a, (long)(cell)a, (long)(cell)b, (long)(cell)a, (long)(cell)a);
+    run_text(forth, program);
+    mu_check(forth.getStackPointer() - forth.getStackBottom() == 4);
+    mu_check(forth.getStackBottom()[0] == 36 * 37 / 2 - 370);
+    cell dot = 0;
+    for(int i = 0; i < 37; i++)
+        dot += a[i] * b[i];
+    mu_check(forth.getStackBottom()[1] == dot);
+    mu_check(forth.getStackBottom()[2] == -10 && forth.getStackBottom()[3] == 26);
+
+    sprintf(program, "drop drop drop drop 7 %ld 37 array-fill %ld %ld 37 array-move "
+        "3 %ld 35 array-add -2 %ld 37 array-mul %ld %ld 37 arrays-add %ld %ld 37 arrays-mul %ld 5 array-scan",
+        (long)(cell)c, (long)(cell)b, (long)(cell)a, (long)(cell)(a + 1), (long)(cell)a,
+        (long)(cell)c, (long)(cell)a, (long)(cell)c, (long)(cell)a, (long)(cell)a);
+    run_text(forth, program);
+    mu_check(forth.getStackPointer() == forth.getStackBottom());
+    // a = (-2 * (2i + 3 inside the range) + 7) * 7, then the prefix sum of the first 5
+    cell sum = 0;
+    for(int i = 0; i < 37; i++){
+        cell value = (-2 * (2 * i + (i >= 1 && i <= 35 ? 3 : 0)) + 7) * 7;
+        if(i < 5){
+            sum += value;
+            value = sum;
+        }
+        mu_check(a[i] == value);
+    }
+
+    // Moves of overlapping ranges
+    sprintf(program, "%ld %ld 36 array-move", (long)(cell)b, (long)(cell)(b + 1));
+    run_text(forth, program);
+    mu_check(b[0] == 0 && b[1] == 0 && b[36] == 70);
+
+    sprintf(program, "%ld 0 array-min", (long)(cell)a);
+    try{
+        run_text(forth, program);
+    } catch(ForthIllegalArgumentException &e){
+        thrown = true;
+    }
+    mu_check(thrown);
+}
+
+MU_TEST(forth_tests_arena){
+    // More than one chunk of the arena
+    Forth forth(stdin, 1000000, 200, 200);
+    bool thrown = false;
+    forth.setHugePages(true);
+    run_program(forth, ": square-sum dup * swap dup * + ;");
+    const Word *word = forth.find("square-sum", 10);
+    mu_check(forth.getCommittedMemory() < forth.getMemorySize());
+    while(forth.getFreeMemory() - forth.getMemory() < 600000)
+        forth.emit(7);
+    mu_check(forth.getCommittedMemory() >= 600000);
+    // Words already there have not moved
+    mu_check(forth.find("square-sum", 10) == word);
+    run_text(forth, ": more 3 4 square-sum ; more");
+    mu_check(*forth.top() == 25);
+
+    Forth small(stdin, 600, 200, 200);
+    small.addMachineWords();
+    try{
+        for(int i = 0; i < 1000; i++)
+            small.emit(i);
+    } catch(ForthOutOfMemoryException &e){
+        thrown = true;
+    }
+    mu_check(thrown);
+    mu_check(small.getFreeMemory() == small.getMemory() + small.getMemorySize());
+    thrown = false;
+    try{
+        run_text(small, ": another ;");
+    } catch(ForthOutOfMemoryException &e){
+        thrown = true;
+    }
+    mu_check(thrown);
+}
+
+MU_TEST(forth_tests_number_base){
+    Forth forth(stdin, 2000, 200, 200);
+    const cell *bottom = forth.getStackBottom();
+    bool thrown = false;
+    run_program(forth, "$ff %-101 #-12 -7 $7FFFFFFFFFFFFFFF 1 + hex ff -a 10 add decimal 10 $10 %10");
+    mu_check(forth.getStackPointer() - bottom == 12);
+    mu_check(bottom[0] == 255 && bottom[1] == -5 && bottom[2] == -12 && bottom[3] == -7);
+    // Numbers wrap around
+    mu_check(bottom[4] == INTPTR_MIN);
+    mu_check(bottom[5] == 255 && bottom[6] == -10 && bottom[7] == 16 && bottom[8] == 0xadd);
+    mu_check(bottom[9] == 10 && bottom[10] == 16 && bottom[11] == 2);
+
+    // Words are found before numbers in bases above 10, and before
+    // tokens that are no numbers at all
+    run_text(forth, "hex : add 1 ; : -1+ 2 ; add decimal -1+ $ # 5");
+    mu_check(forth.getStackPointer() - bottom == 15);
+    mu_check(bottom[12] == 1 && bottom[13] == 2 && bottom[14] == 5);
+
+    // Literals are compiled in the base they are read in
+    run_text(forth, ": mask $ff %1010 and ; mask");
+    mu_check(*forth.top() == 10);
+
+    run_text(forth, "1 base !");
+    try{
+        run_text(forth, "12");
+    } catch(ForthIllegalStateException &e){
+        thrown = true;
+    }
+    mu_check(thrown);
+}
+
+static bool has_effect(const Forth &forth, const char *name, int in, int out){
+    const Word *word = forth.find(name, strlen(name));
+    return word && word->getStackIn() == in && word->getStackOut() == out;
+}
+
+MU_TEST(forth_tests_stack_effects){
+    const char *program = ": e1 swap drop ; : e2 dup * 1 + ; : e3 if 1 else 2 then ; "
+        ": e4 0 swap 0 do i + loop ; : e5 e1 e2 ; : odd dup if drop then ; : pushes 0 do i loop ; "
+        ": p if drop 0 then ; ";
+    const char *text = "3 4 e1 e2 0 e3 3 e4 7 1 e5 5 0 p";
+    cell expected[] = { 17, 2, 6, 2, 5 };
+    ForthEngine engines[] = { FORTH_ENGINE_INDIRECT, FORTH_ENGINE_DIRECT, FORTH_ENGINE_CACHED };
+
+    for(size_t i = 0; i < sizeof(engines) / sizeof(engines[0]); i++){
+        Forth forth(stdin, 2000, 200, 200);
+        bool thrown = false;
+        if(engines[i] != FORTH_ENGINE_INDIRECT && !hasDirectEngine())
+            continue;
+        forth.setEngine(engines[i]);
+        run_program(forth, program);
+        mu_check(has_effect(forth, "+", 2, 1) && has_effect(forth, "(lit+)", 1, 1));
+        mu_check(has_effect(forth, "square", 1, 1));
+        mu_check(!forth.find("leave", 5)->hasStackEffect());
+        mu_check(has_effect(forth, "e1", 2, 1) && has_effect(forth, "e2", 1, 1));
+        mu_check(has_effect(forth, "e3", 1, 1) && has_effect(forth, "e4", 1, 1));
+        mu_check(has_effect(forth, "e5", 2, 1) && has_effect(forth, "p", 2, 1));
+        // Paths that leave different depths have no effect
+        mu_check(!forth.find("odd", 3)->hasStackEffect());
+        mu_check(!forth.find("pushes", 6)->hasStackEffect());
+
+        // p takes two values on one path only, the depth check on entry
+        // fails and it runs checked
+        run_text(forth, text);
+        mu_check(forth.getStackPointer() - forth.getStackBottom() == 5);
+        for(size_t j = 0; j < 5; j++)
+            mu_check(forth.getStackBottom()[j] == expected[j]);
+        try{
+            run_text(forth, "drop drop drop drop drop 1 e1");
+        } catch(ForthEmptyStackException &e){
+            thrown = true;
+        }
+        mu_check(thrown);
+    }
+
+    // Words taking return stack cells of their callers are reported when
+    // warnings are on, and only then
+    Forth small(stdin, 2000, 10, 200);
+    FILE *errors = tmpfile();
+    char report[200] = { 0 };
+    run_program(small, ": deep + + + + + + + + + + + + ;");
+    mu_check(has_effect(small, "deep", 13, 1));
+    small.setErrors(errors);
+    run_text(small, ": again r> drop ;");
+    rewind(errors);
+    mu_check(fgets(report, sizeof(report), errors) == NULL);
+    small.setWarnings(true);
+    run_text(small, ": balanced 1 >r r> ; : index i ; : rdrop r> r> drop >r ;");
+    rewind(errors);
+    mu_check(fgets(report, sizeof(report), errors) != NULL);
+    mu_check(strstr(report, "'index' takes 2 return stack cells") != NULL);
+    mu_check(fgets(report, sizeof(report), errors) != NULL);
+    mu_check(strstr(report, "'rdrop' takes 2 return stack cells") != NULL);
+    mu_check(fgets(report, sizeof(report), errors) == NULL);
+    fclose(errors);
+}
+
+MU_TEST(forth_tests_guard_pages){
+    Forth forth(stdin, 2000, 10, 10);
+    bool thrown = false;
+    // The sizes are rounded up to whole pages
+    cell size = (cell)forth.getStackSize(), returnSize = (cell)forth.getReturnStackSize();
+    mu_check(size >= 10 && returnSize >= 10);
+    mu_check((size + 1) * sizeof(cell) % sysconf(_SC_PAGESIZE) == 0);
+    mu_check(returnSize * sizeof(cell) % sysconf(_SC_PAGESIZE) == 0);
+    for(cell i = 0; i < size; i++)
+        forth.push(i);
+    try{
+        forth.push(size);
+    } catch(ForthOutOfMemoryException &e){
+        thrown = true;
+    }
+    // The fault leaves the stack as it was
+    mu_check(thrown);
+    mu_check(forth.getStackPointer() - forth.getStackBottom() == size && *forth.top() == size - 1);
+    for(cell i = 0; i < size; i++)
+        forth.pop();
+    thrown = false;
+    try{
+        forth.pop();
+    } catch(ForthEmptyStackException &e){
+        thrown = true;
+    }
+    mu_check(thrown);
+
+    thrown = false;
+    for(cell i = 0; i < returnSize; i++)
+        forth.pushReturn(i);
+    try{
+        forth.pushReturn(returnSize);
+    } catch(ForthOutOfMemoryException &e){
+        thrown = true;
+    }
+    mu_check(thrown);
+    mu_check(forth.popReturn() == returnSize - 1);
+    // The return stack starts right at the guard page below it
+    for(cell i = 1; i < returnSize; i++)
+        forth.popReturn();
+    thrown = false;
+    try{
+        forth.popReturn();
+    } catch(ForthEmptyStackException &e){
+        thrown = true;
+    }
+    mu_check(thrown && forth.getReturnStackPointer() == forth.getReturnStackBottom());
+
+    // Overflows from running words, in the main task and in another one
+    run_program(forth, ": many 100000 0 do i loop ; : deep recurse 1 ;");
+    thrown = false;
+    try{
+        run_text(forth, "many");
+    } catch(ForthOutOfMemoryException &e){
+        thrown = true;
+    }
+    mu_check(thrown);
+    thrown = false;
+    try{
+        run_text(forth, "deep");
+    } catch(ForthOutOfMemoryException &e){
+        thrown = true;
+    }
+    mu_check(thrown);
+    thrown = false;
+    forth.spawn(forth.find("many", 4), 20, 20);
+    try{
+        forth.join();
+    } catch(ForthOutOfMemoryException &e){
+        thrown = true;
+    }
+    mu_check(thrown && forth.isMainTask() && forth.getTaskCount() == 0);
+
+    // There is no limit on the number of guarded stacks
+    Forth tasks(stdin, 2000, 10, 10);
+    run_program(tasks, ": idle pause ;");
+    for(int i = 0; i < 2000; i++)
+        tasks.spawn(tasks.find("idle", 4), 16, 16);
+    mu_check(tasks.getTaskCount() == 2000);
+    tasks.join();
+    mu_check(tasks.getTaskCount() == 0);
+
+    // The direct and cached engines do not check pushes, the guards do
+    ForthEngine engines[] = { FORTH_ENGINE_DIRECT, FORTH_ENGINE_CACHED };
+    for(size_t i = 0; i < sizeof(engines) / sizeof(engines[0]); i++){
+        Forth engine(stdin, 2000, 10, 10);
+        if(!hasDirectEngine())
+            continue;
+        engine.setEngine(engines[i]);
+        run_program(engine, ": many 100000 0 do i loop ; : deep recurse 1 ;");
+        thrown = false;
+        try{
+            run_text(engine, "many");
+        } catch(ForthOutOfMemoryException &e){
+            thrown = true;
+        }
+        mu_check(thrown);
+        engine.recover();
+        thrown = false;
+        try{
+            run_text(engine, "deep");
+        } catch(ForthOutOfMemoryException &e){
+            thrown = true;
+        }
+        mu_check(thrown);
+    }
+}
+
+MU_TEST(forth_tests_recovery){
+    Forth forth(stdin, 2000, 200, 200);
+    FILE *errors = tmpfile();
+    char report[200];
+    int reported = 0;
+    run_program(forth, "");
+    cell *before = forth.getFreeMemory();
+    forth.setErrors(errors);
+    forth.setRecovery(true);
+    mu_check(forth.isRecoveryEnabled());
+    // An error while compiling forgets the word, the ; after it is an
+    // error of its own
+    run_text(forth, "1 2 drop drop drop : bad 1 then ; 5 : good 2 * ; 3 good");
+    rewind(errors);
+    while(fgets(report, sizeof(report), errors))
+        reported += !strncmp(report, "Error: ", 7);
+    mu_check(reported == 3);
+    mu_check(forth.find("bad", 3) == NULL);
+    mu_check((const cell*)forth.find("good", 4) == before);
+    mu_check(forth.getStackPointer() - forth.getStackBottom() == 2);
+    mu_check(forth.getStackBottom()[0] == 5 && forth.getStackBottom()[1] == 6);
+    mu_check(forth.getReturnStackPointer() == forth.getReturnStackBottom());
+    fclose(errors);
+
+    // Without recovery the error is thrown
+    bool thrown = false;
+    forth.setRecovery(false);
+    try{
+        run_text(forth, ";");
+    } catch(ForthIllegalStateException &e){
+        thrown = true;
+    }
+    mu_check(thrown);
+}
+
+MU_TEST(forth_tests_marker){
+    Forth forth(stdin, 2000, 200, 200);
+    ForthMarker marker, later;
+    FILE *errors = tmpfile();
+    char report[200] = { 0 };
+    bool thrown = false;
+    run_program(forth, ": x 1 ;");
+    forth.setErrors(errors);
+    forth.mark(&marker);
+    run_text(forth, ": x 2 ; : twice x x + ; twice");
+    mu_check(*forth.top() == 4);
+    forth.mark(&later);
+    forth.rollback(marker);
+    mu_check(forth.getLatest() == marker.latest && forth.getFreeMemory() == marker.freeMemory);
+    mu_check(forth.find("twice", 5) == NULL);
+    // The older x is found again and the space goes to the next words
+    run_text(forth, "x : y 3 ;");
+    mu_check(*forth.top() == 1);
+    mu_check((const cell*)forth.find("y", 1) == marker.freeMemory);
+    try{
+        forth.rollback(later);
+    } catch(ForthIllegalArgumentException &e){
+        thrown = true;
+    }
+    mu_check(thrown);
+
+    // A marker forgets itself and the words after it, also from a word
+    run_text(forth, "marker request : z 5 ; : reset request ; z reset z");
+    mu_check(forth.find("request", 7) == NULL && forth.find("reset", 5) == NULL);
+    mu_check(forth.getLatest() == forth.find("y", 1));
+    rewind(errors);
+    mu_check(fgets(report, sizeof(report), errors) != NULL);
+    mu_check(strstr(report, "Unknown word: 'z'") != NULL);
+    mu_check(*forth.top() == 5);
+    fclose(errors);
+
+    thrown = false;
+    try{
+        run_text(forth, "0 (forget)");
+    } catch(ForthIllegalArgumentException &e){
+        thrown = true;
+    }
+    mu_check(thrown);
+    // Addresses in the arena that are not words are rejected as well
+    thrown = false;
+    try{
+        forth.push((cell)forth.find("y", 1) + sizeof(cell));
+        run_text(forth, "(forget)");
+    } catch(ForthIllegalArgumentException &e){
+        thrown = true;
+    }
+    mu_check(thrown && forth.getLatest() == forth.find("y", 1));
+}
+
 MU_TEST_SUITE(forth_tests) {
     MU_RUN_TEST(forth_tests_init_free);
     MU_RUN_TEST(forth_tests_align);
     MU_RUN_TEST(forth_tests_data_stack);
     MU_RUN_TEST(forth_tests_emit);
     MU_RUN_TEST(forth_tests_codeword);
+    MU_RUN_TEST(forth_tests_index);
     MU_RUN_TEST(forth_tests_compileword);
     MU_RUN_TEST(forth_tests_literal);
     MU_RUN_TEST(forth_tests_literal);
     MU_RUN_TEST(forth_tests_read_word);
+    MU_RUN_TEST(forth_tests_tokenizer);
     MU_RUN_TEST(forth_tests_run_number);
     MU_RUN_TEST(forth_tests_run);
+    MU_RUN_TEST(forth_tests_direct);
+    MU_RUN_TEST(forth_tests_loops);
+    MU_RUN_TEST(forth_tests_cached);
+    MU_RUN_TEST(forth_tests_shared);
+    MU_RUN_TEST(forth_tests_tasks);
+    MU_RUN_TEST(forth_tests_limited);
+    MU_RUN_TEST(forth_tests_arrays);
+    MU_RUN_TEST(forth_tests_arena);
+    MU_RUN_TEST(forth_tests_number_base);
+    MU_RUN_TEST(forth_tests_stack_effects);
+    MU_RUN_TEST(forth_tests_guard_pages);
+    MU_RUN_TEST(forth_tests_recovery);
+    MU_RUN_TEST(forth_tests_marker);
 }
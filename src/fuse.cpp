@@ -0,0 +1,363 @@
+#include <string.h>
+
+#include "code.h"
+#include "fuse.h"
+#include "words.h"
+
+// Peephole pass run when ; closes a definition.
+// Sequences from the table below are replaced by their superinstructions,
+// so they take one dispatch and one stack check instead of several.
+// New entries need a handler (words.cpp) and an opcode (direct.cpp);
+// longer sequences go first, so they win over their prefixes.
+
+static const Fusion fusions[] = {
+	{ "(3r>)", rpop3, 3, { OPCODE_RPOP, OPCODE_RPOP, OPCODE_RPOP }, 0, 3 },
+	{ "(lit+)", lit_add, 2, { OPCODE_LIT, OPCODE_ADD }, 1, 1 },
+	{ "(lit-)", lit_sub, 2, { OPCODE_LIT, OPCODE_SUB }, 1, 1 },
+	{ "(dup*)", dup_mul, 2, { OPCODE_DUP, OPCODE_MUL }, 1, 1 },
+	{ "(over+)", over_add, 2, { OPCODE_OVER, OPCODE_ADD }, 2, 2 },
+	{ "(2dup)", two_dup, 2, { OPCODE_OVER, OPCODE_OVER }, 2, 4 },
+	{ "(<not)", lt_not, 2, { OPCODE_LT, OPCODE_NOT }, 2, 1 },
+	{ "(swap>r)", swap_rpush, 2, { OPCODE_SWAP, OPCODE_RPUSH }, 2, 1 }
+};
+
+#define FUSION_COUNT (sizeof(fusions) / sizeof(fusions[0]))
+
+void addFusedWords(Forth &forth){
+	for(size_t i = 0; i < FUSION_COUNT; i++){
+		forth.addCodeword(fusions[i].name, fusions[i].handler);
+		forth.getLatest()->setStackEffect(fusions[i].in, fusions[i].out);
+	}
+}
+
+const Fusion* getFusions(size_t *count){
+	*count = FUSION_COUNT;
+	return fusions;
+}
+
+const Fusion* findFusion(const function handler){
+	for(size_t i = 0; i < FUSION_COUNT; i++){
+		if(fusions[i].handler == handler)
+			return &fusions[i];
+	}
+	return NULL;
+}
+
+// Dictionary word of a primitive, unless it was redefined
+static const Word* primitiveWord(const Forth &forth, const char *name, const function handler){
+	const Word *word = forth.find(name, (uint8_t)strlen(name));
+	if(!word || word->isCompiled() || *(const function*)word->getConstCode() != handler)
+		return NULL;
+	return word;
+}
+
+static const Word* fusedWord(const Forth &forth, const Fusion &fusion){
+	return primitiveWord(forth, fusion.name, fusion.handler);
+}
+
+// Checks that the sequence starts at index and nothing jumps into its middle
+static bool matches(const ThreadedCode &code, size_t index, const Fusion &fusion, cell *operand){
+	if(index + fusion.length > code.size())
+		return false;
+	*operand = 0;
+	for(size_t i = 0; i < fusion.length; i++){
+		const Instruction &instruction = code.at(index + i);
+		if(instruction.word->getOpcode() != fusion.sequence[i])
+			return false;
+		if(i > 0 && instruction.isTarget)
+			return false;
+		if(instruction.hasOperand)
+			*operand = instruction.operand;
+	}
+	return true;
+}
+
+cell* fuseWord(const Forth &forth, Word *word, cell *end){
+	ThreadedCode code;
+	cell *body = (cell*)word->getCode();
+	bool changed = false;
+
+	// Leave alone words with anything but threaded code up to end
+	if(!code.decode(forth, word, end) || body + code.cells() != end)
+		return end;
+	for(size_t i = 0; i < code.size(); i++){
+		for(size_t j = 0; j < FUSION_COUNT; j++){
+			const Word *fused;
+			cell operand;
+			if(!matches(code, i, fusions[j], &operand))
+				continue;
+			fused = fusedWord(forth, fusions[j]);
+			if(!fused)
+				continue;
+			code.replace(i, fusions[j].length, fused, operand);
+			changed = true;
+			break;
+		}
+	}
+	if(!changed)
+		return end;
+	code.encode(body);
+	return body + code.cells();
+}
+
+// Constant folding, run before the fusions so that what is left of
+// literal arithmetic can still be fused.
+
+// Primitive word other than the ones with opcodes, like / and %
+static bool isPrimitive(const Word *word, const function handler){
+	return word->getOpcode() == OPCODE_PRIMITIVE && *(const function*)word->getConstCode() == handler;
+}
+
+// Result of a op b, false if the operation is not folded. Division by
+// zero and overflowing division are left to fail when the word runs.
+static bool foldBinary(const Word *op, cell a, cell b, cell *result){
+	switch(op->getOpcode()){
+		case OPCODE_ADD: *result = (cell)((uintptr_t)a + (uintptr_t)b); return true;
+		case OPCODE_SUB: *result = (cell)((uintptr_t)a - (uintptr_t)b); return true;
+		case OPCODE_MUL: *result = (cell)((uintptr_t)a * (uintptr_t)b); return true;
+		case OPCODE_AND: *result = a & b; return true;
+		case OPCODE_OR: *result = a | b; return true;
+		case OPCODE_XOR: *result = a ^ b; return true;
+		case OPCODE_EQ: *result = a == b ? -1 : 0; return true;
+		case OPCODE_LT: *result = a < b ? -1 : 0; return true;
+		default: break;
+	}
+	if(b == 0 || (a == INTPTR_MIN && b == -1))
+		return false;
+	if(isPrimitive(op, _div)){
+		*result = a / b;
+		return true;
+	}
+	if(isPrimitive(op, mod)){
+		*result = a % b;
+		return true;
+	}
+	return false;
+}
+
+// lit value op that does nothing to the value below it
+static bool isIdentity(const Word *op, cell value){
+	switch(op->getOpcode()){
+		case OPCODE_ADD:
+		case OPCODE_SUB:
+		case OPCODE_OR:
+		case OPCODE_XOR:
+			return value == 0;
+		case OPCODE_AND:
+			return value == -1;
+		case OPCODE_MUL:
+			return value == 1;
+		default:
+			return value == 1 && isPrimitive(op, _div);
+	}
+}
+
+// Exponent of a power of two above 1, 0 for other values
+static cell powerOfTwo(cell value){
+	cell bits = 0;
+	if(value < 2 || (value & (value - 1)))
+		return 0;
+	while(value > 1){
+		value >>= 1;
+		bits += 1;
+	}
+	return bits;
+}
+
+// Some superinstruction takes a literal followed by opcode
+static bool fusesWithLiteral(uint8_t opcode){
+	for(size_t i = 0; i < FUSION_COUNT; i++){
+		if(fusions[i].sequence[0] == OPCODE_LIT && fusions[i].length > 1 && fusions[i].sequence[1] == opcode)
+			return true;
+	}
+	return false;
+}
+
+cell* foldConstants(const Forth &forth, Word *word, cell *end){
+	ThreadedCode code, nothing;
+	cell *body = (cell*)word->getCode();
+	const Word *lit = primitiveWord(forth, "lit", literal);
+	const Word *trueWord = primitiveWord(forth, "true", _true);
+	const Word *falseWord = primitiveWord(forth, "false", _false);
+	const Word *notWord = primitiveWord(forth, "not", _not);
+	const Word *shl = primitiveWord(forth, "(lit<<)", lit_shl);
+	const Word *shr = primitiveWord(forth, "(lit>>)", lit_shr);
+	bool changed = false;
+	bool found = false;
+
+	if(!lit)
+		return end;
+	for(const cell *c = body; c < end && !found; c++)
+		found = *c == (cell)lit;
+	if(!found || !code.decode(forth, word, end) || body + code.cells() != end)
+		return end;
+
+	// lit a lit b op and lit a not become lit (a op b), the results
+	// fold again with the literals around them
+	for(size_t i = 0; i + 1 < code.size();){
+		const Instruction &first = code.at(i);
+		cell result;
+		if(first.word != lit || code.at(i + 1).isTarget){
+			i += 1;
+			continue;
+		}
+		if(code.at(i + 1).word->getOpcode() == OPCODE_NOT){
+			code.replace(i, 2, lit, ~first.operand);
+		} else if(i + 2 < code.size() && code.at(i + 1).word == lit && !code.at(i + 2).isTarget &&
+				foldBinary(code.at(i + 2).word, first.operand, code.at(i + 1).operand, &result)){
+			code.replace(i, 3, lit, result);
+		} else {
+			i += 1;
+			continue;
+		}
+		changed = true;
+		if(i > 0)
+			i -= 1;
+	}
+
+	// Strength reduction of what is left
+	for(size_t i = 0; i < code.size();){
+		const Instruction &instruction = code.at(i);
+		const Word *op = i + 1 < code.size() && !code.at(i + 1).isTarget ? code.at(i + 1).word : NULL;
+		cell value = instruction.operand;
+		cell bits = powerOfTwo(value);
+		if(instruction.word != lit){
+			i += 1;
+			continue;
+		}
+		if(op && isIdentity(op, value)){
+			code.splice(i + 1, nothing, 0);
+			code.splice(i, nothing, 0);
+		} else if(op && value == -1 && op->getOpcode() == OPCODE_XOR && notWord)
+			code.replace(i, 2, notWord, 0);
+		else if(op && bits && op->getOpcode() == OPCODE_MUL && shl)
+			code.replace(i, 2, shl, bits);
+		else if(op && bits && isPrimitive(op, _div) && shr)
+			code.replace(i, 2, shr, bits);
+		// true and false take one cell, unless lit fuses with what follows
+		else if(value == -1 && trueWord && !(op && fusesWithLiteral(op->getOpcode())))
+			code.replace(i, 1, trueWord, 0);
+		else if(value == 0 && falseWord && !(op && fusesWithLiteral(op->getOpcode())))
+			code.replace(i, 1, falseWord, 0);
+		else {
+			i += 1;
+			continue;
+		}
+		changed = true;
+	}
+	if(!changed)
+		return end;
+	code.encode(body);
+	return body + code.cells();
+}
+
+// Body of a callee that can be copied into its callers, up to and not
+// including its exit. Only straight code qualifies: branches would have
+// to be moved, and a callee that reads its frame cell or anything below
+// sees other cells without its call.
+static bool inlineBody(const Forth &forth, const Word *callee, size_t limit, ThreadedCode *body){
+	ReturnEffect effect;
+	if(!callee->isCompiled() || callee->isImmediate() || !callee->isInlinable() || callee->isHidden())
+		return false;
+	if(!body->decode(forth, callee) || body->cells() > limit + 1)
+		return false;
+	for(size_t i = 0; i + 1 < body->size(); i++){
+		uint8_t opcode = body->at(i).word->getOpcode();
+		if(isBranch(body->at(i).word) || opcode == OPCODE_EXIT || opcode == OPCODE_TAIL)
+			return false;
+	}
+	if(body->at(body->size() - 1).word->getOpcode() != OPCODE_EXIT)
+		return false;
+	return analyseReturnStack(forth, callee, NULL, &effect) && effect.lowest >= 1 && effect.exit == 0;
+}
+
+// Quick look at the cells of a body before it is decoded: could there be
+// a call to a compiled word, followed by exit if the flag is set.
+// Operands may look like calls too, decoding tells them apart.
+static bool mayCall(const Forth &forth, const cell *body, const cell *end, bool beforeExit){
+	for(const cell *c = body; c < end; c++){
+		if(!forth.inDictionary(*c) || !((const Word*)*c)->isCompiled())
+			continue;
+		if(!beforeExit || (c + 1 < end && forth.inDictionary(c[1]) &&
+				((const Word*)c[1])->getOpcode() == OPCODE_EXIT))
+			return true;
+	}
+	return false;
+}
+
+cell* inlineCalls(const Forth &forth, Word *word, cell *end, size_t room){
+	ThreadedCode code;
+	cell *body = (cell*)word->getCode();
+	size_t limit = forth.getInlineLimit();
+	size_t cells;
+	bool changed = false;
+
+	if(!limit || !mayCall(forth, body, end, false))
+		return end;
+	if(!code.decode(forth, word, end) || body + code.cells() != end)
+		return end;
+	cells = code.cells();
+	for(size_t i = 0; i < code.size();){
+		ThreadedCode inlined;
+		const Word *callee = code.at(i).word;
+		size_t size;
+		if(callee == word || !inlineBody(forth, callee, limit, &inlined)){
+			i += 1;
+			continue;
+		}
+		// The call takes one cell, the body without exit replaces it
+		size = inlined.cells() - 1;
+		if(cells - 1 + size > (size_t)(end - body) + room){
+			i += 1;
+			continue;
+		}
+		code.splice(i, inlined, inlined.size() - 1);
+		cells = cells - 1 + size;
+		changed = true;
+		// Calls in the callee were inlined when it was compiled
+		i += inlined.size() - 1;
+	}
+	if(!changed)
+		return end;
+	code.encode(body);
+	return body + code.cells();
+}
+
+// A call right before exit becomes a jump, so the return stack does not
+// grow with tail recursion. Only callees that keep the frame of their
+// caller intact qualify, since the frame they find is not the same.
+cell* tailCalls(const Forth &forth, Word *word, cell *end, size_t room){
+	ThreadedCode code;
+	cell *body = (cell*)word->getCode();
+	const Word *tail = forth.find("(tail)", 6);
+	size_t grown = 0;
+	bool changed = false;
+
+	if(!tail || tail->isCompiled() || *(const function*)tail->getConstCode() != tail_call ||
+			!mayCall(forth, body, end, true))
+		return end;
+	if(!code.decode(forth, word, end) || body + code.cells() != end)
+		return end;
+	for(size_t i = 0; i + 1 < code.size(); i++){
+		const Instruction &call = code.at(i);
+		const Instruction &exit = code.at(i + 1);
+		ReturnEffect effect;
+		if(!call.word->isCompiled() || exit.word->getOpcode() != OPCODE_EXIT)
+			continue;
+		if(!analyseReturnStack(forth, call.word, NULL, &effect, word) || effect.lowest < 1 || effect.exit != 0)
+			continue;
+		// Branches landing on the exit keep it, the body grows by a cell
+		if(exit.isTarget){
+			if(grown == room)
+				continue;
+			code.replace(i, 1, tail, (cell)call.word);
+			grown += 1;
+		} else
+			code.replace(i, 2, tail, (cell)call.word);
+		changed = true;
+	}
+	if(!changed)
+		return end;
+	code.encode(body);
+	return body + code.cells();
+}
@@ -0,0 +1,231 @@
+#include "fuse.cpp"
+#include "minunit.h"
+
+// Looks for a word in the body of a compiled word
+static bool has_word(const Forth &forth, const char *name, const char *wordName){
+    ThreadedCode code;
+    const Word *word = forth.find(name, strlen(name));
+    const Word *needle = forth.find(wordName, strlen(wordName));
+    if(!word || !needle || !code.decode(forth, word))
+        return false;
+    for(size_t i = 0; i < code.size(); i++){
+        // Tail calls name the word in their operand
+        if(code.at(i).word == needle ||
+                (code.at(i).word->getOpcode() == OPCODE_TAIL && (const Word*)code.at(i).operand == needle))
+            return true;
+    }
+    return false;
+}
+
+MU_TEST(fuse_tests_sequences){
+    Forth forth(stdin, 2000, 200, 200);
+    run_program(forth, ": add5 5 + ; : sq dup * ; : hyp over + swap 2 - ; "
+        ": do-step r> r> r> 1 + over over < not swap >r swap >r swap >r ; "
+        "1 add5 7 sq 3 4 hyp");
+
+    const Word *add5 = forth.find("add5", 4);
+    const Word *const *code = (const Word *const*)add5->getConstCode();
+    mu_check(code[0] == forth.find("(lit+)", 6));
+    mu_check((cell)code[1] == 5);
+    mu_check(code[2] == forth.find("exit", 4));
+    mu_check(has_word(forth, "sq", "(dup*)"));
+    mu_check(has_word(forth, "hyp", "(over+)"));
+    mu_check(has_word(forth, "hyp", "(lit-)"));
+    mu_check(has_word(forth, "do-step", "(3r>)"));
+    mu_check(has_word(forth, "do-step", "(2dup)"));
+    mu_check(has_word(forth, "do-step", "(<not)"));
+    mu_check(has_word(forth, "do-step", "(swap>r)"));
+
+    cell expected[] = { 6, 49, 7, 1 };
+    mu_check(forth.getStackPointer() - forth.getStackBottom() == 4);
+    for(size_t i = 0; i < 4; i++)
+        mu_check(forth.getStackBottom()[i] == expected[i]);
+}
+
+MU_TEST(fuse_tests_branches){
+    const char *program = ": h dup if 1 then + ; "
+        ": count 0 swap begin swap 1 + swap 1 - dup 0 = until drop ; "
+        ": walk 0 swap 1 do i dup * + loop ; "
+        ": sign dup 0 < if drop -1 else 0 = not if 1 else 0 then then ; "
+        "3 h 5 count 4 walk -2 sign 2 sign 20 fib2 ";
+    Forth fused(stdin, 2000, 200, 200);
+    Forth plain(stdin, 2000, 200, 200);
+    plain.setFusion(false);
+    mu_check(!plain.isFusionEnabled());
+    run_program(fused, program);
+    run_program(plain, program);
+
+    // then lands on +, so lit 1 + must stay apart
+    mu_check(!has_word(fused, "h", "(lit+)"));
+    mu_check(has_word(fused, "count", "(lit+)"));
+    mu_check(!has_word(plain, "count", "(lit+)"));
+
+    cell expected[] = { 4, 5, 30, -1, 1, 10946 };
+    mu_check(fused.getStackPointer() - fused.getStackBottom() == 6);
+    mu_check(plain.getStackPointer() - plain.getStackBottom() == 6);
+    for(size_t i = 0; i < 6; i++){
+        mu_check(fused.getStackBottom()[i] == expected[i]);
+        mu_check(plain.getStackBottom()[i] == expected[i]);
+    }
+    if(!hasDirectEngine())
+        return;
+    Forth direct(stdin, 2000, 200, 200);
+    direct.setEngine(FORTH_ENGINE_DIRECT);
+    run_program(direct, program);
+    mu_check(direct.getStackPointer() - direct.getStackBottom() == 6);
+    for(size_t i = 0; i < 6; i++)
+        mu_check(direct.getStackBottom()[i] == expected[i]);
+    mu_check(direct.getReturnStackPointer() == direct.getReturnStackBottom());
+}
+
+MU_TEST(fuse_tests_tail_calls){
+    const char *program = ": down dup if 1 - recurse then ; "
+        ": down2 dup 0 = if exit then 1 - recurse ; "
+        ": step noinline 1 + ; : twice step step ; : rdrop r> r> drop >r ; : skip 1 >r rdrop ; "
+        "100000 down 100000 down2 5 twice skip";
+    cell expected[] = { 0, 0, 7 };
+    Forth forth(stdin, 2000, 200, 50);
+    run_program(forth, program);
+    mu_check(has_word(forth, "down", "(tail)"));
+    mu_check(has_word(forth, "down2", "(tail)"));
+    mu_check(has_word(forth, "twice", "(tail)"));
+    // rdrop works on the frame of its caller
+    mu_check(!has_word(forth, "skip", "(tail)"));
+    mu_check(forth.getStackPointer() - forth.getStackBottom() == 3);
+    for(size_t i = 0; i < 3; i++)
+        mu_check(forth.getStackBottom()[i] == expected[i]);
+    mu_check(forth.getReturnStackPointer() == forth.getReturnStackBottom());
+
+    // The pass does not depend on fusion
+    Forth unfused(stdin, 2000, 200, 50);
+    unfused.setFusion(false);
+    run_program(unfused, ": down dup if 1 - recurse then ; 100000 down");
+    mu_check(has_word(unfused, "down", "(tail)") && *unfused.top() == 0);
+
+    // Without the pass the return stack overflows
+    bool thrown = false;
+    Forth plain(stdin, 2000, 200, 50);
+    plain.setTailCalls(false);
+    mu_check(!plain.isTailCallsEnabled());
+    try{
+        run_program(plain, ": down dup if 1 - recurse then ; 100000 down");
+    } catch(ForthOutOfMemoryException &e){
+        thrown = true;
+    }
+    mu_check(thrown);
+
+    thrown = false;
+    try{
+        run_text(forth, "recurse");
+    } catch(ForthIllegalStateException &e){
+        thrown = true;
+    }
+    mu_check(thrown);
+
+    ForthEngine engines[] = { FORTH_ENGINE_DIRECT, FORTH_ENGINE_CACHED };
+    for(size_t i = 0; i < 2 && hasDirectEngine(); i++){
+        Forth threaded(stdin, 2000, 200, 50);
+        threaded.setEngine(engines[i]);
+        run_program(threaded, program);
+        mu_check(threaded.getStackPointer() - threaded.getStackBottom() == 3);
+        for(size_t j = 0; j < 3; j++)
+            mu_check(threaded.getStackBottom()[j] == expected[j]);
+        mu_check(threaded.getReturnStackPointer() == threaded.getReturnStackBottom());
+    }
+}
+
+MU_TEST(fuse_tests_inline){
+    const char *program = ": sq2 square square ; : keep >r 1 r> ; : use 5 keep + ; "
+        ": rdrop r> r> drop >r ; : skip 1 >r rdrop ; "
+        ": big 1 + 2 + 3 + 4 + ; : call-big big ; : kept noinline dup ; : uses-kept kept ; "
+        ": abs1 dup 0 < if -1 * then ; : use-abs abs1 ; : g if 2 else 3 then square ; "
+        ": nop ; : use-nop 1 nop nop 2 ; "
+        "3 sq2 use skip 0 call-big 4 uses-kept -5 use-abs 1 g 0 g use-nop";
+    cell expected[] = { 81, 6, 10, 4, 4, 5, 4, 9, 1, 2 };
+    Forth forth(stdin, 2000, 200, 200);
+    run_program(forth, program);
+    // Inlined bodies are fused further
+    mu_check(!has_word(forth, "sq2", "square") && has_word(forth, "sq2", "(dup*)"));
+    mu_check(!has_word(forth, "use", "keep"));
+    mu_check(!has_word(forth, "g", "square"));
+    mu_check(!has_word(forth, "use-nop", "nop"));
+    // rdrop pops below its frame, big is above the limit, kept opts out
+    // and abs1 has a branch
+    mu_check(has_word(forth, "skip", "rdrop"));
+    mu_check(has_word(forth, "call-big", "big"));
+    mu_check(has_word(forth, "uses-kept", "kept"));
+    mu_check(has_word(forth, "use-abs", "abs1"));
+    mu_check(forth.getStackPointer() - forth.getStackBottom() == 10);
+    for(size_t i = 0; i < 10; i++)
+        mu_check(forth.getStackBottom()[i] == expected[i]);
+    mu_check(forth.getReturnStackPointer() == forth.getReturnStackBottom());
+
+    Forth larger(stdin, 2000, 200, 200);
+    larger.setInlineLimit(10);
+    run_program(larger, program);
+    mu_check(!has_word(larger, "call-big", "big"));
+    Forth plain(stdin, 2000, 200, 200);
+    plain.setInlineLimit(0);
+    run_program(plain, program);
+    mu_check(has_word(plain, "sq2", "square"));
+    for(size_t i = 0; i < 10; i++){
+        mu_check(larger.getStackBottom()[i] == expected[i]);
+        mu_check(plain.getStackBottom()[i] == expected[i]);
+    }
+}
+
+MU_TEST(fuse_tests_constants){
+    const char *program = ": k 2 3 + 4 * ; : cmp 3 5 < 7 7 = and 6 not ; : d -7 2 / 17 5 % ; "
+        ": z 1 0 / ; : m8 8 * ; : q4 4 / ; : id 0 + 1 * -1 and 0 or ; : nt -1 xor ; "
+        ": tf 0 -1 ; : bt 1 swap if drop 2 3 then + ; "
+        "k cmp d 3 m8 -3 m8 7 q4 -7 q4 -8 q4 5 id 0 nt tf 10 0 bt 10 -1 bt";
+    cell expected[] = { 20, -1, -7, -3, 2, 24, -24, 1, -1, -2, 5, -1, 0, -1, 11, 10, 5 };
+    const size_t count = sizeof(expected) / sizeof(expected[0]);
+    Forth forth(stdin, 2000, 200, 200);
+    run_program(forth, program);
+
+    const Word *const *code = (const Word *const*)forth.find("k", 1)->getConstCode();
+    mu_check(code[0] == forth.find("lit", 3) && (cell)code[1] == 20 && code[2] == forth.find("exit", 4));
+    mu_check(!has_word(forth, "cmp", "<") && !has_word(forth, "cmp", "not"));
+    mu_check(!has_word(forth, "d", "/") && !has_word(forth, "d", "%"));
+    // Division by zero is left to fail at run time
+    mu_check(has_word(forth, "z", "/"));
+    mu_check(has_word(forth, "m8", "(lit<<)") && has_word(forth, "q4", "(lit>>)"));
+    code = (const Word *const*)forth.find("id", 2)->getConstCode();
+    mu_check(code[0] == forth.find("exit", 4));
+    mu_check(has_word(forth, "nt", "not"));
+    mu_check(has_word(forth, "tf", "false") && has_word(forth, "tf", "true"));
+    // then lands on +, so 2 3 + stays
+    mu_check(has_word(forth, "bt", "+"));
+
+    mu_check(forth.getStackPointer() - forth.getStackBottom() == (cell)count);
+    for(size_t i = 0; i < count; i++)
+        mu_check(forth.getStackBottom()[i] == expected[i]);
+
+    // Every engine agrees on the shifts
+    for(int engine = FORTH_ENGINE_DIRECT; engine <= FORTH_ENGINE_CACHED + 1; engine++){
+        Forth other(stdin, 2000, 200, 200);
+        if(engine <= FORTH_ENGINE_CACHED){
+            if(!hasDirectEngine())
+                continue;
+            other.setEngine((ForthEngine)engine);
+        } else if(hasJit())
+            other.setJit(true);
+        else
+            continue;
+        run_program(other, program);
+        mu_check(other.getStackPointer() - other.getStackBottom() == (cell)count);
+        for(size_t i = 0; i < count; i++)
+            mu_check(other.getStackBottom()[i] == expected[i]);
+        if(engine > FORTH_ENGINE_CACHED)
+            mu_check(other.find("m8", 2)->getNative() != NULL && other.find("q4", 2)->getNative() != NULL);
+    }
+}
+
+MU_TEST_SUITE(fuse_tests) {
+    MU_RUN_TEST(fuse_tests_sequences);
+    MU_RUN_TEST(fuse_tests_branches);
+    MU_RUN_TEST(fuse_tests_tail_calls);
+    MU_RUN_TEST(fuse_tests_inline);
+    MU_RUN_TEST(fuse_tests_constants);
+}
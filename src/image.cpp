@@ -0,0 +1,314 @@
+#include <stdio.h>
+#include <string.h>
+
+#include "code.h"
+#include "forth.h"
+#include "fuse.h"
+#include "jit.h"
+#include "words.h"
+
+// Dictionary image: the used part of the memory arena and the state
+// needed to continue with it.
+// Addresses differ from run to run (the arena is allocated on the heap
+// and ASLR moves the code), so the cells holding them are written as zero
+// and listed in the relocation table instead:
+// word headers with the offset of the next word, pointers into the arena
+// with their offset and handlers of primitives with their index in the
+// table of primitives followed by the table of superinstructions.
+
+#define IMAGE_MAGIC "CFORTHIM"
+#define IMAGE_VERSION 2
+
+enum ImageRelocationKind {
+	IMAGE_WORD,
+	IMAGE_POINTER,
+	IMAGE_PRIMITIVE
+};
+
+struct ImageHeader {
+	char magic[8];
+	uint32_t version;
+	// Checks that the image was made by a compatible build
+	uint32_t signature;
+	cell cells;
+	cell relocations;
+	// Offsets of the words in the arena
+	cell latest;
+	cell stopWord;
+	// Numbers compiled and read after loading use the same base
+	cell base;
+};
+
+struct ImageRelocation {
+	// Index of the cell in the arena
+	cell at;
+	cell kind;
+	// Offset in bytes or index of the handler, -1 for no word
+	cell value;
+};
+
+static uint32_t hashBytes(uint32_t hash, const void *data, size_t length){
+	const uint8_t *bytes = (const uint8_t*)data;
+	for(size_t i = 0; i < length; i++){
+		hash ^= bytes[i];
+		hash *= 16777619u;
+	}
+	return hash;
+}
+
+// Layout of words and the set of handlers an image depends on
+static uint32_t imageSignature(){
+	size_t primitiveCount, fusionCount;
+	const Primitive *primitives = getPrimitives(&primitiveCount);
+	const Fusion *fusions = getFusions(&fusionCount);
+	uint32_t hash = 2166136261u;
+	uint32_t sizes[] = { sizeof(cell), sizeof(Word), OPCODE_COUNT };
+	hash = hashBytes(hash, sizes, sizeof(sizes));
+	for(size_t i = 0; i < primitiveCount; i++)
+		hash = hashBytes(hash, primitives[i].name, strlen(primitives[i].name) + 1);
+	for(size_t i = 0; i < fusionCount; i++)
+		hash = hashBytes(hash, fusions[i].name, strlen(fusions[i].name) + 1);
+	return hash;
+}
+
+// Index of a handler in the images, -1 if it is not a known primitive
+static cell handlerIndex(const function handler){
+	size_t primitiveCount, fusionCount;
+	const Primitive *primitives = getPrimitives(&primitiveCount);
+	const Fusion *fusions = getFusions(&fusionCount);
+	for(size_t i = 0; i < primitiveCount; i++){
+		if(primitives[i].handler == handler)
+			return (cell)i;
+	}
+	for(size_t i = 0; i < fusionCount; i++){
+		if(fusions[i].handler == handler)
+			return (cell)(primitiveCount + i);
+	}
+	return -1;
+}
+
+static function indexHandler(cell index){
+	size_t primitiveCount, fusionCount;
+	const Primitive *primitives = getPrimitives(&primitiveCount);
+	const Fusion *fusions = getFusions(&fusionCount);
+	if(index < 0 || (size_t)index >= primitiveCount + fusionCount)
+		return NULL;
+	if((size_t)index < primitiveCount)
+		return primitives[index].handler;
+	return fusions[(size_t)index - primitiveCount].handler;
+}
+
+static void addRelocation(ImageRelocation *relocations, size_t *count, cell at, cell kind, cell value){
+	relocations[*count].at = at;
+	relocations[*count].kind = kind;
+	relocations[*count].value = value;
+	*count += 1;
+}
+
+// Words of the dictionary from the oldest to the newest
+static Word** imageWords(Word *latest, size_t *count){
+	Word **words;
+	size_t i = 0;
+	*count = 0;
+	for(Word *word = latest; word; word = word->getNextWord())
+		*count += 1;
+	words = new Word*[*count ? *count : 1];
+	for(Word *word = latest; word; word = word->getNextWord())
+		words[*count - 1 - i++] = word;
+	return words;
+}
+
+static void writeImage(FILE *file, const void *data, size_t size){
+	if(size && fwrite(data, size, 1, file) != 1)
+		throw ForthIllegalStateException("saveImage: failed to write image");
+}
+
+static void readImage(FILE *file, void *data, size_t size){
+	if(size && fread(data, size, 1, file) != 1)
+		throw ForthIllegalArgumentException("loadImage: image is truncated");
+}
+
+void Forth::saveImage(FILE *file) const{
+	ImageHeader header;
+	size_t used = (size_t)(this->freeMemory - this->memory);
+	size_t wordCount, relocationCount = 0;
+	cell *cells;
+	ImageRelocation *relocations;
+	Word **words;
+	const Word *tick = this->find("'", 1);
+
+	if(this->compiling)
+		throw ForthIllegalStateException("saveImage: a word is being compiled");
+	if(this->shared)
+		throw ForthIllegalStateException("saveImage: dictionary is shared with another VM");
+	if(!this->latest)
+		throw ForthIllegalStateException("saveImage: dictionary is empty");
+
+	words = imageWords(this->latest, &wordCount);
+	cells = new cell[used ? used : 1];
+	// At most every cell is relocated
+	relocations = new ImageRelocation[used ? used : 1];
+	memcpy(cells, this->memory, used * sizeof(cell));
+	try{
+		for(size_t i = 0; i < wordCount; i++){
+			Word *word = words[i];
+			cell at = (cell*)word - this->memory;
+			const cell *code = (const cell*)word->getConstCode();
+			const cell *end = i + 1 < wordCount ? (const cell*)words[i + 1] : this->freeMemory;
+			size_t codeAt = (size_t)(code - this->memory);
+			Word *copy = reinterpret_cast<Word*>(cells + at);
+			Word *next = word->getNextWord();
+
+			copy->setNextWord(NULL);
+			copy->setNextInBucket(NULL);
+			// Native code is not saved, the JIT translates words again on load
+			copy->setNative(NULL);
+			if(word->getOpcode() == OPCODE_NATIVE)
+				copy->setOpcode(OPCODE_CALL);
+			addRelocation(relocations, &relocationCount, at, IMAGE_WORD,
+				next ? (cell)((cell*)next - this->memory) * (cell)sizeof(cell) : -1);
+
+			if(!word->isCompiled()){
+				cell index = handlerIndex(*(const function*)code);
+				if(index < 0)
+					throw ForthIllegalStateException("saveImage: primitive is not known to images");
+				cells[codeAt] = 0;
+				addRelocation(relocations, &relocationCount, (cell)codeAt, IMAGE_PRIMITIVE, index);
+				// Cells after the handler are data, saved as they are
+				continue;
+			}
+
+			ThreadedCode threaded;
+			size_t c = codeAt;
+			if(!threaded.decode(*this, word, end))
+				throw ForthIllegalStateException("saveImage: word is not plain threaded code");
+			for(size_t j = 0; j < threaded.size(); j++){
+				const Instruction &instruction = threaded.at(j);
+				cells[c] = 0;
+				addRelocation(relocations, &relocationCount, (cell)c,
+					IMAGE_POINTER, (cell)((const cell*)instruction.word - this->memory) * (cell)sizeof(cell));
+				c += 1;
+				if(!instruction.hasOperand)
+					continue;
+				// ' and tail calls compile the address of a word, other operands are numbers or offsets
+				if((instruction.word == tick || instruction.word->getOpcode() == OPCODE_TAIL) &&
+						instruction.operand >= (cell)this->memory &&
+						instruction.operand < (cell)this->freeMemory){
+					cells[c] = 0;
+					addRelocation(relocations, &relocationCount, (cell)c,
+						IMAGE_POINTER, instruction.operand - (cell)this->memory);
+				}
+				c += 1;
+			}
+		}
+
+		memcpy(header.magic, IMAGE_MAGIC, sizeof(header.magic));
+		header.version = IMAGE_VERSION;
+		header.signature = imageSignature();
+		header.cells = (cell)used;
+		header.relocations = (cell)relocationCount;
+		header.latest = ((cell*)this->latest - this->memory) * (cell)sizeof(cell);
+		header.stopWord = this->stopWord ? ((cell*)this->stopWord - this->memory) * (cell)sizeof(cell) : -1;
+		header.base = this->base;
+		writeImage(file, &header, sizeof(header));
+		writeImage(file, cells, used * sizeof(cell));
+		writeImage(file, relocations, relocationCount * sizeof(ImageRelocation));
+		if(fflush(file))
+			throw ForthIllegalStateException("saveImage: failed to write image");
+	} catch(...) {
+		delete [] words;
+		delete [] cells;
+		delete [] relocations;
+		throw;
+	}
+	delete [] words;
+	delete [] cells;
+	delete [] relocations;
+}
+
+void Forth::loadImage(FILE *file){
+	ImageHeader header;
+	ImageRelocation relocation;
+	size_t wordCount, newSize;
+	Word **words;
+	cell used;
+
+	if(this->shared || this->frozen)
+		throw ForthIllegalStateException("loadImage: dictionary is shared with other VMs");
+	readImage(file, &header, sizeof(header));
+	if(memcmp(header.magic, IMAGE_MAGIC, sizeof(header.magic)) || header.version != IMAGE_VERSION)
+		throw ForthIllegalArgumentException("loadImage: not an image");
+	if(header.signature != imageSignature())
+		throw ForthIllegalArgumentException("loadImage: image is made by an incompatible build");
+	used = header.cells;
+	if(used <= 0 || header.relocations < 0)
+		throw ForthIllegalArgumentException("loadImage: image is corrupt");
+	if((size_t)used > this->memorySize)
+		throw ForthOutOfMemoryException("loadImage: dictionary is too small for the image");
+	if(header.latest < 0 || header.latest >= used * (cell)sizeof(cell) ||
+			header.stopWord < -1 || header.stopWord >= used * (cell)sizeof(cell))
+		throw ForthIllegalArgumentException("loadImage: image is corrupt");
+
+	// The dictionary is replaced, so nothing may refer to the old one
+	memset(this->index, 0, this->indexSize * sizeof(Word*));
+	this->indexCount = 0;
+	this->latest = NULL;
+	this->stopWord = NULL;
+	this->freeMemory = this->memory;
+	this->growMemory((size_t)used * sizeof(cell), "loadImage: dictionary is too small for the image");
+	readImage(file, this->memory, (size_t)used * sizeof(cell));
+	for(cell i = 0; i < header.relocations; i++){
+		readImage(file, &relocation, sizeof(relocation));
+		if(relocation.at < 0 || relocation.at >= used)
+			throw ForthIllegalArgumentException("loadImage: image is corrupt");
+		cell *target = this->memory + relocation.at;
+		switch(relocation.kind){
+			case IMAGE_WORD:
+				// The next word is older and lies below, so the chain always ends
+				if(relocation.at + (cell)(sizeof(Word) / sizeof(cell)) > used ||
+						relocation.value < -1 || relocation.value >= relocation.at * (cell)sizeof(cell))
+					throw ForthIllegalArgumentException("loadImage: image is corrupt");
+				reinterpret_cast<Word*>(target)->setNextWord(relocation.value < 0 ? NULL :
+					reinterpret_cast<Word*>((uint8_t*)this->memory + relocation.value));
+				break;
+			case IMAGE_POINTER:
+				if(relocation.value < 0 || relocation.value >= used * (cell)sizeof(cell))
+					throw ForthIllegalArgumentException("loadImage: image is corrupt");
+				*target = (cell)this->memory + relocation.value;
+				break;
+			case IMAGE_PRIMITIVE: {
+				function handler = indexHandler(relocation.value);
+				if(!handler)
+					throw ForthIllegalArgumentException("loadImage: image is corrupt");
+				memcpy(target, &handler, sizeof(handler));
+				break;
+			}
+			default:
+				throw ForthIllegalArgumentException("loadImage: image is corrupt");
+		}
+	}
+
+	this->freeMemory = this->memory + used;
+	this->latest = reinterpret_cast<Word*>((uint8_t*)this->memory + header.latest);
+	this->stopWord = header.stopWord < 0 ? NULL :
+		reinterpret_cast<Word*>((uint8_t*)this->memory + header.stopWord);
+	this->endTasks();
+	this->executing = (Word *const*)&this->stopWord;
+	this->stackPointer = this->stackBottom;
+	this->returnStackPointer = this->returnStackBottom;
+	this->compiling = false;
+	this->base = header.base;
+
+	words = imageWords(this->latest, &wordCount);
+	for(newSize = this->indexSize; newSize < wordCount; newSize *= 2)
+		;
+	this->rebuildIndex(newSize);
+	if(this->jitEnabled){
+		for(size_t i = 0; i < wordCount; i++){
+			const cell *end = i + 1 < wordCount ? (const cell*)words[i + 1] : this->freeMemory;
+			if(words[i]->isCompiled())
+				this->jit->compile(*this, words[i], end);
+		}
+	}
+	delete [] words;
+}
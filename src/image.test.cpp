@@ -0,0 +1,110 @@
+#include "image.cpp"
+#include "minunit.h"
+
+static void unknown_primitive(Forth&){}
+
+MU_TEST(image_tests_roundtrip){
+    Forth source(stdin, 2000, 200, 200);
+    run_program(source, ": squares 0 swap 1 do i dup * + loop ; "
+        ": table 0 3 1 do 4 2 do i j * + loop loop ; "
+        ": first 0 100 0 do i 7 = if drop i leave then loop ; "
+        ": down 0 0 10 do i + -2 +loop ; "
+        ": up 0 10 0 do i + 5 +loop ; "
+        ": find-first 10 1 do i 4 = if i unloop exit then loop 0 ; "
+        ": countdown dup if 1 - recurse then ; "
+        ": tick ' square ; 1 2 3");
+    FILE *file = tmpfile();
+    source.saveImage(file);
+
+    // Another arena at another address, stacks are not saved
+    Forth loaded(stdin, 3000, 200, 200);
+    rewind(file);
+    loaded.loadImage(file);
+    mu_check(loaded.getStackPointer() == loaded.getStackBottom());
+    mu_check(loaded.getFreeMemory() - loaded.getMemory() == source.getFreeMemory() - source.getMemory());
+    mu_check(loaded.getLatest() != source.getLatest());
+    mu_check(!strncmp(loaded.getLatest()->getName(), "tick", 4));
+    mu_check(loaded.find("(lit+)", 6) != NULL);
+    mu_check(loaded.find("fib2", 4)->isCompiled());
+
+    run_text(loaded, "5 squares table first down up find-first");
+    check_loops(loaded);
+    run_text(loaded, "tick 20 fib2");
+    mu_check(loaded.getStackBottom()[6] == (cell)loaded.find("square", 6));
+    mu_check(loaded.getStackBottom()[7] == 10946);
+
+    // Words compiled after loading refer to the loaded dictionary
+    run_text(loaded, ": cube dup square * ; 3 cube");
+    mu_check(*loaded.top() == 27);
+    // Tail calls jump to the loaded word
+    run_text(loaded, "100000 countdown");
+    mu_check(*loaded.top() == 0);
+
+    if(hasJit()){
+        Forth jitted(stdin, 2000, 200, 200);
+        jitted.setJit(true);
+        rewind(file);
+        jitted.loadImage(file);
+        mu_check(jitted.find("squares", 7)->getNative() != NULL);
+        run_text(jitted, "5 squares table first down up find-first");
+        check_loops(jitted);
+    }
+    fclose(file);
+
+    // The number base is saved with the dictionary
+    run_text(source, "16 base !");
+    file = tmpfile();
+    source.saveImage(file);
+    Forth based(stdin, 2000, 200, 200);
+    rewind(file);
+    based.loadImage(file);
+    run_text(based, "ff");
+    mu_check(*based.top() == 255);
+    fclose(file);
+}
+
+MU_TEST(image_tests_errors){
+    Forth source(stdin, 2000, 200, 200);
+    run_program(source, "");
+    FILE *file = tmpfile();
+    source.saveImage(file);
+
+    bool thrown = false;
+    Forth small(stdin, 100, 200, 200);
+    rewind(file);
+    try{
+        small.loadImage(file);
+    } catch(ForthOutOfMemoryException &e){
+        thrown = true;
+    }
+    mu_check(thrown);
+
+    thrown = false;
+    rewind(file);
+    fputs("garbage", file);
+    rewind(file);
+    try{
+        small.loadImage(file);
+    } catch(ForthIllegalArgumentException &e){
+        thrown = true;
+    }
+    mu_check(thrown);
+    fclose(file);
+
+    // Handlers unknown to images can not be saved
+    thrown = false;
+    file = tmpfile();
+    source.addCodeword("unknown", unknown_primitive);
+    try{
+        source.saveImage(file);
+    } catch(ForthIllegalStateException &e){
+        thrown = true;
+    }
+    mu_check(thrown);
+    fclose(file);
+}
+
+MU_TEST_SUITE(image_tests) {
+    MU_RUN_TEST(image_tests_roundtrip);
+    MU_RUN_TEST(image_tests_errors);
+}
@@ -0,0 +1,857 @@
+#include <limits.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "code.h"
+#include "fuse.h"
+#include "jit.h"
+#include "words.h"
+
+// Jit class
+
+void Jit::setError(JitError _error, const char *_cause){
+	this->error = _error;
+	this->cause = _cause;
+}
+
+void Jit::raise(){
+	JitError kind = this->error;
+	this->error = JIT_ERROR_NONE;
+	switch(kind){
+		case JIT_ERROR_WORD_PROPERTY:
+			throw WordPropertyException(this->cause);
+		case JIT_ERROR_ILLEGAL_ARGUMENT:
+			throw ForthIllegalArgumentException(this->cause);
+		case JIT_ERROR_OUT_OF_MEMORY:
+			throw ForthOutOfMemoryException(this->cause);
+		case JIT_ERROR_ILLEGAL_STATE:
+			throw ForthIllegalStateException(this->cause);
+		case JIT_ERROR_EMPTY_STACK:
+			throw ForthEmptyStackException(this->cause);
+		default:
+			throw ForthException(this->cause ? this->cause : "jit: unknown error");
+	}
+}
+
+#if defined(__x86_64__) && defined(__unix__)
+
+#include <sys/mman.h>
+
+#define JIT_REGION_SIZE (1 << 20)
+
+bool hasJit(){
+	return true;
+}
+
+Jit::Jit(): regions(NULL), error(JIT_ERROR_NONE), cause(NULL){}
+
+Jit::~Jit(){
+	while(this->regions){
+		JitRegion *next = this->regions->next;
+		munmap(this->regions, this->regions->size);
+		this->regions = next;
+	}
+}
+
+// Returns writable memory, the region is made executable again by the caller
+void* Jit::allocate(size_t size){
+	JitRegion *region = this->regions;
+	size = (size + 15) & ~(size_t)15;
+	if(!region || region->used + size > region->size){
+		size_t regionSize = JIT_REGION_SIZE;
+		void *memory;
+		while(regionSize < size + sizeof(JitRegion) + 16)
+			regionSize *= 2;
+		memory = mmap(NULL, regionSize, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+		if(memory == MAP_FAILED)
+			return NULL;
+		region = (JitRegion*)memory;
+		region->next = this->regions;
+		region->size = regionSize;
+		region->used = (sizeof(JitRegion) + 15) & ~(size_t)15;
+		this->regions = region;
+	} else if(mprotect(region, region->size, PROT_READ | PROT_WRITE))
+		return NULL;
+	region->used += size;
+	return (uint8_t*)region + region->used - size;
+}
+
+// Called from native code
+
+// Stores the exception being handled so that raise() can throw it again
+static void storeError(Jit *jit){
+	try{
+		throw;
+	} catch(WordPropertyException &e){
+		jit->setError(JIT_ERROR_WORD_PROPERTY, e.getCause());
+	} catch(ForthIllegalArgumentException &e){
+		jit->setError(JIT_ERROR_ILLEGAL_ARGUMENT, e.getCause());
+	} catch(ForthOutOfMemoryException &e){
+		jit->setError(JIT_ERROR_OUT_OF_MEMORY, e.getCause());
+	} catch(ForthIllegalStateException &e){
+		jit->setError(JIT_ERROR_ILLEGAL_STATE, e.getCause());
+	} catch(ForthEmptyStackException &e){
+		jit->setError(JIT_ERROR_EMPTY_STACK, e.getCause());
+	} catch(ForthException &e){
+		jit->setError(JIT_ERROR_GENERIC, e.getCause());
+	} catch(...){
+		jit->setError(JIT_ERROR_GENERIC, "jit: unexpected exception");
+	}
+}
+
+static int callPrimitive(Forth *forth, function handler, Jit *jit){
+	try{
+		handler(*forth);
+	} catch(...){
+		storeError(jit);
+		return 1;
+	}
+	return 0;
+}
+
+// Runs to the stop word of execute, also inside a task, which goes on after it
+static int callThreaded(Forth *forth, const Word *word, Jit *jit){
+	try{
+		forth->execute(word);
+	} catch(...){
+		storeError(jit);
+		return 1;
+	}
+	return 0;
+}
+
+// Slow paths of inlined words, only called when they have to throw
+static void pushFrame(Forth &forth){
+	forth.pushReturn(0);
+}
+
+static void popFrame(Forth &forth){
+	forth.popReturn();
+}
+
+static void pushLiteral(Forth &forth){
+	forth.push(0);
+}
+
+static void popLoopArguments(Forth &forth){
+	forth.pop();
+	forth.pop();
+}
+
+static void pushLoopFrame(Forth &forth){
+	forth.pushReturn(0);
+	forth.pushReturn(0);
+	forth.pushReturn(0);
+}
+
+// x86-64 machine code buffer
+
+enum Register {
+	RAX, RCX, RDX, RBX, RSP, RBP, RSI, RDI,
+	R8, R9, R10, R11, R12, R13, R14, R15
+};
+
+enum Condition {
+	JB = 0x82,
+	JAE = 0x83,
+	JE = 0x84,
+	JNE = 0x85,
+	JBE = 0x86,
+	JA = 0x87,
+	JS = 0x88,
+	JGE = 0x8D,
+	JLE = 0x8E,
+	JMP = 0xFF
+};
+
+class Assembler {
+	private:
+		uint8_t *bytes;
+		size_t count;
+		size_t capacity;
+
+		void rex(int reg, int base);
+		void modrm(int reg, int base, int32_t displacement);
+	public:
+		Assembler();
+		~Assembler();
+
+		size_t position() const;
+		const uint8_t* data() const;
+
+		void byte(uint8_t value);
+		void dword(uint32_t value);
+		void qword(uint64_t value);
+
+		// opcode reg, [base + displacement]
+		void memory(uint8_t opcode, int reg, int base, int32_t displacement);
+		// opcode rm, reg
+		void registers(uint8_t opcode, int reg, int rm);
+		// add/sub rm, imm32 (extension 0 or 5)
+		void immediate(uint8_t extension, int rm, int32_t value);
+		void moveImmediate(int reg, uint64_t value);
+		void shiftLeft(int reg, uint8_t bits);
+		// sar or shr
+		void shiftRight(int reg, uint8_t bits, bool arithmetic);
+		void push(int reg);
+		void pop(int reg);
+		void callRax();
+
+		// Emits a jump with an empty offset and returns the offset position
+		size_t jump(Condition condition);
+		void bind(size_t jumpPosition, size_t target);
+};
+
+Assembler::Assembler(): bytes(NULL), count(0), capacity(0){}
+
+Assembler::~Assembler(){
+	delete [] this->bytes;
+}
+
+size_t Assembler::position() const{
+	return this->count;
+}
+
+const uint8_t* Assembler::data() const{
+	return this->bytes;
+}
+
+void Assembler::byte(uint8_t value){
+	if(this->count == this->capacity){
+		size_t newCapacity = this->capacity ? this->capacity * 2 : 256;
+		uint8_t *newBytes = new uint8_t[newCapacity];
+		if(this->count)
+			memcpy(newBytes, this->bytes, this->count);
+		delete [] this->bytes;
+		this->bytes = newBytes;
+		this->capacity = newCapacity;
+	}
+	this->bytes[this->count] = value;
+	this->count += 1;
+}
+
+void Assembler::dword(uint32_t value){
+	for(int i = 0; i < 4; i++)
+		this->byte((uint8_t)(value >> (8 * i)));
+}
+
+void Assembler::qword(uint64_t value){
+	for(int i = 0; i < 8; i++)
+		this->byte((uint8_t)(value >> (8 * i)));
+}
+
+void Assembler::rex(int reg, int base){
+	this->byte(0x48 | ((reg & 8) ? 4 : 0) | ((base & 8) ? 1 : 0));
+}
+
+// Always uses a 32-bit displacement
+void Assembler::modrm(int reg, int base, int32_t displacement){
+	this->byte(0x80 | ((reg & 7) << 3) | (base & 7));
+	if((base & 7) == RSP)
+		this->byte(0x24);
+	this->dword((uint32_t)displacement);
+}
+
+void Assembler::memory(uint8_t opcode, int reg, int base, int32_t displacement){
+	this->rex(reg, base);
+	if(opcode == 0xAF)
+		this->byte(0x0F);
+	this->byte(opcode);
+	this->modrm(reg, base, displacement);
+}
+
+void Assembler::registers(uint8_t opcode, int reg, int rm){
+	this->rex(reg, rm);
+	this->byte(opcode);
+	this->byte(0xC0 | ((reg & 7) << 3) | (rm & 7));
+}
+
+void Assembler::immediate(uint8_t extension, int rm, int32_t value){
+	this->rex(0, rm);
+	this->byte(0x81);
+	this->byte(0xC0 | (extension << 3) | (rm & 7));
+	this->dword((uint32_t)value);
+}
+
+void Assembler::moveImmediate(int reg, uint64_t value){
+	this->rex(0, reg);
+	this->byte(0xB8 + (reg & 7));
+	this->qword(value);
+}
+
+void Assembler::shiftLeft(int reg, uint8_t bits){
+	this->rex(0, reg);
+	this->byte(0xC1);
+	this->byte(0xE0 | (reg & 7));
+	this->byte(bits);
+}
+
+void Assembler::shiftRight(int reg, uint8_t bits, bool arithmetic){
+	this->rex(0, reg);
+	this->byte(0xC1);
+	this->byte((arithmetic ? 0xF8 : 0xE8) | (reg & 7));
+	this->byte(bits);
+}
+
+void Assembler::push(int reg){
+	if(reg & 8)
+		this->byte(0x41);
+	this->byte(0x50 + (reg & 7));
+}
+
+void Assembler::pop(int reg){
+	if(reg & 8)
+		this->byte(0x41);
+	this->byte(0x58 + (reg & 7));
+}
+
+void Assembler::callRax(){
+	this->byte(0xFF);
+	this->byte(0xD0);
+}
+
+size_t Assembler::jump(Condition condition){
+	if(condition == JMP)
+		this->byte(0xE9);
+	else {
+		this->byte(0x0F);
+		this->byte(condition);
+	}
+	this->dword(0);
+	return this->count - 4;
+}
+
+void Assembler::bind(size_t jumpPosition, size_t target){
+	uint32_t offset = (uint32_t)(int32_t)(target - (jumpPosition + 4));
+	for(int i = 0; i < 4; i++)
+		this->bytes[jumpPosition + i] = (uint8_t)(offset >> (8 * i));
+}
+
+// Code generation
+
+// Registers used by native code
+#define FORTH RBX
+#define SP R12
+#define LIMIT R13
+#define BOTTOM R14
+
+// Slow path that returns an error instead of resuming
+#define NO_RESUME ((size_t)-1)
+
+// Offsets of the Forth fields native code works with
+struct Layout {
+	int32_t stackPointer;
+	int32_t stackBottom;
+	int32_t dataSize;
+	int32_t returnStackPointer;
+	int32_t returnStackBottom;
+	int32_t returnStackSize;
+	int32_t executing;
+	// Errors go to the Jit of the running VM, which may share the word
+	int32_t jit;
+};
+
+// Jump to the target of the instruction it was emitted for
+struct Branch {
+	size_t jump;
+	size_t target;
+};
+
+// Out of line code taken when an inlined word has to call its handler
+struct SlowPath {
+	size_t jump;
+	function handler;
+	// Instruction to continue with, NO_RESUME to return an error
+	size_t resume;
+};
+
+class Generator {
+	private:
+		Assembler assembler;
+		const Layout &layout;
+		const ThreadedCode &code;
+		size_t *labels;
+		Branch *branches;
+		size_t branchCount;
+		// Instruction being emitted
+		size_t current;
+		SlowPath *slowPaths;
+		size_t slowPathCount;
+		size_t *exits;
+		size_t exitCount;
+		size_t *bails;
+		size_t bailCount;
+
+		void slowPath(Condition condition, function handler, size_t resume);
+		void branch(Condition condition);
+		void need(int cells, function handler, size_t resume);
+		void room(function handler, size_t resume);
+		void call(uint64_t target, uint64_t argument, bool hasArgument);
+		void binary(uint8_t opcode, function handler, size_t resume);
+		void compare(uint8_t condition, function handler, size_t resume);
+		void operation(uint8_t opcode, const Word *word, function handler, cell operand, size_t next);
+		void instruction(size_t index);
+	public:
+		Generator(const Layout &_layout, const ThreadedCode &_code);
+		~Generator();
+		void generate();
+		const Assembler& getAssembler() const;
+};
+
+Generator::Generator(const Layout &_layout, const ThreadedCode &_code):
+	layout(_layout), code(_code), branchCount(0), current(0), slowPathCount(0), exitCount(0), bailCount(0){
+	// Every operation emits at most a few jumps of each kind,
+	// an instruction is up to FUSION_MAX_LENGTH operations
+	size_t operations = code.size() * FUSION_MAX_LENGTH;
+	this->labels = new size_t[code.size() + 1];
+	// Loops emit two branches
+	this->branches = new Branch[code.size() * 2];
+	this->slowPaths = new SlowPath[operations * 2 + 2];
+	this->exits = new size_t[code.size()];
+	this->bails = new size_t[operations * 3 + 2];
+}
+
+Generator::~Generator(){
+	delete [] this->labels;
+	delete [] this->branches;
+	delete [] this->slowPaths;
+	delete [] this->exits;
+	delete [] this->bails;
+}
+
+const Assembler& Generator::getAssembler() const{
+	return this->assembler;
+}
+
+void Generator::slowPath(Condition condition, function handler, size_t resume){
+	SlowPath &path = this->slowPaths[this->slowPathCount++];
+	path.jump = this->assembler.jump(condition);
+	path.handler = handler;
+	path.resume = resume;
+}
+
+void Generator::branch(Condition condition){
+	Branch &branch = this->branches[this->branchCount++];
+	branch.jump = this->assembler.jump(condition);
+	branch.target = this->code.at(this->current).target;
+}
+
+// Fewer than cells values on the data stack
+void Generator::need(int cells, function handler, size_t resume){
+	this->assembler.memory(0x8D, RAX, SP, -8 * cells);
+	this->assembler.registers(0x39, BOTTOM, RAX);
+	this->slowPath(JB, handler, resume);
+}
+
+// Data stack is full
+void Generator::room(function handler, size_t resume){
+	this->assembler.registers(0x39, LIMIT, SP);
+	this->slowPath(JAE, handler, resume);
+}
+
+// Calls target(forth, argument, jit) and returns on error
+void Generator::call(uint64_t target, uint64_t argument, bool hasArgument){
+	this->assembler.memory(0x89, SP, FORTH, this->layout.stackPointer);
+	this->assembler.registers(0x89, FORTH, RDI);
+	if(hasArgument){
+		this->assembler.moveImmediate(RSI, argument);
+		this->assembler.memory(0x8B, RDX, FORTH, this->layout.jit);
+	}
+	this->assembler.moveImmediate(RAX, target);
+	this->assembler.callRax();
+	this->assembler.registers(0x85, RAX, RAX);
+	this->bails[this->bailCount++] = this->assembler.jump(JNE);
+	this->assembler.memory(0x8B, SP, FORTH, this->layout.stackPointer);
+}
+
+// [sp - 16] = [sp - 16] op [sp - 8]
+void Generator::binary(uint8_t opcode, function handler, size_t resume){
+	this->need(2, handler, resume);
+	this->assembler.memory(0x8B, RAX, SP, -8);
+	this->assembler.memory(opcode, RAX, SP, -16);
+	this->assembler.immediate(5, SP, 8);
+}
+
+// [sp - 16] = [sp - 16] cond [sp - 8] ? -1 : 0
+void Generator::compare(uint8_t condition, function handler, size_t resume){
+	this->need(2, handler, resume);
+	this->assembler.memory(0x8B, RAX, SP, -16);
+	this->assembler.memory(0x3B, RAX, SP, -8);
+	// setcc al; movzx eax, al; neg rax
+	this->assembler.byte(0x0F);
+	this->assembler.byte(condition);
+	this->assembler.byte(0xC0);
+	this->assembler.byte(0x0F);
+	this->assembler.byte(0xB6);
+	this->assembler.byte(0xC0);
+	this->assembler.byte(0x48);
+	this->assembler.byte(0xF7);
+	this->assembler.byte(0xD8);
+	this->assembler.memory(0x89, RAX, SP, -16);
+	this->assembler.immediate(5, SP, 8);
+}
+
+// Emits one operation, word is only needed for calls to other words
+void Generator::operation(uint8_t opcode, const Word *word, function handler, cell operand, size_t next){
+	switch(opcode){
+		case OPCODE_LIT:
+			this->room(pushLiteral, next);
+			this->assembler.moveImmediate(RAX, (uint64_t)operand);
+			this->assembler.memory(0x89, RAX, SP, 0);
+			this->assembler.immediate(0, SP, 8);
+			break;
+		case OPCODE_BRANCH:
+			this->branch(JMP);
+			break;
+		case OPCODE_BRANCH0:
+			this->need(1, drop, next);
+			this->assembler.immediate(5, SP, 8);
+			this->assembler.memory(0x8B, RAX, SP, 0);
+			this->assembler.registers(0x85, RAX, RAX);
+			this->branch(JE);
+			break;
+		case OPCODE_EXIT:
+			this->exits[this->exitCount++] = this->assembler.jump(JMP);
+			break;
+		case OPCODE_DROP:
+			this->need(1, handler, next);
+			this->assembler.immediate(5, SP, 8);
+			break;
+		case OPCODE_DUP:
+			this->need(1, handler, next);
+			this->room(handler, next);
+			this->assembler.memory(0x8B, RAX, SP, -8);
+			this->assembler.memory(0x89, RAX, SP, 0);
+			this->assembler.immediate(0, SP, 8);
+			break;
+		case OPCODE_SWAP:
+			this->need(2, handler, next);
+			this->assembler.memory(0x8B, RAX, SP, -8);
+			this->assembler.memory(0x8B, RCX, SP, -16);
+			this->assembler.memory(0x89, RCX, SP, -8);
+			this->assembler.memory(0x89, RAX, SP, -16);
+			break;
+		case OPCODE_OVER:
+			this->need(2, handler, next);
+			this->room(handler, next);
+			this->assembler.memory(0x8B, RAX, SP, -16);
+			this->assembler.memory(0x89, RAX, SP, 0);
+			this->assembler.immediate(0, SP, 8);
+			break;
+		case OPCODE_ADD:
+			this->binary(0x01, handler, next);
+			break;
+		case OPCODE_SUB:
+			this->binary(0x29, handler, next);
+			break;
+		case OPCODE_AND:
+			this->binary(0x21, handler, next);
+			break;
+		case OPCODE_OR:
+			this->binary(0x09, handler, next);
+			break;
+		case OPCODE_XOR:
+			this->binary(0x31, handler, next);
+			break;
+		case OPCODE_MUL:
+			this->need(2, handler, next);
+			this->assembler.memory(0x8B, RAX, SP, -16);
+			this->assembler.memory(0xAF, RAX, SP, -8);
+			this->assembler.memory(0x89, RAX, SP, -16);
+			this->assembler.immediate(5, SP, 8);
+			break;
+		case OPCODE_EQ:
+			this->compare(0x94, handler, next);
+			break;
+		case OPCODE_LT:
+			this->compare(0x9C, handler, next);
+			break;
+		case OPCODE_NOT:
+			this->need(1, handler, next);
+			// not qword [sp - 8]
+			this->assembler.memory(0xF7, 2, SP, -8);
+			break;
+		case OPCODE_TRUE:
+		case OPCODE_FALSE:
+			this->room(handler, next);
+			// mov qword [sp], imm32
+			this->assembler.memory(0xC7, 0, SP, 0);
+			this->assembler.dword(opcode == OPCODE_TRUE ? 0xFFFFFFFF : 0);
+			this->assembler.immediate(0, SP, 8);
+			break;
+		case OPCODE_FETCH:
+			this->need(1, handler, next);
+			this->assembler.memory(0x8B, RAX, SP, -8);
+			this->assembler.memory(0x8B, RAX, RAX, 0);
+			this->assembler.memory(0x89, RAX, SP, -8);
+			break;
+		case OPCODE_STORE:
+			this->need(2, handler, next);
+			this->assembler.memory(0x8B, RAX, SP, -8);
+			this->assembler.memory(0x8B, RCX, SP, -16);
+			this->assembler.memory(0x89, RCX, RAX, 0);
+			this->assembler.immediate(5, SP, 16);
+			break;
+		case OPCODE_DO:
+			// The loop frame is ours (see analyse), leave is never compiled,
+			// so the leave address is not needed in native code
+			this->need(2, popLoopArguments, NO_RESUME);
+			this->assembler.memory(0x8B, RAX, FORTH, this->layout.returnStackPointer);
+			this->assembler.memory(0x8B, RCX, FORTH, this->layout.returnStackSize);
+			this->assembler.shiftLeft(RCX, 3);
+			this->assembler.memory(0x03, RCX, FORTH, this->layout.returnStackBottom);
+			this->assembler.memory(0x8D, RDX, RAX, 24);
+			this->assembler.registers(0x39, RCX, RDX);
+			this->slowPath(JA, pushLoopFrame, NO_RESUME);
+			this->assembler.memory(0xC7, 0, RAX, 0);
+			this->assembler.dword(0);
+			this->assembler.memory(0x8B, RCX, SP, -8);
+			this->assembler.memory(0x89, RCX, RAX, 8);
+			this->assembler.memory(0x8B, RCX, SP, -16);
+			this->assembler.memory(0x89, RCX, RAX, 16);
+			this->assembler.memory(0x89, RDX, FORTH, this->layout.returnStackPointer);
+			this->assembler.immediate(5, SP, 16);
+			break;
+		case OPCODE_LOOP:
+			this->assembler.memory(0x8B, RAX, FORTH, this->layout.returnStackPointer);
+			this->assembler.memory(0x8B, RCX, RAX, -16);
+			this->assembler.immediate(0, RCX, 1);
+			this->assembler.memory(0x89, RCX, RAX, -16);
+			this->assembler.memory(0x3B, RCX, RAX, -8);
+			this->branch(JLE);
+			this->assembler.immediate(5, RAX, 24);
+			this->assembler.memory(0x89, RAX, FORTH, this->layout.returnStackPointer);
+			break;
+		case OPCODE_PLUS_LOOP: {
+			size_t negative, done;
+			this->need(1, drop, next);
+			this->assembler.memory(0x8B, RDX, SP, -8);
+			this->assembler.immediate(5, SP, 8);
+			this->assembler.memory(0x8B, RAX, FORTH, this->layout.returnStackPointer);
+			this->assembler.memory(0x8B, RCX, RAX, -16);
+			this->assembler.registers(0x01, RDX, RCX);
+			this->assembler.memory(0x89, RCX, RAX, -16);
+			this->assembler.registers(0x85, RDX, RDX);
+			negative = this->assembler.jump(JS);
+			this->assembler.memory(0x3B, RCX, RAX, -8);
+			this->branch(JLE);
+			done = this->assembler.jump(JMP);
+			this->assembler.bind(negative, this->assembler.position());
+			this->assembler.memory(0x3B, RCX, RAX, -8);
+			this->branch(JGE);
+			this->assembler.bind(done, this->assembler.position());
+			this->assembler.immediate(5, RAX, 24);
+			this->assembler.memory(0x89, RAX, FORTH, this->layout.returnStackPointer);
+			break;
+		}
+		case OPCODE_UNLOOP:
+			this->assembler.memory(0x8B, RAX, FORTH, this->layout.returnStackPointer);
+			this->assembler.immediate(5, RAX, 24);
+			this->assembler.memory(0x89, RAX, FORTH, this->layout.returnStackPointer);
+			break;
+		case OPCODE_RTOP:
+		case OPCODE_J:
+			this->room(handler, next);
+			this->assembler.memory(0x8B, RAX, FORTH, this->layout.returnStackPointer);
+			this->assembler.memory(0x8B, RAX, RAX, opcode == OPCODE_RTOP ? -16 : -40);
+			this->assembler.memory(0x89, RAX, SP, 0);
+			this->assembler.immediate(0, SP, 8);
+			break;
+		case OPCODE_LIT_ADD:
+		case OPCODE_LIT_SUB:
+			// Stack underflow is reported by drop
+			this->need(1, drop, next);
+			this->assembler.moveImmediate(RAX, (uint64_t)operand);
+			this->assembler.memory(opcode == OPCODE_LIT_ADD ? 0x01 : 0x29, RAX, SP, -8);
+			break;
+		case OPCODE_LIT_SHL:
+			this->need(1, drop, next);
+			this->assembler.memory(0x8B, RAX, SP, -8);
+			this->assembler.shiftLeft(RAX, (uint8_t)operand);
+			this->assembler.memory(0x89, RAX, SP, -8);
+			break;
+		case OPCODE_LIT_SHR:
+			this->need(1, drop, next);
+			this->assembler.memory(0x8B, RAX, SP, -8);
+			// Negative values get 2^operand - 1 added, the sign bits shifted right
+			this->assembler.registers(0x89, RAX, RCX);
+			this->assembler.shiftRight(RCX, 63, true);
+			this->assembler.shiftRight(RCX, (uint8_t)(64 - operand), false);
+			this->assembler.registers(0x01, RCX, RAX);
+			this->assembler.shiftRight(RAX, (uint8_t)operand, true);
+			this->assembler.memory(0x89, RAX, SP, -8);
+			break;
+		case OPCODE_NATIVE:
+			this->call((uint64_t)(uintptr_t)word->getNative(), 0, false);
+			break;
+		case OPCODE_CALL:
+			this->call((uint64_t)(uintptr_t)callThreaded, (uint64_t)(uintptr_t)word, true);
+			break;
+		// Native code calls and returns, the return stack holds one frame more
+		case OPCODE_TAIL: {
+			const Word *called = (const Word*)operand;
+			if(called->getOpcode() == OPCODE_NATIVE)
+				this->call((uint64_t)(uintptr_t)called->getNative(), 0, false);
+			else
+				this->call((uint64_t)(uintptr_t)callThreaded, (uint64_t)(uintptr_t)called, true);
+			this->exits[this->exitCount++] = this->assembler.jump(JMP);
+			break;
+		}
+		default:
+			this->call((uint64_t)(uintptr_t)callPrimitive, (uint64_t)(uintptr_t)handler, true);
+			break;
+	}
+}
+
+void Generator::instruction(size_t index){
+	const Instruction &instruction = this->code.at(index);
+	const Word *word = instruction.word;
+	function handler = word->isCompiled() ? NULL : *(const function*)word->getConstCode();
+	const Fusion *fusion = handler ? findFusion(handler) : NULL;
+
+	this->current = index;
+	// Other superinstructions are emitted as their sequences
+	if(fusion && word->getOpcode() != OPCODE_LIT_ADD && word->getOpcode() != OPCODE_LIT_SUB){
+		for(size_t i = 0; i < fusion->length; i++)
+			this->operation(fusion->sequence[i], NULL, findHandler(fusion->sequence[i]),
+				instruction.operand, index + 1);
+		return;
+	}
+	this->operation(word->getOpcode(), word, handler, instruction.operand, index + 1);
+}
+
+void Generator::generate(){
+	Assembler &a = this->assembler;
+	size_t exitLabel, returnLabel, bailLabel;
+
+	// Prologue: save registers and load the data stack
+	a.push(RBX);
+	a.push(R12);
+	a.push(R13);
+	a.push(R14);
+	a.push(R15);
+	a.registers(0x89, RDI, FORTH);
+	a.memory(0x8B, SP, FORTH, this->layout.stackPointer);
+	a.memory(0x8B, BOTTOM, FORTH, this->layout.stackBottom);
+	a.memory(0x8B, LIMIT, FORTH, this->layout.dataSize);
+	a.shiftLeft(LIMIT, 3);
+	a.registers(0x01, BOTTOM, LIMIT);
+
+	// Push the frame cell, like a call from the threaded interpreter
+	a.memory(0x8B, RAX, FORTH, this->layout.returnStackPointer);
+	a.memory(0x8B, RCX, FORTH, this->layout.returnStackSize);
+	a.shiftLeft(RCX, 3);
+	a.memory(0x03, RCX, FORTH, this->layout.returnStackBottom);
+	a.registers(0x39, RCX, RAX);
+	this->slowPath(JAE, pushFrame, NO_RESUME);
+	a.memory(0x8B, RCX, FORTH, this->layout.executing);
+	a.memory(0x89, RCX, RAX, 0);
+	a.immediate(0, RAX, 8);
+	a.memory(0x89, RAX, FORTH, this->layout.returnStackPointer);
+
+	for(size_t i = 0; i < this->code.size(); i++){
+		this->labels[i] = a.position();
+		this->instruction(i);
+	}
+
+	// Epilogue: pop the frame cell and store the data stack
+	exitLabel = a.position();
+	a.memory(0x8B, RAX, FORTH, this->layout.returnStackPointer);
+	a.memory(0x3B, RAX, FORTH, this->layout.returnStackBottom);
+	this->slowPath(JBE, popFrame, NO_RESUME);
+	a.immediate(5, RAX, 8);
+	a.memory(0x89, RAX, FORTH, this->layout.returnStackPointer);
+	a.memory(0x89, SP, FORTH, this->layout.stackPointer);
+	// xor eax, eax
+	a.byte(0x31);
+	a.byte(0xC0);
+	returnLabel = a.position();
+	a.pop(R15);
+	a.pop(R14);
+	a.pop(R13);
+	a.pop(R12);
+	a.pop(RBX);
+	a.byte(0xC3);
+	bailLabel = a.position();
+	// mov eax, 1
+	a.byte(0xB8);
+	a.dword(1);
+	a.bind(a.jump(JMP), returnLabel);
+
+	for(size_t i = 0; i < this->slowPathCount; i++){
+		const SlowPath &path = this->slowPaths[i];
+		a.bind(path.jump, a.position());
+		this->call((uint64_t)(uintptr_t)callPrimitive, (uint64_t)(uintptr_t)path.handler, true);
+		a.bind(a.jump(JMP), path.resume == NO_RESUME ? bailLabel : this->labels[path.resume]);
+	}
+
+	for(size_t i = 0; i < this->branchCount; i++)
+		a.bind(this->branches[i].jump, this->labels[this->branches[i].target]);
+	for(size_t i = 0; i < this->exitCount; i++)
+		a.bind(this->exits[i], exitLabel);
+	for(size_t i = 0; i < this->bailCount; i++)
+		a.bind(this->bails[i], bailLabel);
+}
+
+static int32_t offset(const Forth &forth, const void *field){
+	return (int32_t)((const uint8_t*)field - (const uint8_t*)&forth);
+}
+
+bool Jit::compile(Forth &forth, Word *word, const cell *end){
+	ThreadedCode code;
+	ReturnEffect effect;
+	Layout layout;
+	nativeCode native;
+	void *memory;
+
+	// The word must keep its own frame cell intact and balance the return stack
+	if(!analyseReturnStack(forth, word, end, &effect) || effect.lowest < 1 || effect.exit != 0)
+		return false;
+	if(!code.decode(forth, word, end))
+		return false;
+
+	layout.stackPointer = offset(forth, &forth.stackPointer);
+	layout.stackBottom = offset(forth, &forth.stackBottom);
+	layout.dataSize = offset(forth, &forth.dataSize);
+	layout.returnStackPointer = offset(forth, &forth.returnStackPointer);
+	layout.returnStackBottom = offset(forth, &forth.returnStackBottom);
+	layout.returnStackSize = offset(forth, &forth.returnStackSize);
+	layout.executing = offset(forth, &forth.executing);
+	layout.jit = offset(forth, &forth.jit);
+
+	Generator generator(layout, code);
+	generator.generate();
+	const Assembler &assembler = generator.getAssembler();
+	memory = this->allocate(assembler.position());
+	if(!memory)
+		return false;
+	memcpy(memory, assembler.data(), assembler.position());
+	if(mprotect(this->regions, this->regions->size, PROT_READ | PROT_EXEC))
+		return false;
+
+	// ISO C++ forbids casting an object pointer to a function pointer
+	memcpy(&native, &memory, sizeof(native));
+	word->setNative(native);
+	word->setOpcode(OPCODE_NATIVE);
+	return true;
+}
+
+#else
+
+bool hasJit(){
+	return false;
+}
+
+Jit::Jit(): regions(NULL), error(JIT_ERROR_NONE), cause(NULL){}
+
+Jit::~Jit(){}
+
+void* Jit::allocate(size_t){
+	return NULL;
+}
+
+bool Jit::compile(Forth&, Word*, const cell*){
+	return false;
+}
+
+#endif
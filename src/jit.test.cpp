@@ -0,0 +1,135 @@
+#include "code.cpp"
+#include "jit.cpp"
+#include "minunit.h"
+
+static void jit_run(Forth &forth, const char *program){
+    char *text = strdup(program);
+    FILE *stream = fmemopen(text, strlen(text), "r");
+    forth.setInput(stream);
+    forth.run();
+    fclose(stream);
+    free(text);
+}
+
+MU_TEST(jit_tests_decode){
+    ThreadedCode code;
+    Forth forth(stdin, 1000, 200, 200);
+    run_program(forth, ": t 1 if 2 else 3 then ;");
+
+    const Word *t = forth.find("t", 1);
+    mu_check(code.decode(forth, t));
+    // lit 1 0branch lit 2 branch lit 3 exit
+    mu_check(code.size() == 6);
+    mu_check(code.at(0).hasOperand && code.at(0).operand == 1);
+    mu_check(isBranch(code.at(1).word) && code.at(1).target == 4);
+    mu_check(isBranch(code.at(3).word) && code.at(3).target == 5);
+    mu_check(code.at(4).isTarget && code.at(5).isTarget);
+    mu_check(!code.at(2).isTarget);
+    mu_check(!code.decode(forth, forth.find("dup", 3)));
+}
+
+MU_TEST(jit_tests_compile){
+    Forth forth(stdin, 2000, 200, 200);
+    if(!hasJit())
+        return;
+    forth.setJit(true);
+    mu_check(forth.isJitEnabled());
+    run_program(forth, ": sum 0 swap 1 do i + loop ; : rdrop r> r> drop >r ; "
+        ": do-step r> r> r> 1 + over over < not swap >r swap >r swap >r ; "
+        ": sign dup 0 < if drop -1 else 0 = not if 1 else 0 then then ; "
+        "10 sum 5 fib2 -3 sign 3 sign 0 sign 7 8 = 7 7 = 7 8 < 3 4 * 12 5 and xor "
+        "here @ 100 over ! @ 6 3 - 1 2 swap over dup rot drop not");
+
+    mu_check(forth.find("sum", 3)->getNative());
+    mu_check(forth.find("fib2", 4)->getNative());
+    mu_check(forth.find("sign", 4)->getNative());
+    // Reaches below its own frame: stays threaded
+    mu_check(!forth.find("do-step", 7)->getNative());
+    mu_check(!forth.find("rdrop", 5)->getNative());
+
+    cell expected[] = { 55, 8, -1, 1, 0, 0, -1, -1, 8, 100, 3, 2, 2, ~2 };
+    mu_check(forth.getStackPointer() - forth.getStackBottom() == sizeof(expected) / sizeof(cell));
+    for(size_t i = 0; i < sizeof(expected) / sizeof(cell); i++)
+        mu_check(forth.getStackBottom()[i] == expected[i]);
+    mu_check(forth.getReturnStackPointer() == forth.getReturnStackBottom());
+}
+
+MU_TEST(jit_tests_loops){
+    Forth forth(stdin, 2000, 200, 200);
+    if(!hasJit())
+        return;
+    forth.setJit(true);
+    run_program(forth, loop_program);
+    check_loops(forth);
+    mu_check(forth.find("squares", 7)->getNative());
+    mu_check(forth.find("table", 5)->getNative());
+    mu_check(forth.find("down", 4)->getNative());
+    mu_check(forth.find("find-first", 10)->getNative());
+    // leave jumps through the loop frame
+    mu_check(!forth.find("first", 5)->getNative());
+}
+
+MU_TEST(jit_tests_errors){
+    Forth forth(stdin, 2000, 200, 200);
+    if(!hasJit())
+        return;
+    forth.setJit(true);
+    run_program(forth, ": under drop drop ; : deep 1 under ;");
+    mu_check(forth.find("deep", 4)->getNative());
+
+    bool thrown = false;
+    try{
+        jit_run(forth, "deep");
+    } catch(ForthEmptyStackException &e){
+        thrown = true;
+    }
+    mu_check(thrown);
+    mu_check(forth.getStackPointer() == forth.getStackBottom());
+}
+
+MU_TEST(jit_tests_shared){
+    Forth base(stdin, 2000, 200, 200);
+    if(!hasJit())
+        return;
+    base.setJit(true);
+    run_program(base, ": under drop drop ; : deep 1 under ;");
+    base.freeze();
+
+    // Native code of the shared words runs with the state of the child
+    Forth child(base, stdin, 1000, 200, 200);
+    bool thrown = false;
+    run_text(child, "5 6 deep");
+    mu_check(child.getStackPointer() - child.getStackBottom() == 1 && *child.top() == 5);
+    child.pop();
+    try{
+        jit_run(child, "deep");
+    } catch(ForthEmptyStackException &e){
+        thrown = true;
+    }
+    mu_check(thrown);
+    mu_check(child.getStackPointer() == child.getStackBottom());
+    mu_check(base.getStackPointer() == base.getStackBottom());
+}
+
+MU_TEST(jit_tests_tail_calls){
+    Forth forth(stdin, 2000, 200, 50);
+    if(!hasJit())
+        return;
+    forth.setJit(true);
+    run_program(forth, ": step noinline 1 + ; : twice step step ; : down dup if 1 - recurse then ; 5 twice 100000 down");
+    // Native code calls the tail callee, threaded code jumps to it
+    mu_check(forth.find("twice", 5)->getNative() != NULL);
+    mu_check(forth.find("down", 4)->getNative() == NULL);
+    mu_check(forth.getStackPointer() - forth.getStackBottom() == 2);
+    mu_check(forth.getStackBottom()[0] == 7 && forth.getStackBottom()[1] == 0);
+    mu_check(forth.getReturnStackPointer() == forth.getReturnStackBottom());
+}
+
+MU_TEST_SUITE(jit_tests) {
+    MU_RUN_TEST(jit_tests_decode);
+    MU_RUN_TEST(jit_tests_compile);
+    MU_RUN_TEST(jit_tests_loops);
+    MU_RUN_TEST(jit_tests_errors);
+    MU_RUN_TEST(jit_tests_shared);
+    MU_RUN_TEST(jit_tests_tail_calls);
+}
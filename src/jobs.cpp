@@ -0,0 +1,161 @@
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "jobs.h"
+
+// Captured output of one script
+struct JobResult {
+	char *text;
+	size_t size;
+	bool failed;
+	bool done;
+};
+
+// Scripts shared by the workers, they take the next one under the lock
+struct JobQueue {
+	const JobSettings *settings;
+	// Frozen dictionary all VMs of the scripts share
+	const Forth *base;
+	const char *const *scripts;
+	size_t count;
+	size_t next;
+	JobResult *results;
+	pthread_mutex_t lock;
+	pthread_cond_t finished;
+};
+
+JobSettings::JobSettings(size_t _memorySize, size_t _stackSize, size_t _returnStackSize):
+	memorySize(_memorySize), stackSize(_stackSize), returnStackSize(_returnStackSize),
+	engine(FORTH_ENGINE_INDIRECT), jit(false), fusion(true), hugePages(false), image(NULL){}
+
+static void prepareVm(Forth &forth, const JobSettings &settings){
+	FILE *image;
+	forth.setHugePages(settings.hugePages);
+	forth.setFusion(settings.fusion);
+	forth.setEngine(settings.engine);
+	if(settings.jit)
+		forth.setJit(true);
+	if(!settings.image){
+		forth.addMachineWords();
+		return;
+	}
+	image = fopen(settings.image, "rb");
+	if(!image)
+		throw ForthIllegalArgumentException("jobs: unable to open the image");
+	try{
+		forth.loadImage(image);
+	} catch(...) {
+		fclose(image);
+		throw;
+	}
+	fclose(image);
+}
+
+// Returns true if the script failed
+static bool runScript(const JobSettings &settings, const Forth &base, const char *script, FILE *output){
+	bool failed = false;
+	FILE *in = fopen(script, "r");
+	if(!in){
+		fprintf(output, "Unable to open file %s!\n", script);
+		return true;
+	}
+	try{
+		Forth forth(base, in, settings.memorySize, settings.stackSize, settings.returnStackSize);
+		forth.setHugePages(settings.hugePages);
+		forth.setOutput(output);
+		forth.setErrors(output);
+		forth.run();
+	} catch(ForthException &e) {
+		fprintf(output, "Error: %s\n", e.getCause());
+		failed = true;
+	} catch(...) {
+		fprintf(output, "Error: unexpected exception\n");
+		failed = true;
+	}
+	fclose(in);
+	return failed;
+}
+
+static void* jobWorker(void *argument){
+	JobQueue *queue = (JobQueue*)argument;
+	for(;;){
+		JobResult result;
+		FILE *output;
+		size_t i;
+		pthread_mutex_lock(&queue->lock);
+		i = queue->next;
+		if(i < queue->count)
+			queue->next += 1;
+		pthread_mutex_unlock(&queue->lock);
+		if(i >= queue->count)
+			return NULL;
+
+		result.text = NULL;
+		result.size = 0;
+		output = open_memstream(&result.text, &result.size);
+		result.failed = !output || runScript(*queue->settings, *queue->base, queue->scripts[i], output);
+		if(output)
+			fclose(output);
+		result.done = true;
+
+		pthread_mutex_lock(&queue->lock);
+		queue->results[i] = result;
+		pthread_cond_broadcast(&queue->finished);
+		pthread_mutex_unlock(&queue->lock);
+	}
+}
+
+size_t runJobs(const JobSettings &settings, const char *const *scripts, size_t count,
+		unsigned workers, FILE *output){
+	JobQueue queue;
+	pthread_t *threads;
+	size_t started = 0, failed = 0;
+
+	if(workers == 0)
+		throw ForthIllegalArgumentException("runJobs: at least one worker is needed");
+	if(workers > count)
+		workers = (unsigned)count;
+	// Throws if the image can not be loaded, before any script runs
+	Forth base(NULL, settings.memorySize, settings.stackSize, settings.returnStackSize);
+	prepareVm(base, settings);
+	base.freeze();
+	queue.base = &base;
+	queue.settings = &settings;
+	queue.scripts = scripts;
+	queue.count = count;
+	queue.next = 0;
+	queue.results = new JobResult[count ? count : 1]();
+	pthread_mutex_init(&queue.lock, NULL);
+	pthread_cond_init(&queue.finished, NULL);
+
+	threads = new pthread_t[workers ? workers : 1];
+	for(unsigned i = 0; i < workers; i++){
+		if(pthread_create(&threads[started], NULL, jobWorker, &queue) == 0)
+			started += 1;
+	}
+	// Without threads the scripts still run, one by one
+	if(!started && count)
+		jobWorker(&queue);
+
+	for(size_t i = 0; i < count; i++){
+		pthread_mutex_lock(&queue.lock);
+		while(!queue.results[i].done)
+			pthread_cond_wait(&queue.finished, &queue.lock);
+		pthread_mutex_unlock(&queue.lock);
+		if(queue.results[i].size)
+			fwrite(queue.results[i].text, 1, queue.results[i].size, output);
+		fflush(output);
+		free(queue.results[i].text);
+		if(queue.results[i].failed)
+			failed += 1;
+	}
+
+	for(size_t i = 0; i < started; i++)
+		pthread_join(threads[i], NULL);
+	delete [] threads;
+	pthread_cond_destroy(&queue.finished);
+	pthread_mutex_destroy(&queue.lock);
+	delete [] queue.results;
+	return failed;
+}
@@ -0,0 +1,86 @@
+#include "jobs.cpp"
+#include "minunit.h"
+
+#define JOBS_SCRIPTS 4
+#define JOBS_ROUNDS 10
+
+MU_TEST(jobs_tests_ordered){
+    static const char *sources[JOBS_SCRIPTS] = {
+        "1 2 + show",
+        ": sum 0 swap 1 do i + loop ; 100 sum show",
+        "nosuchword 5 show",
+        "drop"
+    };
+    static const char *expected =
+        "3 (top)\n"
+        "5050 (top)\n"
+        "Unknown word: 'nosuchword'\n5 (top)\n"
+        "Error: pop: data stack empty\n";
+    char names[JOBS_SCRIPTS][32];
+    const char *scripts[JOBS_SCRIPTS * JOBS_ROUNDS + 1];
+    char *text = NULL;
+    size_t size = 0;
+    FILE *output = open_memstream(&text, &size);
+    JobSettings settings(2000, 200, 200);
+    Forth library(stdin, 2000, 200, 200);
+    FILE *image = fopen("jobs-test.image", "wb");
+
+    // The scripts start from an image with stdlib.fth
+    run_program(library, "");
+    library.saveImage(image);
+    fclose(image);
+    settings.image = "jobs-test.image";
+
+    for(size_t i = 0; i < JOBS_SCRIPTS; i++){
+        FILE *file;
+        sprintf(names[i], "jobs-test-%lu.fth", (unsigned long)i);
+        file = fopen(names[i], "w");
+        fputs(sources[i], file);
+        fclose(file);
+    }
+    for(size_t i = 0; i < JOBS_SCRIPTS * JOBS_ROUNDS; i++)
+        scripts[i] = names[i % JOBS_SCRIPTS];
+    scripts[JOBS_SCRIPTS * JOBS_ROUNDS] = "jobs-test-missing.fth";
+
+    // More scripts than workers, they still come out in order
+    mu_check(runJobs(settings, scripts, JOBS_SCRIPTS * JOBS_ROUNDS + 1, 3, output) == JOBS_ROUNDS + 1);
+    fclose(output);
+
+    char *all = new char[JOBS_ROUNDS * strlen(expected) + 64];
+    all[0] = 0;
+    for(size_t i = 0; i < JOBS_ROUNDS; i++)
+        strcat(all, expected);
+    strcat(all, "Unable to open file jobs-test-missing.fth!\n");
+    mu_assert_string_eq(all, text);
+    delete [] all;
+    free(text);
+
+    for(size_t i = 0; i < JOBS_SCRIPTS; i++)
+        remove(names[i]);
+    remove("jobs-test.image");
+
+    bool thrown = false;
+    try{
+        runJobs(settings, scripts, 1, 0, stdout);
+    } catch(ForthIllegalArgumentException &e){
+        thrown = true;
+    }
+    mu_check(thrown);
+}
+
+MU_TEST(jobs_tests_stub){
+    Forth forth(stdin, 2000, 200, 200);
+    bool thrown = false;
+    forth.addMachineWords();
+    try{
+        interpreter_stub(forth);
+    } catch(ForthIllegalStateException &e){
+        thrown = true;
+    }
+    mu_check(thrown);
+}
+
+MU_TEST_SUITE(jobs_tests) {
+    MU_RUN_TEST(jobs_tests_ordered);
+    MU_RUN_TEST(jobs_tests_stub);
+}
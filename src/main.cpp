@@ -1,27 +1,236 @@
 #include "forth.h"
+#include "jobs.h"
+#include "profiler.h"
 #include "words.h"
 
 #include <cstdio>
+#include <cstdlib>
 #include <cstring>
 
-#define MAX_DATA 16384
+// Cells of the dictionary arena, committed as it grows
+#define MAX_DATA 1048576
 #define MAX_STACK 16384
 #define MAX_RETURN 16384
 
+// Writes the profile on any exit from main, while the dictionary still exists
+class ProfileOutput {
+	private:
+		Profiler *profiler;
+		const char *path;
+	public:
+		ProfileOutput(): profiler(NULL), path(NULL) {}
+		~ProfileOutput(){
+			FILE *out;
+			if(!this->profiler)
+				return;
+			this->profiler->stop();
+			out = fopen(this->path, "w");
+			if(out){
+				this->profiler->write(out);
+				fclose(out);
+			} else
+				fprintf(stderr, "Unable to open file %s!\n", this->path);
+			if(this->profiler->getDropped())
+				fprintf(stderr, "Profiler: %lu samples dropped\n", (unsigned long)this->profiler->getDropped());
+			delete this->profiler;
+		}
+		void start(const Forth &forth, const char *_path){
+			this->path = _path;
+			if(!this->profiler)
+				this->profiler = new Profiler(forth);
+			this->profiler->start();
+		}
+};
+
+// --memory, --stack and --return-stack take a number of cells
+static bool isSizeOption(const char *option){
+	return !strcmp(option, "--memory") || !strcmp(option, "--stack") || !strcmp(option, "--return-stack");
+}
+
+// Sizes and huge pages are read before any VM is made
+static bool readSizes(int argc, char **argv, JobSettings &settings){
+	for(int i = 1; i < argc; i++){
+		if(!strcmp(argv[i], "--huge-pages")){
+			settings.hugePages = true;
+			continue;
+		}
+		if(!isSizeOption(argv[i]))
+			continue;
+		char *end = NULL;
+		long size = i + 1 < argc ? strtol(argv[i + 1], &end, 10) : 0;
+		if(!end || *end || size <= 0){
+			printf("Option %s needs a positive number of cells! Exiting!\n", argv[i]);
+			return false;
+		}
+		if(!strcmp(argv[i], "--memory"))
+			settings.memorySize = (size_t)size;
+		else if(!strcmp(argv[i], "--stack"))
+			settings.stackSize = (size_t)size;
+		else
+			settings.returnStackSize = (size_t)size;
+		i += 1;
+	}
+	return true;
+}
+
+// cforth [options] --jobs N file...: every file in a VM of its own
+static int runParallel(int argc, char **argv, JobSettings &settings){
+	const char **scripts = new const char*[argc];
+	size_t count = 0, failed;
+	long workers = 0;
+	for(int i = 1; i < argc; i++){
+		if(!strcmp(argv[i], "--jobs") || !strcmp(argv[i], "--image")){
+			if(i + 1 == argc){
+				printf("Option %s needs an argument! Exiting!\n", argv[i]);
+				delete [] scripts;
+				return 1;
+			}
+			if(!strcmp(argv[i], "--jobs"))
+				workers = strtol(argv[i + 1], NULL, 10);
+			else
+				settings.image = argv[i + 1];
+			i += 1;
+		} else if(isSizeOption(argv[i]))
+			i += 1;
+		else if(!strcmp(argv[i], "--huge-pages"))
+			continue;
+		else if(!strcmp(argv[i], "--no-fuse"))
+			settings.fusion = false;
+		else if(!strcmp(argv[i], "--direct"))
+			settings.engine = FORTH_ENGINE_DIRECT;
+		else if(!strcmp(argv[i], "--cached"))
+			settings.engine = FORTH_ENGINE_CACHED;
+		else if(!strcmp(argv[i], "--jit"))
+			settings.jit = true;
+		else if(!strncmp(argv[i], "-", 1)){
+			printf("Option %s can not be used with --jobs! Exiting!\n", argv[i]);
+			delete [] scripts;
+			return 1;
+		} else
+			scripts[count++] = argv[i];
+	}
+	if(workers <= 0){
+		printf("Option --jobs needs a positive number of workers! Exiting!\n");
+		delete [] scripts;
+		return 1;
+	}
+	try{
+		failed = runJobs(settings, scripts, count, (unsigned)workers, stdout);
+	} catch (ForthException e) {
+		printf("Error: %s\n", e.getCause());
+		failed = 1;
+	}
+	delete [] scripts;
+	return failed ? 1 : 0;
+}
+
 int main(int argc, char **argv){
 	FILE *in;
-    Forth forth(stdin, MAX_DATA, MAX_STACK, MAX_RETURN);
-    forth.addMachineWords();
-	if(argc == 1){
+	int files = 0;
+	bool image = false;
+	const char *savePath = NULL;
+	JobSettings settings(MAX_DATA, MAX_STACK, MAX_RETURN);
+	if(!readSizes(argc, argv, settings))
+		return 1;
+	for(int i = 1; i < argc; i++){
+		if(!strcmp(argv[i], "--jobs"))
+			return runParallel(argc, argv, settings);
+	}
+	Forth forth(stdin, settings.memorySize, settings.stackSize, settings.returnStackSize);
+	ProfileOutput profile;
+	forth.setHugePages(settings.hugePages);
+	// Images bring their own machine words
+	for(int i = 1; i < argc; i++){
+		if(!strcmp(argv[i], "--image"))
+			image = true;
+	}
+	if(!image){
 		try{
-			forth.run();
+			forth.addMachineWords();
 		} catch (ForthException e) {
-			printf("Error: %s", e.getCause());
+			printf("Error: %s\n", e.getCause());
 			return 1;
 		}
-		return 0;
 	}
 	for(int i = 1; i < argc; i++){
+		if(!strcmp(argv[i], "--save-image")){
+			if(i + 1 == argc){
+				printf("Option %s needs a file name! Exiting!\n", argv[i]);
+				return 1;
+			}
+			i += 1;
+			savePath = argv[i];
+			continue;
+		}
+		if(!strcmp(argv[i], "--image")){
+			if(i + 1 == argc){
+				printf("Option %s needs a file name! Exiting!\n", argv[i]);
+				return 1;
+			}
+			i += 1;
+			in = fopen(argv[i], "rb");
+			if(!in){
+				printf("Unable to open file %s! Exiting!\n", argv[i]);
+				return 1;
+			}
+			try{
+				forth.loadImage(in);
+			} catch (ForthException e) {
+				printf("Error: %s\n", e.getCause());
+				fclose(in);
+				return 1;
+			}
+			fclose(in);
+			continue;
+		}
+		if(!strcmp(argv[i], "--profile")){
+			if(i + 1 == argc){
+				printf("Option %s needs a file name! Exiting!\n", argv[i]);
+				return 1;
+			}
+			i += 1;
+			try{
+				profile.start(forth, argv[i]);
+			} catch (ForthException e) {
+				printf("Error: %s\n", e.getCause());
+				return 1;
+			}
+			continue;
+		}
+		if(isSizeOption(argv[i])){
+			i += 1;
+			continue;
+		}
+		if(!strcmp(argv[i], "--huge-pages"))
+			continue;
+		if(!strcmp(argv[i], "--no-fuse")){
+			forth.setFusion(false);
+			continue;
+		}
+		if(!strcmp(argv[i], "--warn")){
+			forth.setWarnings(true);
+			continue;
+		}
+		// Errors are reported and the input goes on, for long-lived interpreters
+		if(!strcmp(argv[i], "--recover")){
+			forth.setRecovery(true);
+			continue;
+		}
+		if(!strcmp(argv[i], "--direct") || !strcmp(argv[i], "--cached") || !strcmp(argv[i], "--jit")){
+			try{
+				if(!strcmp(argv[i], "--direct"))
+					forth.setEngine(FORTH_ENGINE_DIRECT);
+				else if(!strcmp(argv[i], "--cached"))
+					forth.setEngine(FORTH_ENGINE_CACHED);
+				else
+					forth.setJit(true);
+			} catch (ForthException e) {
+				printf("Error: %s\n", e.getCause());
+				return 1;
+			}
+			continue;
+		}
+		files += 1;
 		if(!strncmp(argv[i], "-", 1))
 			in = stdin;
 		else{
@@ -39,5 +248,30 @@ int main(int argc, char **argv){
 			return 1;
 		}
 	}
+	// Saving is the whole job of cforth stdlib.fth --save-image file
+	if(files == 0 && !savePath){
+		try{
+			forth.run();
+		} catch (ForthException e) {
+			printf("Error: %s", e.getCause());
+			return 1;
+		}
+	}
+	// The image is saved once all sources are loaded, wherever the option is
+	if(savePath){
+		in = fopen(savePath, "wb");
+		if(!in){
+			printf("Unable to open file %s! Exiting!\n", savePath);
+			return 1;
+		}
+		try{
+			forth.saveImage(in);
+		} catch (ForthException e) {
+			printf("Error: %s\n", e.getCause());
+			fclose(in);
+			return 1;
+		}
+		fclose(in);
+	}
     return 0;
 }
@@ -0,0 +1,229 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "profiler.h"
+
+#ifdef __unix__
+#include <signal.h>
+#include <sys/time.h>
+#endif
+
+// Profiler the SIGPROF handler samples
+static Profiler *volatile activeProfiler = NULL;
+
+#ifdef __unix__
+static struct sigaction previousAction;
+
+static void profilerSignal(int){
+	Profiler *profiler = activeProfiler;
+	if(profiler)
+		profiler->sample();
+}
+#endif
+
+bool hasProfiler(){
+#ifdef __unix__
+	return true;
+#else
+	return false;
+#endif
+}
+
+Profiler::Profiler(const Forth &_forth): forth(&_forth), used(0), samples(0), dropped(0), running(false){
+	this->buffer = new cell[PROFILER_BUFFER];
+}
+
+Profiler::~Profiler(){
+	this->stop();
+	delete [] this->buffer;
+}
+
+void Profiler::start(unsigned rate){
+#ifdef __unix__
+	struct sigaction action;
+	struct itimerval timer;
+	if(this->running)
+		return;
+	if(activeProfiler)
+		throw ForthIllegalStateException("Profiler: another profiler is running");
+	if(rate == 0 || rate > 1000000)
+		throw ForthIllegalArgumentException("Profiler: rate must be from 1 to 1000000 samples per second");
+	activeProfiler = this;
+	this->running = true;
+
+	memset(&action, 0, sizeof(action));
+	action.sa_handler = profilerSignal;
+	action.sa_flags = SA_RESTART;
+	sigemptyset(&action.sa_mask);
+	sigaction(SIGPROF, &action, &previousAction);
+
+	timer.it_interval.tv_sec = 0;
+	timer.it_interval.tv_usec = 1000000 / rate;
+	timer.it_value = timer.it_interval;
+	setitimer(ITIMER_PROF, &timer, NULL);
+#else
+	(void)rate;
+	throw ForthIllegalStateException("Profiler: not supported on this platform");
+#endif
+}
+
+void Profiler::stop(){
+#ifdef __unix__
+	struct itimerval timer;
+	if(!this->running)
+		return;
+	memset(&timer, 0, sizeof(timer));
+	setitimer(ITIMER_PROF, &timer, NULL);
+	sigaction(SIGPROF, &previousAction, NULL);
+	activeProfiler = NULL;
+	this->running = false;
+#endif
+}
+
+bool Profiler::isRunning() const{
+	return this->running;
+}
+
+// Runs in the signal handler: no allocation, no locks, only copying
+void Profiler::sample(){
+	const cell *bottom = this->forth->getReturnStackBottom();
+	const cell *top = this->forth->getReturnStackPointer();
+	size_t depth, at = this->used;
+	if(top < bottom)
+		top = bottom;
+	// The innermost frames are kept when the stack is too deep
+	if(top - bottom > PROFILER_DEPTH)
+		bottom = top - PROFILER_DEPTH;
+	depth = (size_t)(top - bottom);
+	if(at + depth + 2 > PROFILER_BUFFER){
+		this->dropped += 1;
+		return;
+	}
+	this->buffer[at] = (cell)depth;
+	this->buffer[at + 1] = (cell)this->forth->getInstructionPointer();
+	for(size_t i = 0; i < depth; i++)
+		this->buffer[at + 2 + i] = bottom[i];
+	this->used = at + depth + 2;
+	this->samples += 1;
+}
+
+size_t Profiler::getSamples() const{
+	return this->samples;
+}
+
+size_t Profiler::getDropped() const{
+	return this->dropped;
+}
+
+// Index of the last word starting at or below address, count if none
+static size_t wordBelow(Word **words, size_t count, cell address){
+	size_t low = 0, high = count;
+	while(low < high){
+		size_t middle = (low + high) / 2;
+		if((cell)words[middle] <= address)
+			low = middle + 1;
+		else
+			high = middle;
+	}
+	return low ? low - 1 : count;
+}
+
+// Compiled word whose body holds the address. Return addresses may be
+// just past the end of the body, so the cell before them is checked.
+static const Word* wordAt(const Forth &forth, Word **words, size_t count, cell address){
+	size_t i = wordBelow(words, count, address);
+	if(i == count || !words[i]->isCompiled() || !forth.inDictionary(address - (cell)sizeof(cell)))
+		return NULL;
+	if(address < (cell)words[i]->getConstCode() || (i + 1 < count && address > (cell)words[i + 1]))
+		return NULL;
+	return words[i];
+}
+
+static bool isWord(Word **words, size_t count, cell address){
+	size_t i = wordBelow(words, count, address);
+	return i < count && (cell)words[i] == address;
+}
+
+static size_t appendFrame(char *line, size_t length, const char *name, size_t nameLength){
+	if(length)
+		line[length++] = ';';
+	for(size_t i = 0; i < nameLength; i++)
+		// ; separates frames in collapsed stacks
+		line[length++] = name[i] == ';' ? '_' : name[i];
+	return length;
+}
+
+static size_t appendWord(char *line, size_t length, const Word *word){
+	return appendFrame(line, length, word->getName(), word->getNameLength());
+}
+
+// Writes the frames of a sample, outermost first, returns the length
+size_t Profiler::collapse(const cell *sample, Word **words, size_t count, char *line) const{
+	size_t depth = (size_t)sample[0];
+	cell ip = sample[1];
+	size_t length = 0;
+	const Word *word;
+	for(size_t i = 0; i < depth; i++){
+		cell frame = sample[2 + i];
+		// A call returns right after the called word, loop frames
+		// and values put with >r do not
+		word = wordAt(*this->forth, words, count, frame);
+		if(word && isWord(words, count, ((const cell*)frame)[-1]) &&
+				((const Word*)((const cell*)frame)[-1])->isCompiled())
+			length = appendWord(line, length, word);
+	}
+	word = wordAt(*this->forth, words, count, ip);
+	if(!word)
+		return appendFrame(line, length, "[interpreter]", strlen("[interpreter]"));
+	length = appendWord(line, length, word);
+	// The primitive being run is the instruction before ip
+	cell previous = ((const cell*)ip)[-1];
+	if(isWord(words, count, previous) && !((const Word*)previous)->isCompiled())
+		length = appendWord(line, length, (const Word*)previous);
+	return length;
+}
+
+static int compareWords(const void *a, const void *b){
+	cell left = (cell)*(Word *const*)a, right = (cell)*(Word *const*)b;
+	return left < right ? -1 : left > right;
+}
+
+static int compareLines(const void *a, const void *b){
+	return strcmp(*(char *const*)a, *(char *const*)b);
+}
+
+void Profiler::write(FILE *output) const{
+	size_t count = 0, lineCount = 0, at = 0;
+	Word **words;
+	char **lines;
+	for(const Word *word = this->forth->getLatest(); word; word = word->getNextWord())
+		count += 1;
+	// Words of a shared dictionary may lie above the own ones
+	words = new Word*[count ? count : 1];
+	count = 0;
+	for(Word *word = this->forth->getLatest(); word; word = word->getNextWord())
+		words[count++] = word;
+	qsort(words, count, sizeof(Word*), compareWords);
+
+	lines = new char*[this->samples ? this->samples : 1];
+	while(at < this->used && lineCount < this->samples){
+		const cell *sample = this->buffer + at;
+		char line[(PROFILER_DEPTH + 2) * (MAX_WORD + 1) + 16];
+		size_t length = this->collapse(sample, words, count, line);
+		lines[lineCount] = new char[length + 1];
+		memcpy(lines[lineCount], line, length);
+		lines[lineCount][length] = 0;
+		lineCount += 1;
+		at += (size_t)sample[0] + 2;
+	}
+	qsort(lines, lineCount, sizeof(char*), compareLines);
+	for(size_t first = 0, j = 0; first < lineCount; first = j){
+		for(j = first; j < lineCount && !strcmp(lines[j], lines[first]); j++)
+			;
+		fprintf(output, "%s %lu\n", lines[first], (unsigned long)(j - first));
+	}
+	for(size_t j = 0; j < lineCount; j++)
+		delete [] lines[j];
+	delete [] lines;
+	delete [] words;
+}
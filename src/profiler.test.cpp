@@ -0,0 +1,58 @@
+#include "profiler.cpp"
+#include "minunit.h"
+
+static Profiler *probed = NULL;
+
+// Takes a sample from inside a word, like the timer does
+static void probe(Forth&){
+    probed->sample();
+}
+
+MU_TEST(profiler_tests_collapse){
+    Forth forth(stdin, 2000, 200, 200);
+    Profiler profiler(forth);
+    char output[256] = { 0 };
+    FILE *file = tmpfile();
+    probed = &profiler;
+    forth.addCodeword("probe", probe);
+    run_program(forth, ": inner 3 1 do probe loop ; : mid noinline 1 inner 2 drop ; : outer mid probe ; outer");
+    mu_check(profiler.getSamples() == 4);
+    mu_check(profiler.getDropped() == 0);
+
+    profiler.write(file);
+    rewind(file);
+    mu_check(fread(output, 1, sizeof(output) - 1, file) > 0);
+    mu_assert_string_eq("outer;mid;inner;probe 3\nouter;probe 1\n", output);
+    fclose(file);
+    probed = NULL;
+}
+
+MU_TEST(profiler_tests_timer){
+    Forth forth(stdin, 2000, 200, 200);
+    Profiler profiler(forth);
+    Profiler other(forth);
+    bool thrown = false;
+    if(!hasProfiler())
+        return;
+    run_program(forth, ": spin 0 100000 1 do i + loop drop ; ");
+    const Word *spin = forth.find("spin", 4);
+    profiler.start(10000);
+    mu_check(profiler.isRunning());
+    try{
+        other.start();
+    } catch(ForthIllegalStateException &e){
+        thrown = true;
+    }
+    mu_check(thrown);
+    // Profiling counts CPU time, so spin until some samples arrive
+    for(size_t i = 0; i < 10000 && profiler.getSamples() < 5; i++)
+        forth.runWord(spin);
+    profiler.stop();
+    mu_check(!profiler.isRunning());
+    mu_check(profiler.getSamples() >= 5);
+}
+
+MU_TEST_SUITE(profiler_tests) {
+    MU_RUN_TEST(profiler_tests_collapse);
+    MU_RUN_TEST(profiler_tests_timer);
+}
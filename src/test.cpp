@@ -1,7 +1,19 @@
 #include "forth.test.cpp"
+#include "jit.test.cpp"
+#include "fuse.test.cpp"
+#include "call.test.cpp"
+#include "image.test.cpp"
+#include "profiler.test.cpp"
+#include "jobs.test.cpp"
 
 int main(void) {
 	MU_RUN_SUITE(forth_tests);
+	MU_RUN_SUITE(jit_tests);
+	MU_RUN_SUITE(fuse_tests);
+	MU_RUN_SUITE(call_tests);
+	MU_RUN_SUITE(image_tests);
+	MU_RUN_SUITE(profiler_tests);
+	MU_RUN_SUITE(jobs_tests);
 	MU_REPORT();
 	return MU_EXIT_CODE;
 }
@@ -0,0 +1,271 @@
+#include <string.h>
+
+#include "tokenizer.h"
+
+#ifdef __unix__
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+#define TOKENIZER_BUFFER 65536
+
+#if defined(__unix__) && defined(__GLIBC__)
+// _IO_IN_BACKUP of libio: ungetc has pushed back more than the buffer held
+#define STREAM_IN_BACKUP 0x100
+
+// Bytes the stream has read ahead of its descriptor, as gnulib's freadahead
+static size_t readAhead(FILE *stream){
+	size_t count = (size_t)(stream->_IO_read_end - stream->_IO_read_ptr);
+	if(stream->_flags & STREAM_IN_BACKUP)
+		count += (size_t)(stream->_IO_save_end - stream->_IO_save_base);
+	return count;
+}
+#endif
+
+// Whitespace as isspace() sees it in the C locale
+static bool isBlank(unsigned char c){
+	return c == ' ' || (c >= '\t' && c <= '\r');
+}
+
+// Index of the first whitespace at or after position, size if none.
+// Checks a machine word at a time: every byte below 0x21 is a candidate,
+// candidates are then checked one by one.
+static size_t scanToken(const char *data, size_t position, size_t size){
+	const size_t ones = ~(size_t)0 / 255;
+	const size_t highs = ones * 0x80;
+	while(position + sizeof(size_t) <= size){
+		size_t chunk, candidates;
+		memcpy(&chunk, data + position, sizeof(size_t));
+		candidates = (chunk - ones * 0x21) & ~chunk & highs;
+		if(!candidates){
+			position += sizeof(size_t);
+			continue;
+		}
+#if defined(__GNUC__) && defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+		// The lowest candidate is exact, the ones above it may be false
+		if(sizeof(size_t) == sizeof(unsigned long)){
+			size_t first = (size_t)__builtin_ctzl((unsigned long)candidates) / 8;
+			if(isBlank((unsigned char)data[position + first]))
+				return position + first;
+		}
+#endif
+		for(size_t i = 0; i < sizeof(size_t); i++){
+			if(isBlank((unsigned char)data[position + i]))
+				return position + i;
+		}
+		position += sizeof(size_t);
+	}
+	while(position < size && !isBlank((unsigned char)data[position]))
+		position += 1;
+	return position;
+}
+
+Tokenizer::Tokenizer(): input(NULL), data(NULL), size(0), position(0),
+	mapping(NULL), mappingSize(0), buffer(NULL), capacity(0), end(true){}
+
+Tokenizer::~Tokenizer(){
+	this->close();
+	delete [] this->buffer;
+}
+
+void Tokenizer::close(){
+#ifdef __unix__
+	if(this->mapping)
+		munmap(this->mapping, this->mappingSize);
+#endif
+	this->mapping = NULL;
+	this->mappingSize = 0;
+	this->data = NULL;
+	this->size = 0;
+	this->position = 0;
+	this->end = true;
+}
+
+void Tokenizer::open(FILE *_input){
+	this->close();
+	this->input = _input;
+	if(!_input)
+		return;
+	this->end = false;
+	if(this->map())
+		return;
+	if(!this->buffer){
+		this->capacity = TOKENIZER_BUFFER;
+		this->buffer = new char[this->capacity];
+	}
+	this->data = this->buffer;
+}
+
+FILE* Tokenizer::getInput() const{
+	return this->input;
+}
+
+bool Tokenizer::isMapped() const{
+	return this->mapping != NULL;
+}
+
+// Maps a regular file from the current position of the stream to its end
+bool Tokenizer::map(){
+#ifdef __unix__
+	struct stat status;
+	long offset;
+	void *memory;
+	int fd = fileno(this->input);
+	if(fd < 0 || fstat(fd, &status) || !S_ISREG(status.st_mode))
+		return false;
+	offset = ftell(this->input);
+	if(offset < 0 || (size_t)offset >= (size_t)status.st_size)
+		return false;
+#ifdef MAP_POPULATE
+	memory = mmap(NULL, (size_t)status.st_size, PROT_READ, MAP_PRIVATE | MAP_POPULATE, fd, 0);
+#else
+	memory = mmap(NULL, (size_t)status.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+#endif
+	if(memory == MAP_FAILED)
+		return false;
+#ifdef MADV_SEQUENTIAL
+	madvise(memory, (size_t)status.st_size, MADV_SEQUENTIAL);
+#endif
+	this->mapping = memory;
+	this->mappingSize = (size_t)status.st_size;
+	this->data = (const char*)memory;
+	this->size = (size_t)status.st_size;
+	this->position = (size_t)offset;
+	this->end = true;
+	return true;
+#else
+	return false;
+#endif
+}
+
+// Moves the last keep bytes to the start of the buffer and reads more.
+// Returns false at the end of the input.
+// Pipes and terminals are read with read(2), taking whatever is available,
+// once the bytes the stream has buffered already are copied out.
+bool Tokenizer::refill(size_t keep){
+	size_t count = 0;
+	size_t room = this->capacity - keep;
+	if(this->end)
+		return false;
+	memmove(this->buffer, this->buffer + this->size - keep, keep);
+	this->size = keep;
+	this->position = 0;
+#if defined(__unix__) && defined(__GLIBC__)
+	if(fileno(this->input) >= 0){
+		size_t ahead = readAhead(this->input);
+		if(ahead)
+			count = fread(this->buffer + keep, 1, ahead < room ? ahead : room, this->input);
+		else{
+			ssize_t got;
+			do
+				got = read(fileno(this->input), this->buffer + keep, room);
+			while(got < 0 && errno == EINTR);
+			count = got > 0 ? (size_t)got : 0;
+		}
+	} else
+#else
+	// Without a way to see what the stream has buffered: a line at a time,
+	// so terminals do not wait for a full block
+	if(fileno(this->input) >= 0){
+		int c;
+		while(count < room && (c = getc(this->input)) != EOF){
+			this->buffer[keep + count] = (char)c;
+			count += 1;
+			if(c == '\n')
+				break;
+		}
+	} else
+#endif
+		count = fread(this->buffer + keep, 1, room, this->input);
+	if(count == 0)
+		this->end = true;
+	this->size += count;
+	return count > 0;
+}
+
+bool Tokenizer::isReady(){
+	while(this->position < this->size && isBlank((unsigned char)this->data[this->position]))
+		this->position += 1;
+	if(this->position < this->size || this->end)
+		return true;
+#ifdef __unix__
+	if(fileno(this->input) >= 0){
+		struct pollfd descriptor;
+#ifdef __GLIBC__
+		if(readAhead(this->input))
+			return true;
+#endif
+		descriptor.fd = fileno(this->input);
+		descriptor.events = POLLIN;
+		descriptor.revents = 0;
+		if(poll(&descriptor, 1, 0) != 0)
+			return true;
+#ifndef __GLIBC__
+		// The stream may have read ahead of the descriptor
+		int flags = fcntl(descriptor.fd, F_GETFL), c;
+		if(flags < 0)
+			return false;
+		fcntl(descriptor.fd, F_SETFL, flags | O_NONBLOCK);
+		c = getc(this->input);
+		fcntl(descriptor.fd, F_SETFL, flags);
+		if(c != EOF){
+			ungetc(c, this->input);
+			return true;
+		}
+		if(feof(this->input))
+			return true;
+		clearerr(this->input);
+#endif
+		return false;
+	}
+#endif
+	return true;
+}
+
+ForthResult Tokenizer::next(const char **token, size_t *length, size_t maxLength){
+	size_t start, stop;
+	bool tooLong = false;
+
+	for(;;){
+		while(this->position < this->size && isBlank((unsigned char)this->data[this->position]))
+			this->position += 1;
+		if(this->position < this->size)
+			break;
+		if(!this->refill(0)){
+			// Readers of the stream after us go on at its end
+			if(this->mapping)
+				fseek(this->input, (long)this->mappingSize, SEEK_SET);
+			return FORTH_EOF;
+		}
+	}
+
+	start = this->position;
+	stop = scanToken(this->data, start, this->size);
+	// The token may go on in the next block
+	while(stop == this->size && !this->end){
+		size_t keep = stop - start;
+		if(keep > maxLength){
+			// Too long anyway: drop what was read so far
+			tooLong = true;
+			keep = 0;
+		}
+		// The kept bytes are moved to the start even at the end of the input
+		bool more = this->refill(keep);
+		start = 0;
+		if(!more){
+			stop = keep;
+			break;
+		}
+		stop = scanToken(this->data, keep, this->size);
+	}
+	this->position = stop;
+	if(tooLong || stop - start > maxLength)
+		return FORTH_BUFFER_OVERFLOW;
+	*token = this->data + start;
+	*length = stop - start;
+	return FORTH_OK;
+}
@@ -78,10 +78,10 @@ void rot(Forth &forth) {
 void show(Forth &forth) {
     const cell *c = forth.getStackBottom();
     while (c <= forth.top()) {
-        printCell(*c);
+        printCell(forth.getOutput(), *c);
         c += 1;
     }
-    printf("(top)\n");
+    fprintf(forth.getOutput(), "(top)\n");
 }
 
 void over(Forth &forth) {
@@ -150,6 +150,12 @@ void forth_exit(Forth &forth){
 	forth.setInstructionPointer((Word**)forth.popReturn());
 }
 
+// Tail call: the called word returns straight to the caller of this one
+void tail_call(Forth &forth){
+	const Word *word = *(const Word *const*)forth.getInstructionPointer();
+	forth.setInstructionPointer((Word**)(cell)word->getConstCode());
+}
+
 void literal(Forth &forth){
 	cell value = *(const cell*)forth.getInstructionPointer();
 	forth.rewindInstructionPointer(1);
@@ -157,24 +163,69 @@ void literal(Forth &forth){
 }
 
 void compile_start(Forth &forth){
-	char buffer[MAX_WORD+1];
+	const char *name;
 	Word *word;
 	size_t length = 0;
-	readWord(forth.getInput(), buffer, MAX_WORD, &length);
-	if(length == 0)
+	if(forth.readToken(&name, &length) != FORTH_OK || length == 0)
 		throw ForthIllegalStateException("compile_start: failed to read word");
-	word = forth.addWord(buffer, (uint8_t)length, true);
+	word = forth.addWord(name, (uint8_t)length, true);
 	forth.setCompiling(true);
 	word->setHidden(true);
 }
 
 void compile_end(Forth &forth){
-	const Word *exit = forth.getLatest()->find("exit", strlen("exit"));
+	const Word *exit = forth.find("exit", strlen("exit"));
+	Word *word = forth.getLatest();
+	if(!word || !word->isCompiled() || !word->isHidden())
+		throw ForthIllegalStateException("compile_end: no word is being defined");
 	if(!exit)
 		throw ForthIllegalStateException("compile_end: exit word not found");
 	forth.emit((cell)exit);
 	forth.setCompiling(false);
-	forth.getLatest()->setHidden(false);
+	word->setHidden(false);
+	forth.finishWord(word);
+}
+
+// Compiles a call to the word being defined, which is hidden until ;
+void recurse(Forth &forth){
+	Word *word = forth.getLatest();
+	if(!word || !word->isCompiled() || !word->isHidden())
+		throw ForthIllegalStateException("recurse: no word is being defined");
+	forth.emit((cell)word);
+}
+
+// marker name defines name, which forgets itself and every word after it
+void marker(Forth &forth){
+	const char *name;
+	size_t length = 0;
+	const Word *tick = forth.find("'", 1);
+	const Word *forget = forth.find("(forget)", strlen("(forget)"));
+	const Word *exit = forth.find("exit", strlen("exit"));
+	Word *word;
+	if(!tick || !forget || !exit)
+		throw ForthIllegalStateException("marker: machine words are missing");
+	if(forth.readToken(&name, &length) != FORTH_OK || length == 0)
+		throw ForthIllegalStateException("marker: failed to read word");
+	word = forth.addWord(name, (uint8_t)length, true);
+	// The address is compiled with ' so images relocate it
+	forth.emit((cell)tick);
+	forth.emit((cell)word);
+	forth.emit((cell)forget);
+	forth.emit((cell)exit);
+}
+
+void forget(Forth &forth){
+	Word *word = (Word*)forth.pop();
+	Word *own = forth.getLatest();
+	ForthMarker marker;
+	// Own words come first in the chain, shared ones are not writable
+	while(own && own != word && forth.isWritable(own))
+		own = own->getNextWord();
+	if(own != word || !forth.isWritable(word))
+		throw ForthIllegalArgumentException("(forget): not a word of this dictionary");
+	marker.latest = word->getNextWord();
+	marker.freeMemory = (cell*)word;
+	forth.rollback(marker);
 }
 
 void rpush(Forth &forth){
@@ -191,13 +242,86 @@ void rtop(Forth &forth){
 	forth.push(forth.getReturnStackPointer()[-2]);
 }
 
+// Counted loops
+// (do) pushes a loop frame to the return stack: the address to leave to,
+// the index and the limit on top, so i reads the index like rtop does.
+// The limit is inclusive: 10 1 do ... loop runs for i from 1 to 10,
+// and the body always runs at least once.
+
+#define LOOP_FRAME 3
+
+static cell* loopFrame(Forth &forth, size_t cells){
+	cell *frame = forth.getReturnStackPointer();
+	if(frame - forth.getReturnStackBottom() < (ptrdiff_t)cells)
+		throw ForthIllegalStateException("loop: not enough values in return stack");
+	return frame;
+}
+
+// Branches back to the loop body or drops the frame and leaves the loop
+static void loopBranch(Forth &forth, bool again){
+	if(again)
+		branch(forth);
+	else {
+		forth.popReturn();
+		forth.popReturn();
+		forth.popReturn();
+		forth.rewindInstructionPointer(1);
+	}
+}
+
+void forth_do(Forth &forth){
+	Word *const *ip = forth.getInstructionPointer();
+	cell start = forth.pop();
+	cell limit = forth.pop();
+	// The operand is the offset to the code after the loop, like in branch
+	forth.pushReturn((cell)(ip + *(const cell*)ip / (cell)sizeof(cell)));
+	forth.pushReturn(start);
+	forth.pushReturn(limit);
+	forth.rewindInstructionPointer(1);
+}
+
+void forth_loop(Forth &forth){
+	cell *frame = loopFrame(forth, LOOP_FRAME);
+	frame[-2] += 1;
+	loopBranch(forth, frame[-2] <= frame[-1]);
+}
+
+// Counts down to the limit for negative steps
+void forth_plus_loop(Forth &forth){
+	cell step = forth.pop();
+	cell *frame = loopFrame(forth, LOOP_FRAME);
+	frame[-2] += step;
+	loopBranch(forth, step < 0 ? frame[-2] >= frame[-1] : frame[-2] <= frame[-1]);
+}
+
+void forth_leave(Forth &forth){
+	cell *frame = loopFrame(forth, LOOP_FRAME);
+	forth.setInstructionPointer((Word**)frame[-3]);
+	forth.popReturn();
+	forth.popReturn();
+	forth.popReturn();
+}
+
+void forth_unloop(Forth &forth){
+	loopFrame(forth, LOOP_FRAME);
+	forth.popReturn();
+	forth.popReturn();
+	forth.popReturn();
+}
+
+// Index of the enclosing loop
+void forth_j(Forth &forth){
+	cell *frame = loopFrame(forth, 2 * LOOP_FRAME);
+	forth.push(frame[-5]);
+}
+
 void rshow(Forth &forth){
 	const cell *c = forth.getReturnStackBottom();
 	while(c < forth.getReturnStackPointer()){
-		printCell(*c);
+		printCell(forth.getOutput(), *c);
 		c += 1;
 	}
-	printf("(r-top)\n");
+	fprintf(forth.getOutput(), "(r-top)\n");
 }
 
 void memory_read(Forth &forth){
@@ -214,6 +338,10 @@ void here(Forth &forth){
 	forth.push((cell)&forth.freeMemory);
 }
 
+void number_base(Forth &forth){
+	forth.push((cell)&forth.base);
+}
+
 void branch(Forth &forth){
 	forth.rewindInstructionPointer((size_t)forth.getInstructionPointer()[0] / sizeof(cell));
 }
@@ -228,21 +356,33 @@ void branch0(Forth &forth){
 }
 
 void immediate(Forth &forth){
+	if(!forth.isWritable(forth.getLatest()))
+		throw ForthIllegalStateException("immediate: the latest word is in a frozen dictionary");
 	forth.getLatest()->setImmediate(!forth.getLatest()->isImmediate());
 }
 
+// Calls to the latest word stay calls, so they show in profiles
+void no_inline(Forth &forth){
+	if(!forth.isWritable(forth.getLatest()))
+		throw ForthIllegalStateException("noinline: the latest word is in a frozen dictionary");
+	forth.getLatest()->setInlinable(false);
+}
+
 void next_word(Forth &forth){
-	size_t length;
-	static char buffer[MAX_WORD + 1];
-	readWord(forth.getInput(), buffer, MAX_WORD + 1, &length);
-	forth.push((cell)buffer);
+	const char *token = NULL;
+	size_t length = 0;
+	if(forth.readToken(&token, &length) != FORTH_OK){
+		token = NULL;
+		length = 0;
+	}
+	forth.push((cell)token);
 	forth.push((cell)length);
 }
 
 void find(Forth &forth){
 	uint8_t length = (uint8_t)forth.pop();
 	const char *name = (const char*)forth.pop();
-	const Word *word = forth.getLatest()->find(name, length);
+	const Word *word = forth.find(name, length);
 	forth.push((cell)word);
 }
 
@@ -256,11 +396,258 @@ void comma(Forth &forth){
 	forth.emit(forth.pop());
 }
 
+// Array words: ranges of cells given as (addr count) on top of the stack.
+// One word replaces a whole loop of @ and ! in the inner interpreter.
+// The kernels are plain counted loops over unsigned cells, so the
+// arithmetic wraps around and the compiler can vectorise them.
+
+#if defined(__GNUC__) && !defined(__clang__)
+// -O2 of older GCC does not vectorise loops that need a check for
+// overlapping arrays or a scalar tail
+#define VECTORIZE __attribute__((optimize("tree-vectorize", "vect-cost-model=dynamic")))
+#else
+#define VECTORIZE
+#endif
+
+static cell* popRange(Forth &forth, size_t *count, const char *name){
+	cell length = forth.pop();
+	cell *address = (cell*)forth.pop();
+	if(length < 0)
+		throw ForthIllegalArgumentException(name);
+	*count = (size_t)length;
+	return address;
+}
+
+VECTORIZE static uintptr_t sumKernel(const uintptr_t *data, size_t count){
+	uintptr_t sum = 0;
+	for(size_t i = 0; i < count; i++)
+		sum += data[i];
+	return sum;
+}
+
+VECTORIZE static uintptr_t dotKernel(const uintptr_t *a, const uintptr_t *b, size_t count){
+	uintptr_t sum = 0;
+	for(size_t i = 0; i < count; i++)
+		sum += a[i] * b[i];
+	return sum;
+}
+
+VECTORIZE static cell minKernel(const cell *data, size_t count){
+	cell result = data[0];
+	for(size_t i = 1; i < count; i++)
+		result = data[i] < result ? data[i] : result;
+	return result;
+}
+
+VECTORIZE static cell maxKernel(const cell *data, size_t count){
+	cell result = data[0];
+	for(size_t i = 1; i < count; i++)
+		result = data[i] > result ? data[i] : result;
+	return result;
+}
+
+VECTORIZE static void fillKernel(cell *data, size_t count, cell value){
+	for(size_t i = 0; i < count; i++)
+		data[i] = value;
+}
+
+VECTORIZE static void addKernel(uintptr_t *data, size_t count, uintptr_t value){
+	for(size_t i = 0; i < count; i++)
+		data[i] += value;
+}
+
+VECTORIZE static void mulKernel(uintptr_t *data, size_t count, uintptr_t value){
+	for(size_t i = 0; i < count; i++)
+		data[i] *= value;
+}
+
+VECTORIZE static void addArraysKernel(uintptr_t *to, const uintptr_t *from, size_t count){
+	for(size_t i = 0; i < count; i++)
+		to[i] += from[i];
+}
+
+VECTORIZE static void mulArraysKernel(uintptr_t *to, const uintptr_t *from, size_t count){
+	for(size_t i = 0; i < count; i++)
+		to[i] *= from[i];
+}
+
+// Every sum depends on the one before, so this one stays scalar
+static void scanKernel(uintptr_t *data, size_t count){
+	uintptr_t sum = 0;
+	for(size_t i = 0; i < count; i++){
+		sum += data[i];
+		data[i] = sum;
+	}
+}
+
+void array_fill(Forth &forth){
+	size_t count;
+	cell *data = popRange(forth, &count, "array-fill: negative count");
+	fillKernel(data, count, forth.pop());
+}
+
+void array_move(Forth &forth){
+	size_t count;
+	cell *to = popRange(forth, &count, "array-move: negative count");
+	const cell *from = (const cell*)forth.pop();
+	memmove(to, from, count * sizeof(cell));
+}
+
+void array_sum(Forth &forth){
+	size_t count;
+	const cell *data = popRange(forth, &count, "array-sum: negative count");
+	forth.push((cell)sumKernel((const uintptr_t*)data, count));
+}
+
+void array_min(Forth &forth){
+	size_t count;
+	const cell *data = popRange(forth, &count, "array-min: negative count");
+	if(!count)
+		throw ForthIllegalArgumentException("array-min: empty range");
+	forth.push(minKernel(data, count));
+}
+
+void array_max(Forth &forth){
+	size_t count;
+	const cell *data = popRange(forth, &count, "array-max: negative count");
+	if(!count)
+		throw ForthIllegalArgumentException("array-max: empty range");
+	forth.push(maxKernel(data, count));
+}
+
+void array_dot(Forth &forth){
+	size_t count;
+	const cell *b = popRange(forth, &count, "array-dot: negative count");
+	const cell *a = (const cell*)forth.pop();
+	forth.push((cell)dotKernel((const uintptr_t*)a, (const uintptr_t*)b, count));
+}
+
+void array_add(Forth &forth){
+	size_t count;
+	cell *data = popRange(forth, &count, "array-add: negative count");
+	addKernel((uintptr_t*)data, count, (uintptr_t)forth.pop());
+}
+
+void array_mul(Forth &forth){
+	size_t count;
+	cell *data = popRange(forth, &count, "array-mul: negative count");
+	mulKernel((uintptr_t*)data, count, (uintptr_t)forth.pop());
+}
+
+void arrays_add(Forth &forth){
+	size_t count;
+	cell *to = popRange(forth, &count, "arrays-add: negative count");
+	const cell *from = (const cell*)forth.pop();
+	addArraysKernel((uintptr_t*)to, (const uintptr_t*)from, count);
+}
+
+void arrays_mul(Forth &forth){
+	size_t count;
+	cell *to = popRange(forth, &count, "arrays-mul: negative count");
+	const cell *from = (const cell*)forth.pop();
+	mulArraysKernel((uintptr_t*)to, (const uintptr_t*)from, count);
+}
+
+void array_scan(Forth &forth){
+	size_t count;
+	cell *data = popRange(forth, &count, "array-scan: negative count");
+	scanKernel((uintptr_t*)data, count);
+}
+
+// Cooperative tasks
+
+void task_spawn(Forth &forth){
+	forth.spawn((const Word*)forth.pop());
+}
+
+void task_pause(Forth &forth){
+	forth.pause();
+}
+
+void task_join(Forth &forth){
+	forth.join();
+}
+
+// Superinstructions, see fuse.cpp
+
+void lit_add(Forth &forth){
+	cell value = *(const cell*)forth.getInstructionPointer();
+	forth.rewindInstructionPointer(1);
+	forth.push(forth.pop() + value);
+}
+
+void lit_sub(Forth &forth){
+	cell value = *(const cell*)forth.getInstructionPointer();
+	forth.rewindInstructionPointer(1);
+	forth.push(forth.pop() - value);
+}
+
+void dup_mul(Forth &forth){
+	cell a = forth.pop();
+	forth.push(a * a);
+}
+
+void over_add(Forth &forth){
+	cell *top = forth.top();
+	if(top - 1 < forth.getStackBottom())
+		throw ForthIllegalStateException("over: not enough values in data stack");
+	top[0] += top[-1];
+}
+
+void two_dup(Forth &forth){
+	cell *top = forth.top();
+	cell a, b;
+	if(top - 1 < forth.getStackBottom())
+		throw ForthIllegalStateException("over: not enough values in data stack");
+	a = top[-1];
+	b = top[0];
+	forth.push(a);
+	forth.push(b);
+}
+
+void lt_not(Forth &forth){
+	cell a, b;
+	b = forth.pop();
+	a = forth.pop();
+	forth.push(a < b ? 0 : -1);
+}
+
+void swap_rpush(Forth &forth){
+	cell a, b;
+	b = forth.pop();
+	a = forth.pop();
+	forth.push(b);
+	forth.pushReturn(a);
+}
+
+void rpop3(Forth &forth){
+	forth.push(forth.popReturn());
+	forth.push(forth.popReturn());
+	forth.push(forth.popReturn());
+}
+
+// Multiplication and division by 2^operand, see foldConstants in fuse.cpp.
+// Division rounds towards zero like /, so negative values are biased first.
+
+void lit_shl(Forth &forth){
+	cell bits = *(const cell*)forth.getInstructionPointer();
+	forth.rewindInstructionPointer(1);
+	forth.push((cell)((uintptr_t)forth.pop() << bits));
+}
+
+void lit_shr(Forth &forth){
+	cell bits = *(const cell*)forth.getInstructionPointer();
+	cell a;
+	forth.rewindInstructionPointer(1);
+	a = forth.pop();
+	forth.push((a < 0 ? a + ((cell)1 << bits) - 1 : a) >> bits);
+}
+
 void next(Forth &forth){
 	forth.rewindInstructionPointer(1);
 }
 
+// Reached only when a word returns past the frame the interpreter pushed
 void interpreter_stub(Forth&){
-	printf("ERROR: return stack underflow (must return to interpreter)\n");
-	exit(2);
+	throw ForthIllegalStateException("interpret: return stack underflow (must return to interpreter)");
 }